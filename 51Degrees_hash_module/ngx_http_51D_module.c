@@ -27,6 +27,9 @@
 #include <ngx_rbtree.h>
 #include <ngx_string.h>
 #include <inttypes.h>
+#if (NGX_ZLIB)
+#include <zlib.h>
+#endif
 #include "src/hash/hash.h"
 #undef MAP_TYPE
 #include "src/hash/fiftyone.h"
@@ -64,13 +67,12 @@
 #define FIFTYONE_DEGREES_VALUE_SEPARATOR (u_char*) ","
 #endif
 
-#ifndef FIFTYONE_DEGREES_MAX_STRING
-/** 
- * Maximum value string being returned.
- * The biggest Javascript is 11666 so choose a number
- * that is reasonably bigger than as as max length
+#ifndef FIFTYONE_DEGREES_VALUE_BUFFER_SIZE
+/**
+ * Initial size of the buffer a value string is built in. The buffer grows to
+ * fit longer values, such as Javascript.
  */
-#define FIFTYONE_DEGREES_MAX_STRING 20000
+#define FIFTYONE_DEGREES_VALUE_BUFFER_SIZE 256
 #endif
 
 #ifndef FIFTYONE_DEGREES_MAX_PROPS_STRING
@@ -96,6 +98,41 @@
  */
 #define FIFTYONE_DEGREES_MEMORY_ADJUSTMENT 1.1
 
+/**
+ * Where the data set does not change once loaded, it is allocated from an
+ * arena of the total size of its allocations instead of the slab pool.
+ * Anything which does not fit in the arena, for example where the data file
+ * is loaded again from disk rather than from memory, is allocated from the
+ * slab pool, so the zone is given an extra 1/this of the arena's size for
+ * it.
+ */
+#define FIFTYONE_DEGREES_ARENA_PADDING 64
+
+/**
+ * When the data file is reloaded in the background, the new data set is
+ * loaded into the shared memory zone before the old one is freed. The zone
+ * is made this many times larger to hold both, with room for the data file
+ * to grow.
+ */
+#define FIFTYONE_DEGREES_RELOAD_MEMORY_ADJUSTMENT 2.5
+
+#ifndef FIFTYONE_DEGREES_THREAD_CONCURRENCY
+/**
+ * Default for 51D_thread_concurrency, the number of matches a worker process
+ * performs in its thread pool at once. This is the number of threads in
+ * nginx's default thread pool.
+ */
+#define FIFTYONE_DEGREES_THREAD_CONCURRENCY 32
+#endif
+
+#ifndef FIFTYONE_DEGREES_THREAD_CONCURRENCY_MAX
+/**
+ * Largest value of 51D_thread_concurrency.
+ */
+#define FIFTYONE_DEGREES_THREAD_CONCURRENCY_MAX 512
+#endif
+
+
 /**
  * True constant.
  */
@@ -111,6 +148,63 @@
  */
 #define FIFTYONE_DEGREES_CONFIG_LEVELS 3
 
+#ifndef FIFTYONE_DEGREES_CACHE_ZONE_VALUE_SIZE
+/**
+ * Default maximum size of a value held in the shared result cache zone, set
+ * with the value_size parameter of 51D_cache_zone. Longer values are not held
+ * in the zone.
+ */
+#define FIFTYONE_DEGREES_CACHE_ZONE_VALUE_SIZE 232
+#endif
+
+/**
+ * Number of slots in each bucket of the shared result cache zone.
+ */
+#define FIFTYONE_DEGREES_CACHE_ZONE_WAYS 4
+
+#ifndef FIFTYONE_DEGREES_CONNECTION_CACHE_SIZE
+/**
+ * Number of header values held for each connection by 51D_connection_cache.
+ * The requests on a connection nearly always carry the same evidence, so
+ * only the values of the headers set for it are needed.
+ */
+#define FIFTYONE_DEGREES_CONNECTION_CACHE_SIZE 8
+#endif
+
+#ifndef FIFTYONE_DEGREES_RESP_HEADER_CACHE_SIZE
+/**
+ * Number of sets of response header values held in each worker process,
+ * keyed on the matched profiles. The SetHeader values only vary with the
+ * browser and platform, so few are needed.
+ */
+#define FIFTYONE_DEGREES_RESP_HEADER_CACHE_SIZE 64
+#endif
+
+#ifndef FIFTYONE_DEGREES_JAVASCRIPT_CACHE_SIZE
+/**
+ * Number of Javascript bodies held in each worker process for the
+ * 51D_get_javascript_* directives, keyed on the matched profiles.
+ */
+#define FIFTYONE_DEGREES_JAVASCRIPT_CACHE_SIZE 16
+#endif
+
+/**
+ * FNV-1a offset basis used to start the hashes of evidence and headers.
+ */
+#define FIFTYONE_DEGREES_HASH_OFFSET 14695981039346656037ULL
+
+/**
+ * FNV-1a prime used to hash evidence and headers.
+ */
+#define FIFTYONE_DEGREES_HASH_PRIME 1099511628211ULL
+
+/**
+ * Multiplier of the keyed hash which verifies the entries found in the
+ * result caches. It is unrelated to the FNV-1a prime, so inputs whose FNV-1a
+ * keys collide do not also collide in the keyed hash.
+ */
+#define FIFTYONE_DEGREES_CHECK_PRIME 0x9E3779B97F4A7C15ULL
+
 /**
  * Global module declaration.
  */
@@ -167,6 +261,28 @@ static char *ngx_http_51D_set_srv(ngx_conf_t* cf, ngx_command_t *cmd, void *conf
  * Forward declaration of #ngx_http_51D_set_main.
  */
 static char *ngx_http_51D_set_main(ngx_conf_t* cf, ngx_command_t *cmd, void *conf);
+/**
+ * Forward declaration of #ngx_http_51D_set_cache.
+ */
+static char *ngx_http_51D_set_cache(ngx_conf_t* cf, ngx_command_t *cmd, void *conf);
+/**
+ * Forward declaration of #ngx_http_51D_set_cache_zone.
+ */
+static char *ngx_http_51D_set_cache_zone(ngx_conf_t* cf, ngx_command_t *cmd, void *conf);
+/**
+ * Forward declaration of #ngx_http_51D_set_auto_reload.
+ */
+static char *ngx_http_51D_set_auto_reload(ngx_conf_t* cf, ngx_command_t *cmd, void *conf);
+#if (NGX_THREADS)
+/**
+ * Forward declaration of #ngx_http_51D_set_thread_pool.
+ */
+static char *ngx_http_51D_set_thread_pool(ngx_conf_t* cf, ngx_command_t *cmd, void *conf);
+#endif
+/**
+ * Forward declaration of #ngx_http_51D_add_variables.
+ */
+static ngx_int_t ngx_http_51D_add_variables(ngx_conf_t *cf);
 
 // Request handler declaration.
 /**
@@ -208,14 +324,97 @@ ngx_atomic_t ngx_http_51D_shm_tag = 1;
  */
 ngx_atomic_t *ngx_http_51D_worker_count;
 
+/**
+ * Bump allocator over a single block of the data set's shared memory zone.
+ * The data set does not change once loaded, so memory freed in the arena is
+ * only returned when the zone is discarded.
+ */
+typedef struct {
+	u_char *start; /**< Start of the arena. */
+	u_char *pos;   /**< Start of the free space in the arena. */
+	u_char *last;  /**< Start of the last allocation, which can be freed
+	                    while the data set is loaded, or NULL. */
+	u_char *end;   /**< End of the arena. */
+} ngx_http_51D_arena_t;
+
+/**
+ * Arena the data set is allocated from. Set up by the master process and
+ * inherited by the worker processes.
+ */
+static ngx_http_51D_arena_t ngx_http_51D_arena;
+
+/**
+ * The data set last loaded into a shared memory zone by the master process.
+ * A reload of nginx where the data set's fingerprint is unchanged asks for a
+ * zone of the same name and size, so nginx keeps the zone with the data set
+ * already loaded in it.
+ */
+typedef struct {
+	uint64_t fingerprint; /**< Fingerprint of the data set, or 0 if none. */
+	size_t size;          /**< Size of the zone. */
+	size_t arenaSize;     /**< Size of the arena in the zone. */
+} ngx_http_51D_shm_last_t;
+
+/**
+ * Data set last loaded by the master process.
+ */
+static ngx_http_51D_shm_last_t ngx_http_51D_shm_last;
+
+/**
+ * Identity of the data file on disk, used to notice when it is replaced.
+ */
+typedef struct {
+	ngx_file_uniq_t uniq; /**< Inode of the file. */
+	time_t mtime;         /**< Last modified time. */
+	off_t size;           /**< Size of the file. */
+} ngx_http_51D_file_id_t;
+
+/**
+ * Checksum of the data file last read by the master process, along with the
+ * identity of the file, so that the file is only read again when nginx is
+ * reloaded once it has been replaced.
+ */
+typedef struct {
+	ngx_http_51D_file_id_t id; /**< Identity of the file. */
+	uint64_t checksum;         /**< Checksum of the file, or 0 if none. */
+} ngx_http_51D_file_checksum_t;
+
+/**
+ * Checksum of the data file last read by the master process.
+ */
+static ngx_http_51D_file_checksum_t ngx_http_51D_last_checksum;
+
+/**
+ * State of the background reload of the data file, held in the data set's
+ * shared memory zone so that a respawned worker process carries on from it.
+ */
+typedef struct {
+	ngx_atomic_t generation;       /**< Incremented each time the data set is
+	                                    replaced. */
+	ngx_http_51D_file_id_t loaded; /**< The data file last loaded. */
+	uint64_t checksum;             /**< Checksum of the data file last
+	                                    loaded, 0 if not computed. */
+	ngx_atomic_t running;          /**< Set by the first worker process when
+	                                    it starts a helper process to load
+	                                    the data file, and cleared by the
+	                                    helper when it is done. */
+	ngx_pid_t pid;                 /**< The last helper process started. */
+} ngx_http_51D_reload_sh_t;
+
+/**
+ * Reload state in the data set's shared memory zone.
+ */
+ngx_http_51D_reload_sh_t *ngx_http_51D_reload;
+
 /**
  * Performance profiles.
  */
 typedef enum ngx_http_51D_performance_profile_e ngx_http_51D_performance_profile;
 
 /**
- * Performance profiles enumerator.
- * NOTE: Only in_memory is currently supported.
+ * Performance profiles enumerator. The in_memory profile loads the data set
+ * once into shared memory. The others read it from the file as needed, with
+ * a resource manager in each worker process.
  */
 enum ngx_http_51D_performance_profile_e {
 	ngx_http_51D_profile_in_memory = 1,
@@ -225,6 +424,26 @@ enum ngx_http_51D_performance_profile_e {
 	ngx_http_51D_profile_balanced_temp
 };
 
+/**
+ * Load modes enumerator. Describes how the data set is loaded, as set by
+ * 51D_load_mode.
+ */
+enum ngx_http_51D_load_mode_e {
+	ngx_http_51D_load_mode_copy = 0,
+	ngx_http_51D_load_mode_mmap = 1
+};
+
+/**
+ * Override evidence sources enumerator. Describes where override evidence is
+ * taken from, as set by 51D_overrides.
+ */
+enum ngx_http_51D_overrides_e {
+	ngx_http_51D_overrides_off = 0,
+	ngx_http_51D_overrides_cookie = 1,
+	ngx_http_51D_overrides_query = 2,
+	ngx_http_51D_overrides_all = 3
+};
+
 /**
  * Multi-header detection mode.
  * See `ngx_http_51D_multi_mode_bits` 
@@ -255,6 +474,34 @@ enum ngx_http_51D_multi_mode_masks {
 	ngx_http_51D_multi_mode_mask_non_ua_only  = ((1 << ngx_http_51D_multi_mode_bits_count) - 1) & ~ngx_http_51D_multi_mode_mask_ua_only,
 };
 
+/**
+ * Property type enumerator. Describes whether a property named in a directive
+ * is in the data set, or is one of the match metrics which are computed from
+ * the match itself.
+ */
+typedef enum {
+	ngx_http_51D_property_data = 0,
+	ngx_http_51D_property_iterations,
+	ngx_http_51D_property_drift,
+	ngx_http_51D_property_difference,
+	ngx_http_51D_property_method,
+	ngx_http_51D_property_user_agents,
+	ngx_http_51D_property_matched_nodes,
+	ngx_http_51D_property_device_id
+} ngx_http_51D_property_type;
+
+/**
+ * Property resolved against the data set, so that its value can be fetched
+ * for each request without looking up its name.
+ */
+typedef struct {
+	ngx_http_51D_property_type type; /**< Type of the property. */
+	int requiredPropertyIndex;       /**< Index in the required properties
+	                                      for data set properties, or -1 if
+	                                      the property is not available. */
+	ngx_str_t *name;                 /**< Name of the property. */
+} ngx_http_51D_property_t;
+
 static const char * const NGX_HTTP_51D_HEADER_PREFIX_CLIENT_HINT = "Sec-CH-UA-";
 static const char * const NGX_HTTP_51D_HEADER_USER_AGENT = "User-Agent";
 
@@ -269,13 +516,276 @@ struct ngx_http_51D_data_to_set_t {
     ngx_uint_t propertyCount;               /**< The number of properties in the
                                                  property array. */
     ngx_str_t **property;                   /**< Array of properties to set. */
+    ngx_http_51D_property_t *properties;    /**< Array of the properties
+                                                 resolved against the data
+                                                 set, local to each process. */
     ngx_str_t headerName;                   /**< The header name to set. */
+    ngx_uint_t headerHash;                  /**< Hash of the header name. */
     ngx_str_t lowerHeaderName;              /**< The header name in lower case. */
     ngx_str_t variableName;                 /**< The name of the variable to use
                                                  a User-Agent */
+    uint64_t key;                           /**< Hash of the match mode and
+                                                 properties, identifying the
+                                                 value in the result cache. */
+    ngx_uint_t profileValues;               /**< Whether all the values depend
+                                                 only on the matched profiles,
+                                                 so can be held in the
+                                                 profile cache. */
     ngx_http_51D_data_to_set *next;         /**< The next header in the list. */
 };
 
+/**
+ * Header in the data set which is used as evidence, found from the index of
+ * lower case header names.
+ */
+typedef struct {
+	ngx_uint_t index;           /**< Index in the unique headers. */
+	const char *name;           /**< Name of the header in the data set. */
+	size_t nameLength;          /**< Length of the name. */
+	ngx_uint_t clientHints;     /**< Whether the header is used when matching
+	                                 on User-Agent and Client Hints only. */
+} ngx_http_51D_evidence_header_t;
+
+/**
+ * State of the match for one set of evidence in a request. Headers which use
+ * the same evidence share the state so that the evidence is only collected,
+ * and the detection only performed, once.
+ */
+typedef struct {
+	ngx_http_51D_multi_header_mode multi;  /**< Bit mask: what headers to use. */
+	ngx_str_t *userAgent;                  /**< The User-Agent for single
+	                                            User-Agent matches. */
+	EvidenceKeyValuePairArray *evidence;   /**< The evidence for multiple
+	                                            header matches, or NULL if
+	                                            not yet collected. */
+	uint64_t key;                          /**< Hash of the evidence. */
+	uint64_t check;                        /**< Keyed hash of the evidence,
+	                                            which verifies an entry
+	                                            found on the key. */
+	ngx_uint_t hasKey;                     /**< Whether the key has been
+	                                            computed. */
+	ngx_uint_t hasMatch;                   /**< Whether the detection has been
+	                                            performed for the evidence. */
+	ngx_uint_t overrides;                  /**< Sources of override evidence,
+	                                            see ngx_http_51D_overrides_e. */
+	uint64_t connectionKey;                /**< Hash of the raw evidence,
+	                                            which the connection cache is
+	                                            keyed on. */
+	ngx_uint_t hasConnectionKey;           /**< Whether the connection key
+	                                            has been computed. */
+} ngx_http_51D_match_state_t;
+
+/**
+ * Overridable property in the data set, found from the index of lower case
+ * evidence names.
+ */
+typedef struct {
+	ngx_uint_t index; /**< Index in the overridable properties. */
+	ngx_str_t name;   /**< Name of the cookie or query argument, including the
+	                       51D_ prefix if the data set uses it. */
+} ngx_http_51D_override_t;
+
+/**
+ * Argument in the query string of a request, as it appears in the request.
+ */
+typedef struct {
+	ngx_str_t name;  /**< Name of the argument, still escaped. */
+	ngx_str_t value; /**< Value of the argument, still escaped. */
+} ngx_http_51D_query_arg_t;
+
+#if (NGX_THREADS)
+typedef struct ngx_http_51D_thread_match_s ngx_http_51D_thread_match_t;
+
+/**
+ * Match performed in a thread pool. The results and evidence belong to the
+ * task while it runs, so the thread never shares them with the worker's
+ * event loop. Once the request has taken the results, the match is returned
+ * to the worker's free list to be used again.
+ */
+struct ngx_http_51D_thread_match_s {
+	ResultsHash *results;                /**< Results of the match. */
+	EvidenceKeyValuePairArray *evidence; /**< Copy of the evidence, whose
+	                                          values remain in the request
+	                                          pool. */
+	uint64_t key;                        /**< Key of the evidence, to check
+	                                          the results are for the same
+	                                          evidence when taken. */
+	StatusCode status;                   /**< Status of the match. */
+	ngx_uint_t done;                     /**< Whether the task has
+	                                          completed. */
+	ngx_http_51D_thread_match_t *next;   /**< Next match in the free
+	                                          list. */
+};
+#endif
+
+/**
+ * Module request context, created the first time it is needed by a request.
+ */
+typedef struct {
+	ngx_array_t *queryArgs; /**< Arguments in the query string, parsed once
+	                             for the request. NULL until parsed. */
+	ngx_str_t *variableValues; /**< Values of the $51D_* variables, indexed
+	                                as the variables. NULL until the first
+	                                is evaluated. */
+	ngx_uint_t variableMulti; /**< Bit mask: the headers modes of the
+	                               variables whose values have been found. */
+	ngx_uint_t matchSequence; /**< Sequence of the match performed for the
+	                               request, which the worker's results hold
+	                               until the next match of any request. 0 if
+	                               no match has been performed. */
+	ngx_http_51D_multi_header_mode matchMulti; /**< Bit mask: what headers
+	                                                the match used. */
+	ngx_uint_t matchOverrides; /**< Sources of override evidence the match
+	                                used. */
+	ngx_str_t *matchUserAgent; /**< The User-Agent of a single User-Agent
+	                                match. */
+	ngx_str_t *respHeaderValues; /**< Values of the response headers,
+	                                  formatted for the request's last match
+	                                  by the handler. NULL until formatted. */
+	uint64_t profilesKey;   /**< Key of the profiles of the request's last
+	                             match. */
+	ngx_uint_t profilesKeySequence; /**< Sequence of the match the profiles
+	                                     key is for. 0 if it has not been
+	                                     found. */
+	ngx_str_t javascript;   /**< Javascript body formatted by the header
+	                             filter for the body filter. */
+	ngx_uint_t hasJavascript; /**< Whether the Javascript body has been
+	                               formatted. */
+	ngx_uint_t notModified; /**< Whether the Javascript is answered with 304
+	                             Not Modified, so has no body. */
+#if (NGX_THREADS)
+	ngx_http_51D_thread_match_t *threadMatch; /**< Match posted to the
+	                                               thread pool which the
+	                                               request has not yet
+	                                               taken. */
+#endif
+} ngx_http_51D_ctx_t;
+
+/**
+ * Value string being built in a buffer from the request pool. The length is
+ * kept as values are appended, and the buffer grows as needed. The string is
+ * always null terminated.
+ */
+typedef struct {
+	ngx_pool_t *pool;  /**< Pool the buffer is allocated from. */
+	u_char *data;      /**< The buffer, NULL until the first append. */
+	size_t len;        /**< Length of the string in the buffer. */
+	size_t capacity;   /**< Size of the buffer, excluding the terminator. */
+	ngx_uint_t escape; /**< Whether values are escaped as they are
+	                        appended, so they can be set in a header. */
+	ngx_uint_t failed; /**< Whether the buffer could not be allocated. */
+} ngx_http_51D_value_builder_t;
+
+/**
+ * Entry in the detection result cache.
+ */
+typedef struct {
+	ngx_rbtree_node_t node; /**< Node in the tree, keyed on the entry key. */
+	ngx_queue_t queue;      /**< Position in the least recently used queue. */
+	uint64_t key;           /**< Full key of the evidence and header. */
+	uint64_t check;         /**< Keyed hash of the evidence and header,
+	                             compared when the key is found. */
+	ngx_str_t value;        /**< Escaped value string for the header. */
+} ngx_http_51D_cache_node_t;
+
+/**
+ * Detection result cache, local to each process. Holds the escaped value
+ * strings of headers keyed on a hash of the evidence and the header
+ * definition, evicting the least recently used entry when full.
+ */
+typedef struct {
+	ngx_rbtree_t rbtree;              /**< Tree of entries keyed on the key. */
+	ngx_rbtree_node_t sentinel;       /**< Sentinel of the tree. */
+	ngx_queue_t queue;                /**< Entries in use, most recently used
+	                                       first. */
+	ngx_queue_t free;                 /**< Entries not in use. */
+	ngx_http_51D_cache_node_t *nodes; /**< All of the entries. */
+	ngx_uint_t size;                  /**< Number of entries. */
+	ngx_uint_t hits;                  /**< Number of lookups found. */
+	ngx_uint_t misses;                /**< Number of lookups not found. */
+} ngx_http_51D_cache_t;
+
+/**
+ * Slot in the shared result cache zone. A writer makes the sequence odd while
+ * it updates the slot, so a reader which sees an odd or changed sequence
+ * discards what it read instead of taking the zone's lock.
+ */
+typedef struct {
+	ngx_atomic_t seq;   /**< Sequence, odd while the slot is written. */
+	uint64_t key;       /**< Key of the value, 0 if the slot is empty. */
+	uint64_t check;     /**< Keyed hash of the evidence and header, compared
+	                         when the key is found. */
+	size_t len;         /**< Length of the value. */
+	u_char value[1];    /**< Escaped value string, of the value size of the
+	                         zone. */
+} ngx_http_51D_cache_zone_slot_t;
+
+/**
+ * Shared result cache zone, held in its own shared memory zone and used by
+ * all worker processes. Keys map to a bucket of
+ * FIFTYONE_DEGREES_CACHE_ZONE_WAYS slots.
+ */
+typedef struct {
+	ngx_uint_t bucketCount; /**< Number of buckets. */
+	uint64_t seed;          /**< Random seed chosen when the zone is created,
+	                             mixed into the keys and the checks of the
+	                             slots. */
+	size_t valueSize;       /**< Maximum length of a value in a slot. */
+	size_t slotSize;        /**< Size of each slot including its value. */
+	u_char *slots;          /**< All of the slots. */
+} ngx_http_51D_cache_zone_sh_t;
+
+/**
+ * Header value held for a connection, keyed on the raw evidence of the
+ * request and the header.
+ */
+typedef struct {
+	uint64_t key;    /**< Key of the evidence and header, 0 if unused. */
+	ngx_str_t value; /**< Escaped value string, in the connection's pool. */
+	size_t size;     /**< Size of the memory the value is held in, which is
+	                      reused by the values which replace it. */
+} ngx_http_51D_connection_value_t;
+
+/**
+ * Header values held for a connection by 51D_connection_cache. This is the
+ * data of a cleanup of the connection's pool, which is how the cache of a
+ * connection is found. The values are held in the connection's pool, and
+ * each value's memory is reused by the values which replace it, so the
+ * pool only grows with the longest value held.
+ */
+typedef struct {
+	ngx_pool_t *pool;             /**< Pool of the connection. */
+	ngx_atomic_uint_t generation; /**< Generation of the data set the values
+	                                   are from. */
+	ngx_uint_t next;              /**< Index of the value to replace next. */
+	ngx_http_51D_connection_value_t values[
+		FIFTYONE_DEGREES_CONNECTION_CACHE_SIZE]; /**< Values held. */
+} ngx_http_51D_connection_cache_t;
+
+/**
+ * Values of all the response headers to set for the matched profiles. The
+ * values are held in the same block of memory as the entry.
+ */
+typedef struct {
+	uint64_t key;       /**< Hash of the matched profiles. */
+	ngx_str_t *values;  /**< Value of each response header to set, or NULL
+	                         if the entry is empty. */
+} ngx_http_51D_resp_header_entry_t;
+
+/**
+ * Javascript body for the matched profiles, with its gzip encoding. The
+ * strings are held in the same block of memory as the entry, which is freed
+ * when neither the table nor any request refers to it.
+ */
+typedef struct {
+	uint64_t key;       /**< Hash of the matched profiles and the body. */
+	ngx_uint_t refs;    /**< Number of references from the table and the
+	                         requests sending the body. */
+	ngx_str_t identity; /**< The body without encoding. */
+	ngx_str_t gzip;     /**< The gzip encoded body, or empty if it could not
+	                         be compressed. */
+} ngx_http_51D_javascript_entry_t;
+
 /**
  * Match config structure set from the config file.
  */
@@ -298,6 +808,20 @@ typedef struct {
 typedef struct {
 	ngx_http_51D_match_conf_t matchConf; /**< The match to carry out in this
 	                                          location. */
+	ngx_uint_t overrides;                /**< Sources of override evidence,
+	                                          see ngx_http_51D_overrides_e. */
+	ngx_str_t javascriptCacheControl;    /**< Cache-Control header value of
+	                                          the Javascript responses, empty
+	                                          if not set. */
+	ngx_flag_t javascriptGzip;           /**< Whether the Javascript is sent
+	                                          gzip encoded to requests which
+	                                          accept it. */
+#if (NGX_THREADS)
+	ngx_thread_pool_t *threadPool;       /**< Thread pool to perform all
+	                                          evidence matches in, or NULL
+	                                          to perform them in the
+	                                          worker. */
+#endif
 } ngx_http_51D_loc_conf_t;
 
 /**
@@ -308,10 +832,29 @@ typedef struct {
 	                                                   initialise the data
 	                                                   set with. */
     ngx_str_t dataFile;                           /**< 51Degrees data file. */
+	ngx_uint_t loadMode;                          /**< How the data file is
+	                                                   loaded, see
+	                                                   ngx_http_51D_load_mode_e. */
+	u_char *dataFileMap;                          /**< The data file mapped
+	                                                   into memory by the
+	                                                   master process, or NULL
+	                                                   once it is copied into
+	                                                   the shared memory
+	                                                   zone. */
+	size_t dataFileMapSize;                       /**< Size of the mapped
+	                                                   data file. */
+	size_t arenaSize;                             /**< Size of the arena the
+	                                                   data set is allocated
+	                                                   from, or 0 if it is
+	                                                   allocated from the slab
+	                                                   pool. */
+	uint64_t dataSetFingerprint;                  /**< Fingerprint of the data
+	                                                   set in the shared memory
+	                                                   zone, or 0 if the zone
+	                                                   is not kept over a
+	                                                   reload. */
 	ResultsHash *results;                         /**< 51Degrees results, local
 	                                                   to each process. */
-	char valueString[FIFTYONE_DEGREES_MAX_STRING]; /**< Result string to hold
-												       return javascript */
 	ResourceManager *resourceManager;             /**< 51Degrees data set,
                                                        shared across all 
                                                        process'. */
@@ -321,6 +864,15 @@ typedef struct {
 	ngx_http_51D_data_to_set *setRespHeader;      /**< Array of headers to set
 													   in the response, local
 													   to each process. */
+	ngx_uint_t setRespHeaderProfileValues;        /**< Whether the values of
+	                                                   all the response
+	                                                   headers depend only on
+	                                                   the matched profiles. */
+	size_t setRespHeaderLength;                   /**< Length of the longest
+	                                                   response header name,
+	                                                   used to skip response
+	                                                   headers which can not
+	                                                   match. */
 	ngx_str_t valueSeparator;                     /**< Match header value
                                                        separator. */
 	ngx_uint_t performanceProfile;                /**< 51Degrees
@@ -329,6 +881,8 @@ typedef struct {
                                                        set. */
 	ngx_uint_t difference;                        /**< 51Degrees difference value
                                                        to set. */
+	ngx_uint_t threadPoolUsed;                    /**< Whether any location
+	                                                   uses 51D_thread_pool. */
 	ngx_uint_t maxConcurrency;                    /**< 51Degrees max concurrency 
                                                        value to set. */
 	ngx_uint_t allowUnmatched;                    /**< 51Degrees flag, whether
@@ -343,12 +897,205 @@ typedef struct {
 	ngx_uint_t respHeadersEnabled;                /**< Whether any
                                                        51D_set_resp_headers
                                                        directive is set to on,
-                                                       requiring all data file
+                                                       requiring the SetHeader
                                                        properties. */
+	ngx_uint_t cacheSize;                         /**< Number of entries in the
+	                                                   result cache, 0 if
+	                                                   disabled. */
+	ngx_http_51D_cache_t *cache;                  /**< Result cache, local to
+	                                                   each process. */
+	uint64_t cacheSeed;                           /**< Random seed of the
+	                                                   keyed hash which
+	                                                   verifies the entries
+	                                                   found in the result
+	                                                   caches, chosen when the
+	                                                   process starts, or the
+	                                                   seed of the shared
+	                                                   result cache zone so
+	                                                   that every process
+	                                                   finds the same
+	                                                   checks. */
+	ngx_uint_t profileCacheSize;                  /**< Number of entries in the
+	                                                   profile cache, 0 if
+	                                                   disabled. */
+	ngx_http_51D_cache_t *profileCache;           /**< Value strings keyed on
+	                                                   the matched profiles,
+	                                                   local to each
+	                                                   process. */
+	ngx_http_51D_resp_header_entry_t *respHeaderCache; /**< Values of the
+	                                                   response headers keyed
+	                                                   on the matched
+	                                                   profiles, local to each
+	                                                   process. NULL if the
+	                                                   headers can not be
+	                                                   cached. */
+	uint64_t dataSetTag;                          /**< Hash of the data set's
+	                                                   header, identifying the
+	                                                   data file in the ETag
+	                                                   of Javascript
+	                                                   responses. */
+	ngx_http_51D_javascript_entry_t **javascriptCache; /**< Javascript
+	                                                   bodies keyed on the
+	                                                   matched profiles, local
+	                                                   to each process. */
+	ngx_uint_t matchSequence;                     /**< Incremented each time
+	                                                   a match replaces the
+	                                                   worker's results. */
+	ngx_flag_t connectionCache;                   /**< Whether the values of
+	                                                   the last requests are
+	                                                   held for each
+	                                                   connection. */
+	ngx_uint_t connectionCacheHits;               /**< Number of lookups found
+	                                                   in the connection
+	                                                   caches by this
+	                                                   process. */
+	ngx_uint_t connectionCacheMisses;             /**< Number of lookups not
+	                                                   found in the connection
+	                                                   caches by this
+	                                                   process. */
+	ngx_msec_t reloadInterval;                    /**< Interval at which the
+	                                                   data file is checked
+	                                                   for changes, 0 if it
+	                                                   is not. */
+	ngx_event_t reloadEvent;                      /**< Timer which checks the
+	                                                   data file, local to
+	                                                   each process. */
+	ngx_http_51D_file_id_t reloadPending;         /**< Changed data file seen
+	                                                   by the last check,
+	                                                   loaded once it stops
+	                                                   changing. */
+	ngx_atomic_uint_t reloadGeneration;           /**< Generation of the data
+	                                                   set used by this
+	                                                   process. */
+	ngx_shm_zone_t *cacheZone;                    /**< Shared memory zone for
+	                                                   the result cache shared
+	                                                   by all processes. */
+	ngx_http_51D_cache_zone_sh_t *cacheZoneSh;    /**< Result cache in the
+	                                                   shared memory zone. */
+	size_t cacheZoneValueSize;                    /**< Maximum length of a
+	                                                   value held in the
+	                                                   shared result cache
+	                                                   zone. */
+	uint64_t cacheZoneSettings;                   /**< Hash of the data file
+	                                                   and the settings which
+	                                                   affect values. */
+	uint64_t cacheZoneFingerprint;                /**< Hash of the settings
+	                                                   and the data set in
+	                                                   use, mixed into the
+	                                                   keys of the shared
+	                                                   result cache. */
+	ngx_uint_t cacheZoneHits;                     /**< Number of lookups found
+	                                                   in the shared result
+	                                                   cache by this process. */
+	ngx_uint_t cacheZoneMisses;                   /**< Number of lookups not
+	                                                   found in the shared
+	                                                   result cache by this
+	                                                   process. */
+	ngx_hash_t evidenceHeaderIndex;               /**< Index of the unique
+	                                                   evidence headers on
+	                                                   their lower case names,
+	                                                   local to each
+	                                                   process. */
+	ngx_http_51D_evidence_header_t *evidenceHeaders; /**< The unique evidence
+	                                                   headers, local to each
+	                                                   process. */
+	ngx_uint_t evidenceHeaderCount;               /**< Number of unique
+	                                                   evidence headers. */
+	u_char *evidenceHeaderFound;                  /**< Flag for each evidence
+	                                                   header, reused by each
+	                                                   match to mark those
+	                                                   found in the request,
+	                                                   local to each
+	                                                   process. */
+	ngx_hash_t overrideIndex;                     /**< Index of the overridable
+	                                                   properties on their
+	                                                   lower case evidence
+	                                                   names, local to each
+	                                                   process. */
+	ngx_http_51D_override_t *overrides;           /**< The overridable
+	                                                   properties, local to
+	                                                   each process. */
+	ngx_uint_t overrideCount;                     /**< Number of overridable
+	                                                   properties. */
+	size_t overrideMaxLength;                     /**< Length of the longest
+	                                                   override evidence
+	                                                   name. */
+	u_char *overrideLowerName;                    /**< Buffer for the lower
+	                                                   case name of a cookie
+	                                                   or query argument,
+	                                                   sized for the longest
+	                                                   override name, local
+	                                                   to each process. */
+	ngx_str_t *overrideValues;                    /**< The override values
+	                                                   found in cookies then
+	                                                   the query string,
+	                                                   reused by each match,
+	                                                   local to each
+	                                                   process. */
+	ngx_pool_t *dataSetPool;                      /**< Pool holding the
+	                                                   indexes built from the
+	                                                   data set, local to each
+	                                                   process. */
+	ngx_atomic_uint_t indexedGeneration;          /**< Generation of the data
+	                                                   set the indexes were
+	                                                   built from. Only valid
+	                                                   if there is a data set
+	                                                   pool. */
+	EvidenceKeyValuePairArray *evidence;          /**< Evidence array reused
+	                                                   by each match, sized
+	                                                   for all the evidence
+	                                                   the data set can use,
+	                                                   local to each
+	                                                   process. */
+	ngx_array_t *dataToSet;                       /**< All of the headers and
+	                                                   bodies set in any
+	                                                   block, so their
+	                                                   properties can be
+	                                                   resolved when the
+	                                                   process starts. */
+	ngx_array_t *variables;                       /**< The $51D_* variables
+	                                                   used in the config,
+	                                                   indexed as their
+	                                                   values in the request
+	                                                   context. */
+	ngx_int_t threadConcurrency;                  /**< Number of matches a
+	                                                   process performs in
+	                                                   its thread pool at
+	                                                   once. */
+#if (NGX_THREADS)
+	ngx_http_51D_thread_match_t *freeThreadMatches; /**< Matches not in use
+	                                                   by a thread pool task,
+	                                                   local to each
+	                                                   process. */
+	ngx_uint_t threadMatchesPosted;               /**< Number of matches in
+	                                                   the thread pool, local
+	                                                   to each process. */
+	ngx_http_51D_thread_match_t *staleThreadMatches; /**< Matches of a
+	                                                   replaced data set,
+	                                                   freed once no matches
+	                                                   are in the thread
+	                                                   pool. */
+	ngx_uint_t threadPoolMatches;                 /**< Number of evidence
+	                                                   matches performed in
+	                                                   the thread pool by
+	                                                   this process. */
+	ngx_uint_t workerMatches;                     /**< Number of evidence
+	                                                   matches performed in
+	                                                   this process. */
+#endif
 	ngx_http_51D_match_conf_t matchConf;          /**< The match to carry out in
 	                                                   this block's locations. */
 } ngx_http_51D_main_conf_t;
 
+/**
+ * Forward declaration of #ngx_http_51D_add_set_header_properties.
+ */
+static ngx_int_t ngx_http_51D_add_set_header_properties(ngx_conf_t *cf, ngx_http_51D_main_conf_t *fdmcf);
+/**
+ * Forward declaration of #ngx_http_51D_get_data_set_fingerprint.
+ */
+static uint64_t ngx_http_51D_get_data_set_fingerprint(ngx_conf_t *cf, ngx_http_51D_main_conf_t *fdmcf);
+
 /**
  * Module server config.
  */
@@ -415,6 +1162,77 @@ report_insufficient_memory_status(
 		"");
 }
 
+/**
+ * Fold the bytes supplied into a FNV-1a hash.
+ * @param hash the hash so far, or FIFTYONE_DEGREES_HASH_OFFSET to start.
+ * @param data the bytes to add to the hash.
+ * @param length the number of bytes.
+ * @return the updated hash.
+ */
+static uint64_t
+ngx_http_51D_hash(uint64_t hash, const void *data, size_t length) {
+	const u_char *p = (const u_char *)data, *end = p + length;
+	while (p < end) {
+		hash ^= *p++;
+		hash *= FIFTYONE_DEGREES_HASH_PRIME;
+	}
+	return hash;
+}
+
+/**
+ * Fold the bytes supplied into the keyed hash which verifies an entry found
+ * in the result caches on its FNV-1a key. Started from the random seed of the
+ * process, evidence can not be chosen so that it collides with other evidence
+ * in both hashes.
+ * @param hash the hash so far, or the seed to start.
+ * @param data the bytes to add to the hash.
+ * @param length the number of bytes.
+ * @return the updated hash.
+ */
+static uint64_t
+ngx_http_51D_check_hash(uint64_t hash, const void *data, size_t length) {
+	const u_char *p = (const u_char *)data, *end = p + length;
+	while (p < end) {
+		hash = (hash ^ *p++) * FIFTYONE_DEGREES_CHECK_PRIME;
+		hash ^= hash >> 32;
+	}
+	return hash;
+}
+
+/**
+ * Whether the data set is loaded by each worker process, rather than once
+ * into the shared memory zone. This is the case for the performance profiles
+ * which read the data file as needed, as the file handles and caches of the
+ * collections can not be shared between processes.
+ * @param fdmcf main configuration
+ * @return 1 if each worker process loads the data set, otherwise 0.
+ */
+static ngx_uint_t
+ngx_http_51D_per_worker(ngx_http_51D_main_conf_t *fdmcf) {
+	return fdmcf->performanceProfile != NGX_CONF_UNSET_UINT &&
+		fdmcf->performanceProfile != ngx_http_51D_profile_in_memory;
+}
+
+/**
+ * Size a collection for a resource manager in each worker process. The
+ * cache capacity of the profile is divided between the processes, but never
+ * made smaller than the concurrency.
+ * @param collection config of the collection.
+ * @param workers number of worker processes.
+ * @param concurrency number of threads in a process which use the collection.
+ */
+static void
+ngx_http_51D_size_collection(
+	CollectionConfig *collection,
+	ngx_uint_t workers,
+	ngx_uint_t concurrency) {
+	collection->concurrency = (uint16_t)concurrency;
+	if (collection->capacity > 0) {
+		collection->capacity = (uint32_t)ngx_max(
+			collection->capacity / workers, concurrency);
+	}
+}
+
 /**
  * Get a fiftyoneDegreesConfigHash instance based on the main configuration
  * @param fdmcf main configuration
@@ -428,22 +1246,18 @@ get_config_hash(ngx_http_51D_main_conf_t *fdmcf) {
 		case ngx_http_51D_profile_in_memory:
 			config = HashInMemoryConfig;
 			break;
-		// Only support the in_memory performance profile
-		// as Nginx is meant to be used in a high performance
-		// environment.
-		//
-		// case ngx_http_51D_profile_high_performance:
-		// 	config = HashHighPerformanceConfig;
-		// 	break;
-		// case ngx_http_51D_profile_low_memory:
-		// 	config = HashLowMemoryConfig;
-		// 	break;
-		// case ngx_http_51D_profile_balanced:
-		// 	config = HashBalancedConfig;
-		// 	break;
-		// case ngx_http_51D_profile_balanced_temp:
-		// 	config = HashBalancedTempConfig;
-		// 	break;
+		case ngx_http_51D_profile_high_performance:
+			config = HashHighPerformanceConfig;
+			break;
+		case ngx_http_51D_profile_low_memory:
+			config = HashLowMemoryConfig;
+			break;
+		case ngx_http_51D_profile_balanced:
+			config = HashBalancedConfig;
+			break;
+		case ngx_http_51D_profile_balanced_temp:
+			config = HashBalancedTempConfig;
+			break;
 		default:
 			// Default to the in_memory profile
 			config = HashInMemoryConfig;
@@ -460,8 +1274,28 @@ get_config_hash(ngx_http_51D_main_conf_t *fdmcf) {
 		config.difference = fdmcf->difference;
 	}
 
-	// Max concurrency is always set to the number of worker processes
-	if (fdmcf->maxConcurrency != NGX_CONF_UNSET_UINT) {
+	// A resource manager in each worker process is only used by that
+	// process, and the threads of its thread pool. The caches of all the
+	// processes share the memory the profile uses for one.
+	if (ngx_http_51D_per_worker(fdmcf)) {
+		ngx_uint_t workers =
+			fdmcf->maxConcurrency != NGX_CONF_UNSET_UINT &&
+			(ngx_int_t)fdmcf->maxConcurrency > 0 ? fdmcf->maxConcurrency : 1;
+		ngx_uint_t concurrency = fdmcf->threadPoolUsed ?
+			(ngx_uint_t)fdmcf->threadConcurrency + 1 : 1;
+		ngx_http_51D_size_collection(&config.strings, workers, concurrency);
+		ngx_http_51D_size_collection(&config.components, workers, concurrency);
+		ngx_http_51D_size_collection(&config.maps, workers, concurrency);
+		ngx_http_51D_size_collection(&config.properties, workers, concurrency);
+		ngx_http_51D_size_collection(&config.values, workers, concurrency);
+		ngx_http_51D_size_collection(&config.profiles, workers, concurrency);
+		ngx_http_51D_size_collection(&config.rootNodes, workers, concurrency);
+		ngx_http_51D_size_collection(&config.nodes, workers, concurrency);
+		ngx_http_51D_size_collection(
+			&config.profileOffsets, workers, concurrency);
+	}
+	// Otherwise max concurrency is set to the number of worker processes
+	else if (fdmcf->maxConcurrency != NGX_CONF_UNSET_UINT) {
 		config.strings.concurrency = fdmcf->maxConcurrency;
 		config.components.concurrency = fdmcf->maxConcurrency;
 		config.maps.concurrency = fdmcf->maxConcurrency;
@@ -478,6 +1312,11 @@ get_config_hash(ngx_http_51D_main_conf_t *fdmcf) {
 		config.b.allowUnmatched = fdmcf->allowUnmatched == 1 ? true : false;
 	}
 
+	// A mapped data file is unmapped by the module, not freed by 51Degrees.
+	if (fdmcf->loadMode == ngx_http_51D_load_mode_mmap) {
+		config.b.b.freeData = false;
+	}
+
 	// Set use performance graph
 	if (fdmcf->usePerformanceGraph != NGX_CONF_UNSET_UINT) {
 		config.usePerformanceGraph = 
@@ -500,54 +1339,407 @@ get_config_hash(ngx_http_51D_main_conf_t *fdmcf) {
  * which the required properties belong to, so initialising the data set
  * with all of its properties makes every match considerably more
  * expensive. All of the data file's properties are initialised when no
- * data set properties are named, or when response headers are enabled,
- * as the SetHeader properties used by 51D_set_resp_headers are discovered
- * from the data file rather than named in directives.
+ * data set properties are named. The SetHeader properties used by
+ * 51D_set_resp_headers are added to the named properties by
+ * ngx_http_51D_add_set_header_properties.
  * @param fdmcf main configuration
  * @return fiftyoneDegreesPropertiesRequired instance
  */
 static PropertiesRequired
 get_properties_hash(ngx_http_51D_main_conf_t *fdmcf) {
 	PropertiesRequired properties = PropertiesDefault;
-	if (fdmcf->properties[0] != '\0' && fdmcf->respHeadersEnabled == 0) {
+	if (fdmcf->properties[0] != '\0') {
 		properties.string = (const char *)fdmcf->properties;
 	}
 	return properties;
 }
 
 /**
- * Module post config. Adds the module to the HTTP access phase array, sets the
- * defaults if necessary, and sets the shared memory zones. Added header and
- * body filter to the filter chain for develiring Javascript content upon
- * requests.
- *
- * This will initialise the main configuration data, including the
- * performanceProfile, drift, difference ...
- *
+ * Get the fingerprint of the data file and the settings which affect the
+ * values returned, so that entries in the shared result cache are only found
+ * when they would give the same values. Entries from a previous data file
+ * are never found, and are replaced over time.
+ * @param cf nginx config.
+ * @param fdmcf module main config.
+ * @return the fingerprint.
+ */
+static uint64_t
+ngx_http_51D_get_fingerprint(ngx_conf_t *cf, ngx_http_51D_main_conf_t *fdmcf)
+{
+	ngx_file_info_t fi;
+	off_t fileSize = 0;
+	time_t fileModified = 0;
+	uint64_t hash = FIFTYONE_DEGREES_HASH_OFFSET;
+
+	if (ngx_file_info(fdmcf->dataFile.data, &fi) != NGX_FILE_ERROR) {
+		fileSize = ngx_file_size(&fi);
+		fileModified = ngx_file_mtime(&fi);
+	}
+	else {
+		ngx_conf_log_error(
+			NGX_LOG_WARN,
+			cf,
+			ngx_errno,
+			ngx_file_info_n " \"%V\" failed",
+			&fdmcf->dataFile);
+	}
+
+	hash = ngx_http_51D_hash(
+		hash, fdmcf->dataFile.data, fdmcf->dataFile.len);
+	hash = ngx_http_51D_hash(hash, &fileSize, sizeof(fileSize));
+	hash = ngx_http_51D_hash(hash, &fileModified, sizeof(fileModified));
+	hash = ngx_http_51D_hash(
+		hash, fdmcf->properties, ngx_strlen(fdmcf->properties));
+	hash = ngx_http_51D_hash(
+		hash, fdmcf->valueSeparator.data, fdmcf->valueSeparator.len);
+	hash = ngx_http_51D_hash(hash, &fdmcf->drift, sizeof(fdmcf->drift));
+	hash = ngx_http_51D_hash(
+		hash, &fdmcf->difference, sizeof(fdmcf->difference));
+	hash = ngx_http_51D_hash(
+		hash, &fdmcf->allowUnmatched, sizeof(fdmcf->allowUnmatched));
+	return hash;
+}
+
+/**
+ * Unmap the data file when the configuration cycle it was mapped for is
+ * freed. Worker processes of the cycle have their own copy of the mapping.
+ * @param data module main config.
+ */
+static void
+ngx_http_51D_unmap_data_file(void *data)
+{
+	ngx_http_51D_main_conf_t *fdmcf = data;
+
+	if (fdmcf->dataFileMap != NULL) {
+		if (munmap(fdmcf->dataFileMap, fdmcf->dataFileMapSize) == -1) {
+			ngx_log_error(
+				NGX_LOG_ALERT,
+				ngx_cycle->log,
+				ngx_errno,
+				"munmap(\"%V\") failed",
+				&fdmcf->dataFile);
+		}
+		fdmcf->dataFileMap = NULL;
+	}
+}
+
+/**
+ * Map the data file into memory, read only and shared, so the data set can
+ * be sized and initialised from it with a single read of the file. With
+ * 51D_load_mode mmap the data set is built over the mapping, otherwise it is
+ * copied into the shared memory zone. The master process maps the file
+ * before the workers are forked, so they all use the same pages of the page
+ * cache.
  * @param cf nginx config.
+ * @param fdmcf module main config.
  * @return ngx_int_t nginx conf status.
  */
 static ngx_int_t
-ngx_http_51D_post_conf(ngx_conf_t *cf)
+ngx_http_51D_map_data_file(ngx_conf_t *cf, ngx_http_51D_main_conf_t *fdmcf)
 {
-	ngx_http_handler_pt *h;
-	ngx_http_core_main_conf_t *cmcf;
-	ngx_http_51D_main_conf_t *fdmcf;
-	ngx_atomic_int_t tagOffset;
-	ngx_str_t resourceManagerName;
+	ngx_fd_t fd;
+	ngx_file_info_t fi;
+	ngx_pool_cleanup_t *cln;
+	u_char *map;
 	size_t size;
 
-	cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
-	fdmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_51D_module);
+	if (fdmcf->dataFileMap != NULL) {
+		return NGX_OK;
+	}
 
-	// set a handler at rewrite phase to perform matching
-	h = ngx_array_push(&cmcf->phases[NGX_HTTP_REWRITE_PHASE].handlers);
-	if (h == NULL) {
+	cln = ngx_pool_cleanup_add(cf->pool, 0);
+	if (cln == NULL) {
+		return NGX_ERROR;
+	}
+
+	fd = ngx_open_file(
+		fdmcf->dataFile.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if (fd == NGX_INVALID_FILE) {
 		ngx_conf_log_error(
-			NGX_LOG_ERR,
+			NGX_LOG_EMERG,
 			cf,
-			0,
-			"51Degrees failed to get a handler entry.");
+			ngx_errno,
+			ngx_open_file_n " \"%V\" failed",
+			&fdmcf->dataFile);
+		return NGX_ERROR;
+	}
+	if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+		ngx_conf_log_error(
+			NGX_LOG_EMERG,
+			cf,
+			ngx_errno,
+			ngx_fd_info_n " \"%V\" failed",
+			&fdmcf->dataFile);
+		ngx_close_file(fd);
+		return NGX_ERROR;
+	}
+	size = (size_t)ngx_file_size(&fi);
+	map = size > 0 ?
+		mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	if (map == MAP_FAILED) {
+		ngx_conf_log_error(
+			NGX_LOG_EMERG,
+			cf,
+			ngx_errno,
+			"mmap(\"%V\") failed",
+			&fdmcf->dataFile);
+		ngx_close_file(fd);
+		return NGX_ERROR;
+	}
+	// The mapping does not need the file to stay open.
+	if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+		ngx_conf_log_error(
+			NGX_LOG_ALERT,
+			cf,
+			ngx_errno,
+			ngx_close_file_n " \"%V\" failed",
+			&fdmcf->dataFile);
+	}
+
+	fdmcf->dataFileMap = map;
+	fdmcf->dataFileMapSize = size;
+	cln->handler = ngx_http_51D_unmap_data_file;
+	cln->data = fdmcf;
+	return NGX_OK;
+}
+
+/**
+ * Total of all the memory allocated while the arena is sized, including
+ * memory which is freed again.
+ */
+static size_t ngx_http_51D_arena_total;
+
+/**
+ * Alloc function used while the arena is sized. Counts the size of each
+ * allocation as it is made in the arena.
+ * @param __size the size of memory to allocate.
+ * @return void* a pointer to the allocated memory.
+ */
+static void *
+ngx_http_51D_arena_count_alloc(size_t __size)
+{
+	ngx_http_51D_arena_total += ngx_align(__size, NGX_ALIGNMENT);
+	return MemoryStandardMalloc(__size);
+}
+
+/**
+ * Alloc aligned function used while the arena is sized. Counts the size of
+ * each allocation, and the most padding its alignment needs in the arena.
+ * @param alignment of the requested memory block
+ * @param __size to be allocated
+ * @return pointer to the allocated memory
+ */
+static void *
+ngx_http_51D_arena_count_alloc_aligned(int alignment, size_t __size)
+{
+	ngx_http_51D_arena_total += __size + alignment;
+	return MemoryStandardMallocAligned(alignment, __size);
+}
+
+/**
+ * Get the size of the arena for a data set built over the mapped data file.
+ * Memory freed in the arena is not reused, so the arena must hold the total
+ * of all the memory allocated while the data set is loaded, not only the
+ * most allocated at once which the 51Degrees library reports. The data set
+ * is built once with allocations counted, then freed.
+ * @param config for the data set.
+ * @param properties required by the data set.
+ * @param fdmcf module main config holding the mapped data file.
+ * @param exception set if the data set could not be built.
+ * @return the size of the arena, or 0 if the data set could not be built.
+ */
+static size_t
+ngx_http_51D_size_arena(
+	ConfigHash *config,
+	PropertiesRequired *properties,
+	ngx_http_51D_main_conf_t *fdmcf,
+	Exception *exception)
+{
+	ResourceManager manager;
+	size_t total;
+
+	ngx_http_51D_arena_total = 0;
+	Malloc = ngx_http_51D_arena_count_alloc;
+	MallocAligned = ngx_http_51D_arena_count_alloc_aligned;
+	fiftyoneDegreesHashInitManagerFromMemory(
+		&manager,
+		config,
+		properties,
+		fdmcf->dataFileMap,
+		(long)fdmcf->dataFileMapSize,
+		exception);
+	if (EXCEPTION_OKAY) {
+		ResourceManagerFree(&manager);
+	}
+	Malloc = MemoryStandardMalloc;
+	MallocAligned = MemoryStandardMallocAligned;
+	total = EXCEPTION_OKAY ? ngx_http_51D_arena_total : 0;
+	ngx_http_51D_arena_total = 0;
+	return total;
+}
+
+/**
+ * Get the size of the shared memory zone for the resource manager. Sizing
+ * the data set also checks the data file, so an error is reported before
+ * the worker processes start.
+ * @param cf nginx config.
+ * @param fdmcf module main config.
+ * @param size set to the size of the zone.
+ * @return ngx_int_t nginx conf status.
+ */
+static ngx_int_t
+ngx_http_51D_size_shm_resource_manager(
+	ngx_conf_t *cf,
+	ngx_http_51D_main_conf_t *fdmcf,
+	size_t *size)
+{
+	// Need to get the size of memory that the resource manager will occupy.
+	ConfigHash config = get_config_hash(fdmcf);
+	PropertiesRequired properties = get_properties_hash(fdmcf);
+
+	EXCEPTION_CREATE
+	if (fdmcf->loadMode == ngx_http_51D_load_mode_mmap) {
+		if (ngx_http_51D_per_worker(fdmcf)) {
+			ngx_conf_log_error(
+				NGX_LOG_EMERG,
+				cf,
+				0,
+				"51D_load_mode mmap requires the IN_MEMORY performance "
+				"profile");
+			return NGX_ERROR;
+		}
+		// A worker could not share a data file it maps itself.
+		if (fdmcf->reloadInterval > 0) {
+			ngx_conf_log_error(
+				NGX_LOG_EMERG,
+				cf,
+				0,
+				"51D_auto_reload can not be used with 51D_load_mode mmap");
+			return NGX_ERROR;
+		}
+		if (ngx_http_51D_map_data_file(cf, fdmcf) != NGX_OK) {
+			return NGX_ERROR;
+		}
+		// Only the structures over the mapped file are in the zone, and
+		// they are allocated from the arena.
+		*size = ngx_http_51D_size_arena(
+			&config, &properties, fdmcf, exception);
+	}
+	else if (ngx_http_51D_per_worker(fdmcf) == 0) {
+		// Read the data file once. The zone is sized from the mapping, and
+		// the data set is then loaded from the same pages in init_module
+		// rather than reading and processing the file again.
+		if (ngx_http_51D_map_data_file(cf, fdmcf) != NGX_OK) {
+			return NGX_ERROR;
+		}
+		*size = fdmcf->reloadInterval == 0 ?
+			ngx_http_51D_size_arena(&config, &properties, fdmcf, exception) :
+			fiftyoneDegreesHashSizeManagerFromMemory(
+				&config,
+				&properties,
+				fdmcf->dataFileMap,
+				(long)fdmcf->dataFileMapSize,
+				exception);
+		// The zone also holds the copy of the data file.
+		if ((int)*size > 0) {
+			*size += fdmcf->dataFileMapSize;
+		}
+	}
+	else {
+		*size = fiftyoneDegreesHashSizeManagerFromFile(
+			&config,
+			&properties,
+			(const char *)fdmcf->dataFile.data,
+			exception);
+	}
+	if ((int)*size < 1 || EXCEPTION_FAILED) {
+		// If there was a problem, throw an error.
+		return report_status(
+			cf->cycle->log,
+			exception->status,
+			(const char *)fdmcf->dataFile.data);
+	}
+	// Each worker process loads the data set itself, so it is not held in
+	// the zone. The data file has still been checked here, so an error is
+	// reported before the workers start.
+	if (ngx_http_51D_per_worker(fdmcf)) {
+		*size = 0;
+	}
+	// A data set which is never replaced is allocated from an arena of the
+	// total size of its allocations. One which is reloaded in the background
+	// must be freed, so it is allocated from the slab pool.
+	else if (fdmcf->reloadInterval == 0) {
+		fdmcf->arenaSize = *size;
+		*size = 0;
+	}
+
+	// Add the size of the resource manager, worker count and reload state.
+	*size += sizeof(ResourceManager) +
+		sizeof(ngx_atomic_t) +
+		sizeof(ngx_http_51D_reload_sh_t);
+
+	// The data is held in shared memory where each object is required
+	// to be power of 2 and minimum of 8 bytes. Non-conforming value
+	// will be rounded up. Thus, adjust the size to cope with cases
+	// where allocated size is rounded up.
+	*size *= FIFTYONE_DEGREES_MEMORY_ADJUSTMENT;
+
+	// Reloading the data file in the background needs room for the old and
+	// new data sets.
+	if (fdmcf->reloadInterval > 0 && ngx_http_51D_per_worker(fdmcf) == 0) {
+		*size *= FIFTYONE_DEGREES_RELOAD_MEMORY_ADJUSTMENT;
+	}
+
+	// The slab pool needs some pages of its own however little is held.
+	if (*size < 8 * ngx_pagesize) {
+		*size = 8 * ngx_pagesize;
+	}
+
+	// The arena is a single allocation of whole pages from the slab pool,
+	// each of which also needs a page descriptor, plus room in the slab pool
+	// for anything which does not fit in the arena.
+	if (fdmcf->arenaSize > 0) {
+		*size += ngx_align(fdmcf->arenaSize, ngx_pagesize) /
+			ngx_pagesize * (ngx_pagesize + sizeof(ngx_slab_page_t)) +
+			fdmcf->arenaSize / FIFTYONE_DEGREES_ARENA_PADDING;
+	}
+
+	return NGX_OK;
+}
+
+/**
+ * Module post config. Adds the module to the HTTP access phase array, sets the
+ * defaults if necessary, and sets the shared memory zones. Added header and
+ * body filter to the filter chain for develiring Javascript content upon
+ * requests.
+ *
+ * This will initialise the main configuration data, including the
+ * performanceProfile, drift, difference ...
+ *
+ * @param cf nginx config.
+ * @return ngx_int_t nginx conf status.
+ */
+static ngx_int_t
+ngx_http_51D_post_conf(ngx_conf_t *cf)
+{
+	ngx_http_handler_pt *h;
+	ngx_http_core_main_conf_t *cmcf;
+	ngx_http_51D_main_conf_t *fdmcf;
+	ngx_atomic_int_t tagOffset;
+	ngx_str_t resourceManagerName;
+	size_t size;
+
+	cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+	fdmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_51D_module);
+
+	// set a handler at rewrite phase to perform matching
+	h = ngx_array_push(&cmcf->phases[NGX_HTTP_REWRITE_PHASE].handlers);
+	if (h == NULL) {
+		ngx_conf_log_error(
+			NGX_LOG_ERR,
+			cf,
+			0,
+			"51Degrees failed to get a handler entry.");
 		return NGX_ERROR;
 	}
 
@@ -559,6 +1751,15 @@ ngx_http_51D_post_conf(ngx_conf_t *cf)
 	ngx_http_next_body_filter = ngx_http_top_body_filter;
 	ngx_http_top_body_filter = ngx_http_51D_body_filter;
 
+	ngx_conf_init_value(
+		fdmcf->threadConcurrency, FIFTYONE_DEGREES_THREAD_CONCURRENCY);
+
+	// Add the $51D_* variables used in the config, so their properties are
+	// initialised with the data set.
+	if (ngx_http_51D_add_variables(cf) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
 	// Set the default value separator if necessary.
 	if ((int)fdmcf->valueSeparator.len <= 0) {
 		fdmcf->valueSeparator.data = FIFTYONE_DEGREES_VALUE_SEPARATOR;
@@ -580,39 +1781,65 @@ ngx_http_51D_post_conf(ngx_conf_t *cf)
 		return NGX_OK;
 	}
 
+	// Add the SetHeader properties used by 51D_set_resp_headers to the named
+	// properties. When none are named all properties are initialised anyway.
+	if (fdmcf->respHeadersEnabled == 1 &&
+		fdmcf->properties[0] != '\0' &&
+		ngx_http_51D_add_set_header_properties(cf, fdmcf) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	// Keys in the shared result cache are specific to this data file and
+	// these settings.
+	if (fdmcf->cacheZone != NULL) {
+		fdmcf->cacheZoneSettings = ngx_http_51D_get_fingerprint(cf, fdmcf);
+	}
+
 	// Initialise the shared memory zone for the resource manager.
 	resourceManagerName.data = (u_char *) "51Degrees Shared Resource Manager";
 	resourceManagerName.len = ngx_strlen(resourceManagerName.data);
-	// By increasing the tag each time, the shared memory zone won't be reused.
-	// Thus, during a reload, the old allocated resources in the shared memory
-	// will be freed automatically.
-	tagOffset = ngx_atomic_fetch_add(&ngx_http_51D_shm_tag, (ngx_atomic_int_t)1);
 
-	// Need to get the size of memory that the resource manager will occupy.
-	ConfigHash config = get_config_hash(fdmcf);
-	PropertiesRequired properties = get_properties_hash(fdmcf);
-
-	EXCEPTION_CREATE
-	size = fiftyoneDegreesHashSizeManagerFromFile(
-		&config,
-		&properties,
-		(const char *)fdmcf->dataFile.data,
-		exception);
-	if ((int)size < 1 || EXCEPTION_FAILED) {
-		// If there was a problem, throw an error.
-		return report_status(
-			cf->cycle->log,
-			exception->status,
-			(const char *)fdmcf->dataFile.data);
+	// A data set copied into the zone is kept over a reload. The zone is
+	// named after the data set's fingerprint and keeps the same tag, so
+	// nginx carries it over where the fingerprint and size are unchanged.
+	// The size is then taken from the last load rather than processing the
+	// data file again. If nginx does not carry the zone over, the data file
+	// is loaded into the new zone by init_module.
+	if (fdmcf->loadMode != ngx_http_51D_load_mode_mmap &&
+		ngx_http_51D_per_worker(fdmcf) == 0) {
+		fdmcf->dataSetFingerprint =
+			ngx_http_51D_get_data_set_fingerprint(cf, fdmcf);
+	}
+	if (fdmcf->dataSetFingerprint != 0) {
+		resourceManagerName.len += sizeof(" 0123456789abcdef") - 1;
+		resourceManagerName.data = ngx_pnalloc(
+			cf->pool, resourceManagerName.len);
+		if (resourceManagerName.data == NULL) {
+			return NGX_ERROR;
+		}
+		ngx_sprintf(
+			resourceManagerName.data,
+			"51Degrees Shared Resource Manager %016xL",
+			fdmcf->dataSetFingerprint);
+		tagOffset = 0;
+	}
+	else {
+		// By increasing the tag each time, the shared memory zone won't be
+		// reused. Thus, during a reload, the old allocated resources in the
+		// shared memory will be freed automatically.
+		tagOffset = ngx_atomic_fetch_add(
+			&ngx_http_51D_shm_tag, (ngx_atomic_int_t)1);
 	}
-	// Add the size of the resource manager and worker count
-	size += sizeof(ResourceManager) + sizeof(ngx_atomic_t);
 
-	// The data is held in shared memory where each object is required
-	// to be power of 2 and minimum of 8 bytes. Non-conforming value
-	// will be rounded up. Thus, adjust the size to cope with cases
-	// where allocated size is rounded up.
-	size *= FIFTYONE_DEGREES_MEMORY_ADJUSTMENT;
+	if (fdmcf->dataSetFingerprint != 0 &&
+		fdmcf->dataSetFingerprint == ngx_http_51D_shm_last.fingerprint) {
+		fdmcf->arenaSize = ngx_http_51D_shm_last.arenaSize;
+		size = ngx_http_51D_shm_last.size;
+	}
+	else if (ngx_http_51D_size_shm_resource_manager(cf, fdmcf, &size) !=
+		NGX_OK) {
+		return NGX_ERROR;
+	}
 
 	ngx_http_51D_shm_resource_manager =
 		ngx_shared_memory_add(
@@ -667,6 +1894,7 @@ ngx_http_51D_create_main_conf(ngx_conf_t *cf)
 	conf->drift = NGX_CONF_UNSET_UINT;
 	conf->difference = NGX_CONF_UNSET_UINT;
 	conf->maxConcurrency = ccf->worker_processes;
+	conf->threadPoolUsed = 0;
 	conf->allowUnmatched = NGX_CONF_UNSET_UINT;
 	conf->usePerformanceGraph = NGX_CONF_UNSET_UINT;
 	conf->usePredictiveGraph = NGX_CONF_UNSET_UINT;
@@ -674,14 +1902,55 @@ ngx_http_51D_create_main_conf(ngx_conf_t *cf)
 	// Init others
 	memset(conf->properties, 0, FIFTYONE_DEGREES_MAX_PROPS_STRING);
     conf->dataFile = (ngx_str_t)ngx_null_string;
+	conf->loadMode = NGX_CONF_UNSET_UINT;
+	conf->dataFileMap = NULL;
+	conf->dataFileMapSize = 0;
+	conf->arenaSize = 0;
+	conf->dataSetFingerprint = 0;
 	conf->results = NULL;
-	memset(conf->valueString, 0, FIFTYONE_DEGREES_MAX_STRING);
 	conf->resourceManager = NULL;
 	conf->setRespHeaderCount = 0;
 	conf->setRespHeader = NULL;
+	conf->setRespHeaderLength = 0;
+	conf->setRespHeaderProfileValues = 0;
+	conf->respHeaderCache = NULL;
+	conf->javascriptCache = NULL;
+	conf->dataSetTag = 0;
 	conf->valueSeparator = (ngx_str_t)ngx_null_string;
 	conf->respHeadersEnabled = 0;
-		
+	conf->cacheSize = 0;
+	conf->cache = NULL;
+	conf->profileCacheSize = 0;
+	conf->profileCache = NULL;
+	conf->connectionCache = NGX_CONF_UNSET;
+	conf->threadConcurrency = NGX_CONF_UNSET;
+	conf->matchSequence = 0;
+	conf->reloadInterval = 0;
+	conf->reloadGeneration = 0;
+	conf->dataSetPool = NULL;
+	conf->indexedGeneration = 0;
+	conf->evidence = NULL;
+	conf->cacheSeed = 0;
+	conf->cacheZone = NULL;
+	conf->cacheZoneSh = NULL;
+	conf->cacheZoneValueSize = 0;
+	conf->cacheZoneSettings = 0;
+	conf->cacheZoneFingerprint = 0;
+	conf->cacheZoneHits = 0;
+	conf->cacheZoneMisses = 0;
+	conf->connectionCacheHits = 0;
+	conf->connectionCacheMisses = 0;
+	conf->dataToSet = ngx_array_create(
+		cf->pool, 4, sizeof(ngx_http_51D_data_to_set *));
+	if (conf->dataToSet == NULL) {
+		return NULL;
+	}
+	conf->variables = ngx_array_create(
+		cf->pool, 4, sizeof(ngx_http_51D_data_to_set *));
+	if (conf->variables == NULL) {
+		return NULL;
+	}
+
 	ngx_http_51D_init_match_conf(&conf->matchConf);
     return conf;
 }
@@ -701,6 +1970,11 @@ ngx_http_51D_create_loc_conf(ngx_conf_t *cf)
         return NULL;
     }
     ngx_http_51D_init_match_conf(&conf->matchConf);
+	conf->overrides = NGX_CONF_UNSET_UINT;
+	conf->javascriptGzip = NGX_CONF_UNSET;
+#if (NGX_THREADS)
+	conf->threadPool = NGX_CONF_UNSET_PTR;
+#endif
 	return conf;
 }
 
@@ -738,6 +2012,18 @@ ngx_http_51D_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 	ngx_conf_merge_uint_value(
 		conf->matchConf.setHeaders, prev->matchConf.setHeaders, NGX_CONF_UNSET_UINT);
 
+	ngx_conf_merge_uint_value(
+		conf->overrides, prev->overrides, ngx_http_51D_overrides_all);
+
+	ngx_conf_merge_str_value(
+		conf->javascriptCacheControl, prev->javascriptCacheControl, "");
+
+	ngx_conf_merge_value(conf->javascriptGzip, prev->javascriptGzip, 0);
+
+#if (NGX_THREADS)
+	ngx_conf_merge_ptr_value(conf->threadPool, prev->threadPool, NULL);
+#endif
+
 	return NGX_CONF_OK;
 }
 
@@ -831,6 +2117,52 @@ void *ngx_http_51D_shm_alloc_aligned(int alignment, size_t __size) {
 	return ngx_http_51D_shm_alloc(actualAllocSize);
 }
 
+/**
+ * Arena alloc function. Replaces fiftyoneDegreesMalloc while the data set is
+ * loaded into the arena. Memory which does not fit in the arena is
+ * allocated from the slab pool.
+ * @param __size the size of memory to allocate.
+ * @return void* a pointer to the allocated memory.
+ */
+static void *
+ngx_http_51D_arena_alloc(size_t __size)
+{
+	ngx_http_51D_arena_t *arena = &ngx_http_51D_arena;
+	u_char *ptr = ngx_align_ptr(arena->pos, NGX_ALIGNMENT);
+	if ((size_t)(arena->end - ptr) < __size) {
+		ngx_log_debug1(
+			NGX_LOG_DEBUG_ALL,
+			ngx_cycle->log,
+			0,
+			"51Degrees arena full, allocating %d from the slab pool",
+			__size);
+		return ngx_http_51D_shm_alloc(__size);
+	}
+	arena->last = ptr;
+	arena->pos = ptr + __size;
+	return ptr;
+}
+
+/**
+ * Arena alloc aligned function. Replaces fiftyoneDegreesMallocAligned while
+ * the data set is loaded into the arena.
+ * @param alignment of the requested memory block
+ * @param __size to be allocated
+ * @return pointer to the allocated memory
+ */
+static void *
+ngx_http_51D_arena_alloc_aligned(int alignment, size_t __size)
+{
+	ngx_http_51D_arena_t *arena = &ngx_http_51D_arena;
+	u_char *ptr = ngx_align_ptr(arena->pos, alignment);
+	if (ptr > arena->end || (size_t)(arena->end - ptr) < __size) {
+		return ngx_http_51D_shm_alloc_aligned(alignment, __size);
+	}
+	arena->last = ptr;
+	arena->pos = ptr + __size;
+	return ptr;
+}
+
 /**
  * Shared memory free function. Replaces fiftyoneDegreesFree to free pointers
  * to the shared memory zone.
@@ -840,7 +2172,17 @@ void ngx_http_51D_shm_free(void *__ptr)
 {
 	ngx_slab_pool_t *shpool;
 	shpool = (ngx_slab_pool_t *) ngx_http_51D_shm_resource_manager->shm.addr;
-	if ((u_char *) __ptr < shpool->start || (u_char *) __ptr > shpool->end) {
+	if ((u_char *) __ptr >= ngx_http_51D_arena.start &&
+		(u_char *) __ptr < ngx_http_51D_arena.end) {
+		// Memory in the arena is only returned when the zone is discarded,
+		// except for the last allocation made while the data set is loaded
+		// which is often a temporary buffer.
+		if ((u_char *) __ptr == ngx_http_51D_arena.last) {
+			ngx_http_51D_arena.pos = ngx_http_51D_arena.last;
+			ngx_http_51D_arena.last = NULL;
+		}
+	}
+	else if ((u_char *) __ptr < shpool->start || (u_char *) __ptr > shpool->end) {
 		// The memory is not in the shared memory pool, so free with standard
 		// free function.
 		ngx_log_debug1(
@@ -862,6 +2204,68 @@ void ngx_http_51D_shm_free(void *__ptr)
 	}
 }
 
+/**
+ * Use the shared memory zone of the data set for the memory allocated and
+ * freed by 51Degrees, holding the zone's lock until ngx_http_51D_shm_leave
+ * is called. This is needed wherever a data set may be created or freed.
+ * Memory outside of the zone is still freed by ngx_http_51D_shm_free.
+ */
+static void
+ngx_http_51D_shm_enter(void)
+{
+	ngx_slab_pool_t *shpool;
+	shpool = (ngx_slab_pool_t *)ngx_http_51D_shm_resource_manager->shm.addr;
+	ngx_shmtx_lock(&shpool->mutex);
+	Malloc = ngx_http_51D_shm_alloc;
+	Free = ngx_http_51D_shm_free;
+	MallocAligned = ngx_http_51D_shm_alloc_aligned;
+	FreeAligned = ngx_http_51D_shm_free;
+}
+
+/**
+ * Reset the memory functions of 51Degrees to the standard ones and release
+ * the lock taken by ngx_http_51D_shm_enter.
+ */
+static void
+ngx_http_51D_shm_leave(void)
+{
+	ngx_slab_pool_t *shpool;
+	shpool = (ngx_slab_pool_t *)ngx_http_51D_shm_resource_manager->shm.addr;
+	Malloc = MemoryStandardMalloc;
+	Free = MemoryStandardFree;
+	MallocAligned = MemoryStandardMallocAligned;
+	FreeAligned = MemoryStandardFreeAligned;
+	ngx_shmtx_unlock(&shpool->mutex);
+}
+
+/**
+ * Use the shared memory zone for the memory freed when results or data sets
+ * are released, if the data set is in the zone. Where each worker process
+ * loads its own data set, its memory is the process's own and the memory
+ * functions are left alone, as thread pool tasks may be allocating with
+ * them.
+ * @param fdmcf module main config.
+ */
+static void
+ngx_http_51D_release_enter(ngx_http_51D_main_conf_t *fdmcf)
+{
+	if (ngx_http_51D_per_worker(fdmcf) == 0) {
+		ngx_http_51D_shm_enter();
+	}
+}
+
+/**
+ * Leave the shared memory zone entered by ngx_http_51D_release_enter.
+ * @param fdmcf module main config.
+ */
+static void
+ngx_http_51D_release_leave(ngx_http_51D_main_conf_t *fdmcf)
+{
+	if (ngx_http_51D_per_worker(fdmcf) == 0) {
+		ngx_http_51D_shm_leave();
+	}
+}
+
 /**
  * Init resource manager memory zone. Allocates space for the resource manager
  * in the shared memory zone.
@@ -877,9 +2281,18 @@ ngx_http_51D_init_shm_resource_manager(ngx_shm_zone_t *shm_zone, void *data)
 	ResourceManager *resourceManager;
 	shpool = (ngx_slab_pool_t *) ngx_http_51D_shm_resource_manager->shm.addr;
 
+	// The zone has been carried over from the previous cycle with the data
+	// set still loaded in it.
+	if (data != NULL) {
+		shm_zone->data = data;
+		return NGX_OK;
+	}
+
 	// Allocate space for the resource manager.
+	// The resource manager is left empty where each worker process loads
+	// the data set.
 	resourceManager = 
-		(ResourceManager *)ngx_slab_alloc(shpool, sizeof(ResourceManager));
+		(ResourceManager *)ngx_slab_calloc(shpool, sizeof(ResourceManager));
 
 	// Set the resource manager as the shared data for this zone.
 	shm_zone->data = resourceManager;
@@ -902,8 +2315,247 @@ ngx_http_51D_init_shm_resource_manager(ngx_shm_zone_t *shm_zone, void *data)
 }
 
 /**
- * Init module function. Initialises the resrouce manager with the given
- * initialisation parameters. Throws an error if the resource manager could
+ * Init shared result cache zone. Allocates all of the slots in the zone and
+ * chooses the seed of its keys. The zone keeps the same tag, so it is carried
+ * over by a reload where its size is unchanged, and the workers of the new
+ * cycle start with a warm cache. The slots of a zone carried over keep the
+ * value size they were created with.
+ * @param shm_zone the shared memory zone.
+ * @param data if the zone has been carried over from a reload, this is the
+ *        old main config.
+ * @return ngx_int_t nginx conf status.
+ */
+static ngx_int_t
+ngx_http_51D_init_cache_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_http_51D_main_conf_t *oldFdmcf = data;
+	ngx_http_51D_main_conf_t *fdmcf = shm_zone->data;
+	ngx_http_51D_cache_zone_sh_t *sh;
+	ngx_slab_pool_t *shpool;
+	size_t bucketSize;
+
+	shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+	if (oldFdmcf != NULL || shm_zone->shm.exists) {
+		sh = oldFdmcf != NULL ? oldFdmcf->cacheZoneSh : shpool->data;
+		fdmcf->cacheZoneSh = sh;
+		if (sh->valueSize != fdmcf->cacheZoneValueSize) {
+			ngx_log_error(
+				NGX_LOG_WARN,
+				shm_zone->shm.log,
+				0,
+				"51Degrees cache zone \"%V\" keeps value_size=%uz until "
+				"it is resized or renamed.",
+				&shm_zone->shm.name,
+				sh->valueSize);
+		}
+		return NGX_OK;
+	}
+
+	sh = (ngx_http_51D_cache_zone_sh_t *)ngx_slab_alloc(
+		shpool, sizeof(ngx_http_51D_cache_zone_sh_t));
+	if (sh == NULL) {
+		return report_insufficient_memory_status(shm_zone->shm.log);
+	}
+
+	sh->seed = ((uint64_t)ngx_random() << 32) ^ (uint64_t)ngx_random();
+	sh->valueSize = fdmcf->cacheZoneValueSize;
+	sh->slotSize = ngx_align(
+		offsetof(ngx_http_51D_cache_zone_slot_t, value) + sh->valueSize,
+		sizeof(uint64_t));
+
+	// Use all of the remaining pages in the zone for the slots.
+	bucketSize = sh->slotSize * FIFTYONE_DEGREES_CACHE_ZONE_WAYS;
+	sh->bucketCount = (shpool->pfree * ngx_pagesize) / bucketSize;
+	sh->slots = sh->bucketCount > 0 ?
+		(u_char *)ngx_slab_alloc(shpool, sh->bucketCount * bucketSize) :
+		NULL;
+	if (sh->slots == NULL) {
+		ngx_log_error(
+			NGX_LOG_EMERG,
+			shm_zone->shm.log,
+			0,
+			"51Degrees cache zone \"%V\" is too small.",
+			&shm_zone->shm.name);
+		return NGX_ERROR;
+	}
+	ngx_memzero(sh->slots, sh->bucketCount * bucketSize);
+
+	shpool->data = sh;
+	fdmcf->cacheZoneSh = sh;
+	ngx_log_debug1(
+		NGX_LOG_DEBUG_ALL,
+		shm_zone->shm.log,
+		0,
+		"51Degrees initialised cache zone with %ui buckets.",
+		sh->bucketCount);
+	return NGX_OK;
+}
+
+/**
+ * Get the identity of the data file on disk.
+ * @param fdmcf module main config.
+ * @param id set to the identity of the file.
+ * @param log the log to write errors to.
+ * @return NGX_OK, or NGX_ERROR if the file could not be found.
+ */
+static ngx_int_t
+ngx_http_51D_get_file_id(
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_http_51D_file_id_t *id,
+	ngx_log_t *log)
+{
+	ngx_file_info_t fi;
+
+	if (ngx_file_info(fdmcf->dataFile.data, &fi) == NGX_FILE_ERROR) {
+		ngx_log_error(
+			NGX_LOG_WARN,
+			log,
+			ngx_errno,
+			ngx_file_info_n " \"%V\" failed",
+			&fdmcf->dataFile);
+		return NGX_ERROR;
+	}
+	id->uniq = ngx_file_uniq(&fi);
+	id->mtime = ngx_file_mtime(&fi);
+	id->size = ngx_file_size(&fi);
+	return NGX_OK;
+}
+
+/**
+ * Whether two identities are of the same data file on disk.
+ * @param a first identity.
+ * @param b second identity.
+ * @return 1 if they are the same, otherwise 0.
+ */
+static ngx_uint_t
+ngx_http_51D_file_id_equal(
+	ngx_http_51D_file_id_t *a,
+	ngx_http_51D_file_id_t *b)
+{
+	return a->uniq == b->uniq && a->mtime == b->mtime && a->size == b->size;
+}
+
+/**
+ * Map the replaced data file into the helper process which reloads it, read
+ * only, so that it can be checksummed and copied into the shared memory
+ * zone without holding the zone's lock.
+ * @param fdmcf module main config.
+ * @param size set to the size of the file.
+ * @param log the log to write errors to.
+ * @return the mapping, or NULL if the file could not be mapped.
+ */
+static u_char *
+ngx_http_51D_map_reload_file(
+	ngx_http_51D_main_conf_t *fdmcf,
+	size_t *size,
+	ngx_log_t *log)
+{
+	ngx_fd_t fd;
+	ngx_file_info_t fi;
+	u_char *map = MAP_FAILED;
+
+	fd = ngx_open_file(
+		fdmcf->dataFile.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if (fd == NGX_INVALID_FILE) {
+		ngx_log_error(
+			NGX_LOG_WARN,
+			log,
+			ngx_errno,
+			ngx_open_file_n " \"%V\" failed",
+			&fdmcf->dataFile);
+		return NULL;
+	}
+	if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+		ngx_log_error(
+			NGX_LOG_WARN,
+			log,
+			ngx_errno,
+			ngx_fd_info_n " \"%V\" failed",
+			&fdmcf->dataFile);
+	}
+	else {
+		*size = (size_t)ngx_file_size(&fi);
+		map = *size > 0 ?
+			mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+		if (map == MAP_FAILED) {
+			ngx_log_error(
+				NGX_LOG_WARN,
+				log,
+				ngx_errno,
+				"mmap(\"%V\") failed",
+				&fdmcf->dataFile);
+		}
+	}
+	if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+		ngx_log_error(
+			NGX_LOG_ALERT,
+			log,
+			ngx_errno,
+			ngx_close_file_n " \"%V\" failed",
+			&fdmcf->dataFile);
+	}
+	return map == MAP_FAILED ? NULL : map;
+}
+
+/**
+ * Get the fingerprint of the data set loaded into the shared memory zone.
+ * This covers the identity and contents of the data file, and all of the
+ * settings and properties it is loaded with, so that a reload of nginx keeps
+ * the zone only where it would load the same data set again. The contents
+ * are only read where the inode, size or modified time of the file differ
+ * from when it was last read. They are then read from the mapping of the
+ * file which the zone is sized and loaded from, so the file is read once.
+ * @param cf nginx config.
+ * @param fdmcf module main config.
+ * @return the fingerprint, or 0 if the data file could not be read.
+ */
+static uint64_t
+ngx_http_51D_get_data_set_fingerprint(
+	ngx_conf_t *cf,
+	ngx_http_51D_main_conf_t *fdmcf)
+{
+	ngx_http_51D_file_id_t id;
+	uint64_t checksum, hash;
+
+	if (ngx_http_51D_get_file_id(fdmcf, &id, cf->log) != NGX_OK) {
+		return 0;
+	}
+	if (ngx_http_51D_last_checksum.checksum != 0 &&
+		ngx_http_51D_file_id_equal(&id, &ngx_http_51D_last_checksum.id)) {
+		checksum = ngx_http_51D_last_checksum.checksum;
+	}
+	else {
+		if (ngx_http_51D_map_data_file(cf, fdmcf) != NGX_OK) {
+			return 0;
+		}
+		checksum = ngx_http_51D_hash(
+			FIFTYONE_DEGREES_HASH_OFFSET,
+			fdmcf->dataFileMap,
+			fdmcf->dataFileMapSize);
+		ngx_http_51D_last_checksum.id = id;
+		ngx_http_51D_last_checksum.checksum = checksum;
+	}
+	hash = ngx_http_51D_get_fingerprint(cf, fdmcf);
+	hash = ngx_http_51D_hash(hash, &id.uniq, sizeof(id.uniq));
+	hash = ngx_http_51D_hash(hash, &checksum, sizeof(checksum));
+	hash = ngx_http_51D_hash(
+		hash, &fdmcf->performanceProfile, sizeof(fdmcf->performanceProfile));
+	hash = ngx_http_51D_hash(
+		hash, &fdmcf->maxConcurrency, sizeof(fdmcf->maxConcurrency));
+	hash = ngx_http_51D_hash(
+		hash, &fdmcf->usePerformanceGraph, sizeof(fdmcf->usePerformanceGraph));
+	hash = ngx_http_51D_hash(
+		hash, &fdmcf->usePredictiveGraph, sizeof(fdmcf->usePredictiveGraph));
+	hash = ngx_http_51D_hash(
+		hash, &fdmcf->respHeadersEnabled, sizeof(fdmcf->respHeadersEnabled));
+	hash = ngx_http_51D_hash(
+		hash, &fdmcf->reloadInterval, sizeof(fdmcf->reloadInterval));
+	return hash == 0 ? 1 : hash;
+}
+
+/**
+ * Init module function. Initialises the resrouce manager with the given
+ * initialisation parameters. Throws an error if the resource manager could
  * not be initialised.
  * @param cycle the current nginx cycle.
  * @return ngx_int_t nginx conf status.
@@ -912,7 +2564,8 @@ static ngx_int_t
 ngx_http_51D_init_module(ngx_cycle_t *cycle)
 {
 	ngx_http_51D_main_conf_t *fdmcf;
-	ngx_slab_pool_t *shpool;
+	void *copy = NULL;
+	ngx_uint_t noMemory = 0;
 
 	// Get module main config.
 	fdmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_51D_module);
@@ -923,34 +2576,114 @@ ngx_http_51D_init_module(ngx_cycle_t *cycle)
 	fdmcf->resourceManager =
 		(ResourceManager *)ngx_http_51D_shm_resource_manager->data;
 
-	shpool = (ngx_slab_pool_t *)ngx_http_51D_shm_resource_manager->shm.addr;
+	// The zone was carried over from the previous cycle, along with the data
+	// set, the worker count and the reload state set up by this process.
+	if (fdmcf->resourceManager->active != NULL) {
+		ngx_log_error(
+			NGX_LOG_NOTICE,
+			cycle->log,
+			0,
+			"51Degrees data file \"%V\" and settings unchanged, keeping the "
+			"loaded data set",
+			&fdmcf->dataFile);
+		return NGX_OK;
+	}
 
-	// Set the memory allocation function to use the shared memory zone.
-	Malloc = ngx_http_51D_shm_alloc;
-	Free = ngx_http_51D_shm_free;
-	MallocAligned = ngx_http_51D_shm_alloc_aligned;
-	FreeAligned = ngx_http_51D_shm_free;
+	// Need to determine the ConfigHash at this point
+	ConfigHash config = get_config_hash(fdmcf);
+	PropertiesRequired properties = get_properties_hash(fdmcf);
 
-	// Initialise the resource manager.
-	ngx_shmtx_lock(&shpool->mutex);
+	// Use the shared memory zone while the resource manager is initialised.
+	ngx_http_51D_shm_enter();
 	ngx_http_51D_worker_count =
 		(ngx_atomic_t *)ngx_http_51D_shm_alloc(sizeof(ngx_atomic_t));
 	ngx_atomic_cmp_set(ngx_http_51D_worker_count, 0, 0);
+	ngx_http_51D_reload = (ngx_http_51D_reload_sh_t *)ngx_http_51D_shm_alloc(
+		sizeof(ngx_http_51D_reload_sh_t));
+	if (ngx_http_51D_reload != NULL) {
+		ngx_memzero(ngx_http_51D_reload, sizeof(ngx_http_51D_reload_sh_t));
+		// The file is identified before it is read, so a change while it is
+		// read is seen by the first check.
+		if (fdmcf->reloadInterval > 0) {
+			ngx_http_51D_get_file_id(
+				fdmcf, &ngx_http_51D_reload->loaded, cycle->log);
+		}
+	}
 
-	// Need to determine the ConfigHash at this point
-	ConfigHash config = get_config_hash(fdmcf);
-	PropertiesRequired properties = get_properties_hash(fdmcf);
+	// Allocate the arena and load the data set into it. The arena of the
+	// last zone is forgotten, so nothing is taken to be in it if this one
+	// can not be allocated.
+	ngx_memzero(&ngx_http_51D_arena, sizeof(ngx_http_51D_arena_t));
+	if (fdmcf->arenaSize > 0 && ngx_http_51D_reload != NULL) {
+		ngx_http_51D_arena.start = (u_char *)ngx_http_51D_shm_alloc(
+			fdmcf->arenaSize);
+		if (ngx_http_51D_arena.start != NULL) {
+			ngx_http_51D_arena.pos = ngx_http_51D_arena.start;
+			ngx_http_51D_arena.last = NULL;
+			ngx_http_51D_arena.end =
+				ngx_http_51D_arena.start + fdmcf->arenaSize;
+			Malloc = ngx_http_51D_arena_alloc;
+			MallocAligned = ngx_http_51D_arena_alloc_aligned;
+		}
+	}
 
 	EXCEPTION_CREATE;
-	HashInitManagerFromFile(
-		fdmcf->resourceManager,
-		&config,
-		&properties,
-		(const char *)fdmcf->dataFile.data,
-		exception
-	);
-	// Release lock
-	ngx_shmtx_unlock(&shpool->mutex);
+	if (fdmcf->loadMode == ngx_http_51D_load_mode_mmap) {
+		// The data set is built over the mapped file without copying it.
+		fiftyoneDegreesHashInitManagerFromMemory(
+			fdmcf->resourceManager,
+			&config,
+			&properties,
+			fdmcf->dataFileMap,
+			(long)fdmcf->dataFileMapSize,
+			exception);
+	}
+	else if (fdmcf->dataFileMap != NULL) {
+		// The data file was mapped to size the zone. Copy it into the zone
+		// and build the data set over the copy, which is freed with the data
+		// set, so the file is only read once.
+		copy = Malloc(fdmcf->dataFileMapSize);
+		if (copy != NULL) {
+			ngx_memcpy(copy, fdmcf->dataFileMap, fdmcf->dataFileMapSize);
+			config.b.b.freeData = true;
+			fiftyoneDegreesHashInitManagerFromMemory(
+				fdmcf->resourceManager,
+				&config,
+				&properties,
+				copy,
+				(long)fdmcf->dataFileMapSize,
+				exception);
+		}
+		else {
+			noMemory = 1;
+		}
+		ngx_http_51D_unmap_data_file(fdmcf);
+	}
+	else if (ngx_http_51D_per_worker(fdmcf) == 0) {
+		// The zone was sized from the last load of the same data file, but
+		// nginx did not carry it over, so the file is loaded again.
+		// Otherwise each worker process loads the data set when it starts.
+		HashInitManagerFromFile(
+			fdmcf->resourceManager,
+			&config,
+			&properties,
+			(const char *)fdmcf->dataFile.data,
+			exception
+		);
+	}
+	// The data set is not changed from here on, so nothing in the arena can
+	// be freed until the zone is discarded.
+	ngx_http_51D_arena.last = NULL;
+	ngx_log_debug2(
+		NGX_LOG_DEBUG_ALL,
+		cycle->log,
+		0,
+		"51Degrees arena used %d of %d bytes",
+		ngx_http_51D_arena.pos - ngx_http_51D_arena.start,
+		fdmcf->arenaSize);
+	// Reset the malloc and free functions as nothing else should be allocated
+	// in the shared memory zone, and release the lock.
+	ngx_http_51D_shm_leave();
 
 	if (EXCEPTION_FAILED) {
 		return report_status(
@@ -958,12 +2691,17 @@ ngx_http_51D_init_module(ngx_cycle_t *cycle)
 			exception->status,
 			(const char *)fdmcf->dataFile.data);
 	}
-	// Reset the malloc and free functions as nothing else should be allocated
-	// in the shared memory zone.
-	Malloc = MemoryStandardMalloc;
-	Free = MemoryStandardFree;
-	MallocAligned = MemoryStandardMallocAligned;
-	FreeAligned = MemoryStandardFreeAligned;
+	if (ngx_http_51D_reload == NULL || noMemory) {
+		return report_insufficient_memory_status(cycle->log);
+	}
+
+	// Remember the data set so that the zone is kept by the next reload of
+	// nginx if it is unchanged.
+	if (fdmcf->dataSetFingerprint != 0) {
+		ngx_http_51D_shm_last.fingerprint = fdmcf->dataSetFingerprint;
+		ngx_http_51D_shm_last.size = ngx_http_51D_shm_resource_manager->shm.size;
+		ngx_http_51D_shm_last.arenaSize = fdmcf->arenaSize;
+	}
 
 	return NGX_OK;
 }
@@ -978,10 +2716,38 @@ static ngx_conf_enum_t ngx_http_51D_performance_profiles[] = {
 	{ ngx_string("LOW_MEMORY"), ngx_http_51D_profile_low_memory },
 	{ ngx_string("BALANCED"), ngx_http_51D_profile_balanced },
 	{ ngx_string("BALANCED_TEMP"), ngx_http_51D_profile_balanced_temp },
-	{ ngx_string("DEFAULT"), ngx_http_51D_profile_balanced },
+	{ ngx_string("DEFAULT"), ngx_http_51D_profile_in_memory },
+	{ ngx_null_string, 0 }
+};
+
+/**
+ * Load modes map, to map user specified string with the corresponding mode.
+ */
+static ngx_conf_enum_t ngx_http_51D_load_modes[] = {
+	{ ngx_string("copy"), ngx_http_51D_load_mode_copy },
+	{ ngx_string("mmap"), ngx_http_51D_load_mode_mmap },
+	{ ngx_null_string, 0 }
+};
+
+/**
+ * Override evidence sources map, to map user specified string with the
+ * corresponding sources.
+ */
+static ngx_conf_enum_t ngx_http_51D_overrides[] = {
+	{ ngx_string("off"), ngx_http_51D_overrides_off },
+	{ ngx_string("cookie"), ngx_http_51D_overrides_cookie },
+	{ ngx_string("query"), ngx_http_51D_overrides_query },
+	{ ngx_string("all"), ngx_http_51D_overrides_all },
 	{ ngx_null_string, 0 }
 };
 
+/**
+ * Bounds of 51D_thread_concurrency.
+ */
+static ngx_conf_num_bounds_t ngx_http_51D_thread_concurrency_bounds = {
+	ngx_conf_check_num_bounds, 1, FIFTYONE_DEGREES_THREAD_CONCURRENCY_MAX
+};
+
 /**
  * Definitions of functions which can be called from the config file.
  * --51D_match_single takes two string arguments, the name of the header
@@ -1008,8 +2774,8 @@ static ngx_conf_enum_t ngx_http_51D_performance_profiles[] = {
  * multiple http header matching.
  * --51D_performance_profile takes one enum argument, the performance profile
  * to set. Values can be "IN_MEMORY", "HIGH_PERFORMANCE", "LOW_MEMORY",
- * "BALANCED", "BALANCED_TEMP", "DEFAULT". Currently only "IN_MEMORY" is
- * supported.
+ * "BALANCED", "BALANCED_TEMP", "DEFAULT". "IN_MEMORY" and "DEFAULT" load
+ * the data set into shared memory, the others into each worker process.
  * --51D_drift takes one integer argument, the drift value to set
  * --51D_difference takes one integer argument, the difference value to set
  * --51D_max_concurrency takes one integer argument, the maximum number of
@@ -1029,6 +2795,22 @@ static ngx_conf_enum_t ngx_http_51D_performance_profiles[] = {
  * 51Degrees data file. Is called within server block.
  * --51D_value_separator takes one string argument, the separator of the
  * values being returned.
+ * --51D_cache takes one argument in the form size=N, the number of header
+ * values to hold in the result cache of each worker process.
+ * --51D_profile_cache takes one argument in the form size=N, the number of
+ * header values to hold for the matched profiles in each worker process.
+ * --51D_cache_zone takes one argument in the form name:size, the shared
+ * memory zone to hold the result cache shared by all worker processes.
+ * --51D_overrides takes one enum argument, which specifies whether override
+ * evidence is taken from cookies, the query string, both or neither.
+ * --51D_load_mode takes one enum argument, which specifies whether the data
+ * file is copied into the shared memory zone or mapped into memory. The
+ * values can be "copy" or "mmap".
+ * --51D_auto_reload takes one argument in the form interval=time, how often
+ * the data file is checked and reloaded without reloading nginx.
+ * --51D_thread_pool takes one string argument, the name of the thread pool
+ * to perform all evidence matches in, or "off". Only available when nginx is
+ * built with thread support.
  */
 static ngx_command_t  ngx_http_51D_commands[] = {
 
@@ -1207,6 +2989,85 @@ static ngx_command_t  ngx_http_51D_commands[] = {
 	offsetof(ngx_http_51D_main_conf_t, valueSeparator),
 	NULL },
 
+	{ ngx_string("51D_cache"),
+	NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+	ngx_http_51D_set_cache,
+	NGX_HTTP_MAIN_CONF_OFFSET,
+	offsetof(ngx_http_51D_main_conf_t, cacheSize),
+	NULL },
+
+	{ ngx_string("51D_profile_cache"),
+	NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+	ngx_http_51D_set_cache,
+	NGX_HTTP_MAIN_CONF_OFFSET,
+	offsetof(ngx_http_51D_main_conf_t, profileCacheSize),
+	NULL },
+
+	{ ngx_string("51D_connection_cache"),
+	NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_MAIN_CONF_OFFSET,
+	offsetof(ngx_http_51D_main_conf_t, connectionCache),
+	NULL },
+
+	{ ngx_string("51D_overrides"),
+	NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+	ngx_conf_set_enum_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_51D_loc_conf_t, overrides),
+	&ngx_http_51D_overrides },
+
+	{ ngx_string("51D_javascript_cache_control"),
+	NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+	ngx_conf_set_str_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_51D_loc_conf_t, javascriptCacheControl),
+	NULL },
+
+	{ ngx_string("51D_javascript_gzip"),
+	NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_51D_loc_conf_t, javascriptGzip),
+	NULL },
+
+	{ ngx_string("51D_cache_zone"),
+	NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+	ngx_http_51D_set_cache_zone,
+	NGX_HTTP_MAIN_CONF_OFFSET,
+	0,
+	NULL },
+
+	{ ngx_string("51D_load_mode"),
+	NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+	ngx_conf_set_enum_slot,
+	NGX_HTTP_MAIN_CONF_OFFSET,
+	offsetof(ngx_http_51D_main_conf_t, loadMode),
+	&ngx_http_51D_load_modes },
+
+	{ ngx_string("51D_auto_reload"),
+	NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+	ngx_http_51D_set_auto_reload,
+	NGX_HTTP_MAIN_CONF_OFFSET,
+	0,
+	NULL },
+
+#if (NGX_THREADS)
+	{ ngx_string("51D_thread_pool"),
+	NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+	ngx_http_51D_set_thread_pool,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	0,
+	NULL },
+#endif
+
+	{ ngx_string("51D_thread_concurrency"),
+	NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+	ngx_conf_set_num_slot,
+	NGX_HTTP_MAIN_CONF_OFFSET,
+	offsetof(ngx_http_51D_main_conf_t, threadConcurrency),
+	&ngx_http_51D_thread_concurrency_bounds },
+
 	ngx_null_command
 };
 
@@ -1266,21 +3127,104 @@ static ngx_int_t getRespHeaderIndex(
 }
 
 /**
- * Find a header name in a header to set linked list.
- * @param respHeader pointer to the first element in a list
- * @param headerName a header to search for.
- * @return pointer to the element that match. NULL if not found.
+ * Get the type of a property being requested.
+ * @param val the name of the property.
+ * @return the type, which is ngx_http_51D_property_data unless the property
+ * is a meta data property.
+ */
+static ngx_http_51D_property_type
+ngx_http_51D_get_property_type(const char *val) {
+	if (StringCompare(val, "Iterations") == 0) {
+		return ngx_http_51D_property_iterations;
+	}
+	if (StringCompare(val, "Drift") == 0) {
+		return ngx_http_51D_property_drift;
+	}
+	if (StringCompare(val, "Difference") == 0) {
+		return ngx_http_51D_property_difference;
+	}
+	if (StringCompare(val, "Method") == 0) {
+		return ngx_http_51D_property_method;
+	}
+	if (StringCompare(val, "UserAgents") == 0) {
+		return ngx_http_51D_property_user_agents;
+	}
+	if (StringCompare(val, "MatchedNodes") == 0) {
+		return ngx_http_51D_property_matched_nodes;
+	}
+	if (StringCompare(val, "DeviceId") == 0) {
+		return ngx_http_51D_property_device_id;
+	}
+	return ngx_http_51D_property_data;
+}
+
+/**
+ * Check if a property being requested is a meta data property.
+ * @param val the string value.
+ */
+static bool is_metadata(char *val) {
+	return ngx_http_51D_get_property_type(val) != ngx_http_51D_property_data;
+}
+
+/**
+ * Resolve the properties of a header or body against the data set, so that
+ * no property names are looked up for each request. Properties which are not
+ * in the data set are logged once, by the first worker process, and return
+ * FIFTYONE_DEGREES_PROPERTY_NOT_AVAILABLE.
+ * @param cycle pointer to the current cycle.
+ * @param dataSet pointer to the 51Degrees Hash dataset.
+ * @param data the header or body to resolve the properties of.
+ * @return status.
  */
-static ngx_http_51D_data_to_set *getRespHeader(
-	ngx_http_51D_data_to_set *respHeader,
-	const char *headerName) {
-	ngx_http_51D_data_to_set *header = respHeader;
-	while (header != NULL) {
-		if (ngx_strcmp(headerName, header->headerName.data) == 0) {
-			return header;
+static ngx_int_t
+ngx_http_51D_resolve_properties(
+	ngx_cycle_t *cycle,
+	DataSetHash *dataSet,
+	ngx_http_51D_data_to_set *data) {
+	ngx_uint_t i;
+	ngx_http_51D_property_t *property;
+
+	if (data->properties == NULL && data->propertyCount > 0) {
+		data->properties = (ngx_http_51D_property_t *)ngx_palloc(
+			cycle->pool, data->propertyCount * sizeof(ngx_http_51D_property_t));
+		if (data->properties == NULL) {
+			return report_insufficient_memory_status(cycle->log);
 		}
 	}
-	return NULL;
+
+	data->profileValues = 1;
+	for (i = 0; i < data->propertyCount; i++) {
+		property = &data->properties[i];
+		property->name = data->property[i];
+		property->type =
+			ngx_http_51D_get_property_type((const char *)property->name->data);
+		property->requiredPropertyIndex = -1;
+		if (property->type != ngx_http_51D_property_data &&
+			property->type != ngx_http_51D_property_device_id) {
+			// Match metrics differ for matches of the same profiles.
+			data->profileValues = 0;
+		}
+		if (property->type == ngx_http_51D_property_data) {
+			property->requiredPropertyIndex =
+				PropertiesGetRequiredPropertyIndexFromName(
+					dataSet->b.b.available,
+					(const char *)property->name->data);
+			if (property->requiredPropertyIndex < 0 && ngx_worker == 0) {
+				ngx_log_error(
+					NGX_LOG_WARN,
+					cycle->log,
+					0,
+					"51Degrees property '%V' is not available in the data "
+					"file, '%s' will be returned.",
+					property->name,
+					FIFTYONE_DEGREES_PROPERTY_NOT_AVAILABLE);
+			}
+		}
+	}
+
+	data->headerHash = data->headerName.len > 0 ?
+		ngx_hash_key(data->headerName.data, data->headerName.len) : 0;
+	return NGX_OK;
 }
 
 /**
@@ -1295,7 +3239,7 @@ initRespHeaders(
 	ngx_cycle_t *cycle,
 	ngx_http_51D_main_conf_t *fdmcf,
 	DataSetHash *dataSet) {
-	ngx_http_51D_data_to_set **respHeaderPtr;
+	ngx_http_51D_data_to_set *respHeader;
 	ngx_uint_t i, respHeaderCount = 0;
 	ngx_int_t headerIndex;
 	const char *propertyName, *headerName;
@@ -1346,56 +3290,61 @@ initRespHeaders(
 
 		fdmcf->setRespHeaderCount = respHeaderCount;
 
+		// The headers are held in one array, in the order of their names, so
+		// the header filter can index them without following a list.
+		fdmcf->setRespHeader = (ngx_http_51D_data_to_set *)ngx_pcalloc(
+			cycle->pool, respHeaderCount * sizeof(ngx_http_51D_data_to_set));
+		if (fdmcf->setRespHeader == NULL) {
+			report_insufficient_memory_status(cycle->log);
+			return NGX_ERROR;
+		}
+
 		// Set the header names
-		respHeaderPtr = &fdmcf->setRespHeader;
 		for (i = 0; i < respHeaderCount; i++) {
-			*respHeaderPtr = (ngx_http_51D_data_to_set *)ngx_palloc(
-				cycle->pool, sizeof(ngx_http_51D_data_to_set));
-			if (*respHeaderPtr == NULL) {
-				report_insufficient_memory_status(cycle->log);
-				return NGX_ERROR;
-			}
+			respHeader = &fdmcf->setRespHeader[i];
 
 			// header might have to be constructed
 			// with all evidence, not just a User-Agent. User-Agent
 			// might be deprecated in the future.
 			//
 			// Bits of this field will be populated later.
-			(*respHeaderPtr)->multi = 0;
+			respHeader->multi = 0;
 	
 			// This doesn't need to be allocated in separate memmory
 			// as it won't be freed from available properties.
-			(*respHeaderPtr)->headerName = headerNames[i];
-			(*respHeaderPtr)->lowerHeaderName.data =
+			respHeader->headerName = headerNames[i];
+			respHeader->lowerHeaderName.data =
 				(u_char *)ngx_palloc(
 					cycle->pool, 
 					headerNames[i].len + 1);
-			if ((*respHeaderPtr)->lowerHeaderName.data == NULL) {
+			if (respHeader->lowerHeaderName.data == NULL) {
 				report_insufficient_memory_status(cycle->log);
 				return NGX_ERROR;
 			}
 			
 			ngx_strlow(
-				(*respHeaderPtr)->lowerHeaderName.data,
-				(*respHeaderPtr)->headerName.data,
-				(*respHeaderPtr)->headerName.len);
-			(*respHeaderPtr)->lowerHeaderName.len = (*respHeaderPtr)->headerName.len;
+				respHeader->lowerHeaderName.data,
+				respHeader->headerName.data,
+				respHeader->headerName.len + 1);
+			respHeader->lowerHeaderName.len = respHeader->headerName.len;
+			fdmcf->setRespHeaderLength = ngx_max(
+				fdmcf->setRespHeaderLength, respHeader->headerName.len);
 
 			// Set to zero so we know where we are while filling.
-			(*respHeaderPtr)->propertyCount = 0;
-			(*respHeaderPtr)->property =
+			respHeader->propertyCount = 0;
+			respHeader->property =
 				(ngx_str_t **)ngx_palloc(cycle->pool, propertyCounts[i] * sizeof(ngx_str_t *));
-			if (fdmcf->setRespHeader[i].property == NULL) {
+			if (respHeader->property == NULL) {
 				report_insufficient_memory_status(cycle->log);
 				return NGX_ERROR;
 			}
-			(*respHeaderPtr)->variableName = (ngx_str_t)ngx_null_string;
-			(*respHeaderPtr)->next = NULL;
-			respHeaderPtr = &(*respHeaderPtr)->next;
+			respHeader->properties = NULL;
+			respHeader->variableName = (ngx_str_t)ngx_null_string;
+			respHeader->key = 0;
+			respHeader->next = NULL;
 		}
 
 		// Fill the properties.
-		ngx_http_51D_data_to_set *respHeader;
 		for (i = 0;  i < dataSet->b.b.available->count; i++) {
 			propertyName = STRING(dataSet->b.b.available->items[i].name.data.ptr);
 			if (ngx_strncmp(
@@ -1404,7 +3353,8 @@ initRespHeaders(
 				ngx_strlen(FIFTYONE_DEGREES_SET_HEADER_PREFIX)) == 0) {
 				headerName = skipComponentName(
 					propertyName + ngx_strlen(FIFTYONE_DEGREES_SET_HEADER_PREFIX));
-				respHeader = getRespHeader(fdmcf->setRespHeader, headerName);
+				respHeader = &fdmcf->setRespHeader[getRespHeaderIndex(
+					headerNames, headerName, respHeaderCount)];
 				respHeader->property[respHeader->propertyCount] =
 					(ngx_str_t *)ngx_palloc(cycle->pool, sizeof(ngx_str_t));
 				if (respHeader->property[respHeader->propertyCount] == NULL) {
@@ -1427,539 +3377,3129 @@ initRespHeaders(
 				respHeader->propertyCount++;
 			}
 		}
+
+		// Resolve the properties now all of them have been added.
+		fdmcf->setRespHeaderProfileValues = 1;
+		for (i = 0; i < respHeaderCount; i++) {
+			if (ngx_http_51D_resolve_properties(
+				cycle, dataSet, &fdmcf->setRespHeader[i]) != NGX_OK) {
+				return NGX_ERROR;
+			}
+			if (fdmcf->setRespHeader[i].profileValues == 0) {
+				fdmcf->setRespHeaderProfileValues = 0;
+			}
+		}
 	}
 	return NGX_OK;
 }
 
 /**
- * Init process function. Creates a result set from the shared resource
- * manager.
- * This result set is local to the process.
- * Here is where the ResultsHash will be initialised.
- * @param cycle the current nginx cycle.
- * @return ngx_int_t nginx status.
+ * Insert function for the result cache tree. Entries are ordered on the tree
+ * key, then on the full key where the tree key is narrower than the full key.
+ * @param temp the root of the tree.
+ * @param node the node to insert.
+ * @param sentinel the sentinel of the tree.
  */
-static ngx_int_t
-ngx_http_51D_init_process(ngx_cycle_t *cycle)
-{
-	ngx_int_t status;
-	ngx_http_51D_main_conf_t *fdmcf;
-
-	if (ngx_http_51D_shm_resource_manager == NULL) {
-		return NGX_OK;
+static void
+ngx_http_51D_cache_insert_value(
+	ngx_rbtree_node_t *temp,
+	ngx_rbtree_node_t *node,
+	ngx_rbtree_node_t *sentinel) {
+	ngx_rbtree_node_t **p;
+	ngx_http_51D_cache_node_t *entry, *tempEntry;
+
+	for ( ;; ) {
+		if (node->key < temp->key) {
+			p = &temp->left;
+		}
+		else if (node->key > temp->key) {
+			p = &temp->right;
+		}
+		else {
+			entry = (ngx_http_51D_cache_node_t *)node;
+			tempEntry = (ngx_http_51D_cache_node_t *)temp;
+			p = entry->key < tempEntry->key ? &temp->left : &temp->right;
+		}
+		if (*p == sentinel) {
+			break;
+		}
+		temp = *p;
 	}
-	fdmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_51D_module);
-	DataSetHash *dataSet = (DataSetHash *)DataSetGet(fdmcf->resourceManager);
-	ngx_uint_t overridesCount =
-		dataSet->b.b.overridable != NULL ? dataSet->b.b.overridable->count : 0;
-	
-	// There can only be one result per unique header, so the max number of results
-	// is the number of unique headers.
-	fdmcf->results = ResultsHashCreate(
-		fdmcf->resourceManager,
-		overridesCount);
 
-	// Initialise the response headers array.
-	if ((status = initRespHeaders(cycle, fdmcf, dataSet)) != NGX_OK) {
-		return status;
-	};
+	*p = node;
+	node->parent = temp;
+	node->left = sentinel;
+	node->right = sentinel;
+	ngx_rbt_red(node);
+}
 
-	// Release the dataset
-	DataSetRelease((DataSetBase *)dataSet);
+/**
+ * Create the result cache for a worker process with all of its entries
+ * allocated up front.
+ * @param log the log to write errors to.
+ * @param size the number of entries in the cache.
+ * @return the cache, or NULL if there was not enough memory.
+ */
+static ngx_http_51D_cache_t *
+ngx_http_51D_cache_create(ngx_log_t *log, ngx_uint_t size) {
+	ngx_uint_t i;
+	ngx_http_51D_cache_t *cache;
 
-	if (fdmcf->results == NULL) {
-		return report_insufficient_memory_status(cycle->log);
+	cache = (ngx_http_51D_cache_t *)ngx_alloc(sizeof(ngx_http_51D_cache_t), log);
+	if (cache == NULL) {
+		return NULL;
+	}
+	cache->nodes = (ngx_http_51D_cache_node_t *)ngx_alloc(
+		size * sizeof(ngx_http_51D_cache_node_t), log);
+	if (cache->nodes == NULL) {
+		ngx_free(cache);
+		return NULL;
 	}
 
-	// Increment the workers which are using the dataset.
-	ngx_atomic_fetch_add(ngx_http_51D_worker_count, 1);
-	return NGX_OK;
+	ngx_rbtree_init(
+		&cache->rbtree,
+		&cache->sentinel,
+		ngx_http_51D_cache_insert_value);
+	ngx_queue_init(&cache->queue);
+	ngx_queue_init(&cache->free);
+	for (i = 0; i < size; i++) {
+		cache->nodes[i].value = (ngx_str_t)ngx_null_string;
+		ngx_queue_insert_tail(&cache->free, &cache->nodes[i].queue);
+	}
+	cache->size = size;
+	cache->hits = 0;
+	cache->misses = 0;
+	return cache;
 }
 
 /**
- * Exit process function. Frees the results set that was created on process
- * init.
- * @param cycle the current nginx cycle.
+ * Free the result cache and all of the values it holds.
+ * @param cache to free.
  */
-void
-ngx_http_51D_exit_process(ngx_cycle_t *cycle)
-{
-	ngx_http_51D_main_conf_t *fdmcf;
-
-	if (ngx_http_51D_shm_resource_manager == NULL) {
-		return;
+static void
+ngx_http_51D_cache_free(ngx_http_51D_cache_t *cache) {
+	ngx_uint_t i;
+	for (i = 0; i < cache->size; i++) {
+		if (cache->nodes[i].value.data != NULL) {
+			ngx_free(cache->nodes[i].value.data);
+		}
 	}
+	ngx_free(cache->nodes);
+	ngx_free(cache);
+}
 
-	fdmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_51D_module);
+/**
+ * Find the entry with the key in the result cache, whatever evidence it was
+ * added for.
+ * @param cache to search.
+ * @param key of the evidence and header.
+ * @return the entry, or NULL if the key is not in the cache.
+ */
+static ngx_http_51D_cache_node_t *
+ngx_http_51D_cache_find_key(ngx_http_51D_cache_t *cache, uint64_t key) {
+	ngx_rbtree_key_t treeKey = (ngx_rbtree_key_t)key;
+	ngx_rbtree_node_t *node = cache->rbtree.root;
+	ngx_rbtree_node_t *sentinel = cache->rbtree.sentinel;
+	ngx_http_51D_cache_node_t *entry;
+
+	while (node != sentinel) {
+		if (treeKey < node->key) {
+			node = node->left;
+			continue;
+		}
+		if (treeKey > node->key) {
+			node = node->right;
+			continue;
+		}
+		entry = (ngx_http_51D_cache_node_t *)node;
+		if (key == entry->key) {
+			return entry;
+		}
+		node = key < entry->key ? node->left : node->right;
+	}
+	return NULL;
+}
 
-	ResultsHashFree(fdmcf->results);
+/**
+ * Find the entry with the key in the result cache, without changing the
+ * order of the entries or the counts of lookups. An entry with the key whose
+ * check differs was added for other evidence, so is not returned.
+ * @param cache to search.
+ * @param key of the evidence and header.
+ * @param check keyed hash of the evidence and header.
+ * @return the entry, or NULL if the evidence is not in the cache.
+ */
+static ngx_http_51D_cache_node_t *
+ngx_http_51D_cache_find(
+	ngx_http_51D_cache_t *cache,
+	uint64_t key,
+	uint64_t check) {
+	ngx_http_51D_cache_node_t *entry = ngx_http_51D_cache_find_key(cache, key);
+	return entry != NULL && entry->check == check ? entry : NULL;
+}
 
-	// Decrement the worker count. Try 5 times if not succeed.
-	ngx_uint_t i;
-	for (
-		i = 5;
-		i > 0 && ngx_atomic_fetch_add(ngx_http_51D_worker_count, -1) != 1;
-		i--) {}
+/**
+ * Find the entry with the key and check in the result cache. If found, the
+ * entry becomes the most recently used.
+ * @param cache to search.
+ * @param key of the evidence and header.
+ * @param check keyed hash of the evidence and header.
+ * @return the entry, or NULL if the evidence is not in the cache.
+ */
+static ngx_http_51D_cache_node_t *
+ngx_http_51D_cache_lookup(
+	ngx_http_51D_cache_t *cache,
+	uint64_t key,
+	uint64_t check) {
+	ngx_http_51D_cache_node_t *entry =
+		ngx_http_51D_cache_find(cache, key, check);
+
+	if (entry == NULL) {
+		cache->misses++;
+		return NULL;
+	}
+	ngx_queue_remove(&entry->queue);
+	ngx_queue_insert_head(&cache->queue, &entry->queue);
+	cache->hits++;
+	return entry;
 }
 
 /**
- * Exit master process. Frees resource created for the 51Degrees module.
- * @param cycle the current nginx cycle.
+ * Add a value to the result cache, evicting the least recently used entry if
+ * the cache is full. An entry with the key which was added for other
+ * evidence is replaced.
+ * @param cache to add the value to.
+ * @param key of the evidence and header.
+ * @param check keyed hash of the evidence and header.
+ * @param value the escaped value string to copy into the cache.
+ * @param length of the value.
+ * @param log the log to write errors to.
  */
-void
-ngx_http_51D_exit_master(ngx_cycle_t *cycle)
-{
-	ngx_slab_pool_t *shpool;
-	ResourceManager *resourceManager;
-	if (ngx_http_51D_shm_resource_manager == NULL) {
+static void
+ngx_http_51D_cache_insert(
+	ngx_http_51D_cache_t *cache,
+	uint64_t key,
+	uint64_t check,
+	u_char *value,
+	size_t length,
+	ngx_log_t *log) {
+	ngx_queue_t *q;
+	ngx_http_51D_cache_node_t *entry;
+	u_char *data;
+
+	data = (u_char *)ngx_alloc(length + 1, log);
+	if (data == NULL) {
+		return;
+	}
+	ngx_memcpy(data, value, length);
+	data[length] = '\0';
+
+	entry = ngx_http_51D_cache_find_key(cache, key);
+	if (entry != NULL) {
+		ngx_free(entry->value.data);
+		entry->check = check;
+		entry->value.data = data;
+		entry->value.len = length;
+		ngx_queue_remove(&entry->queue);
+		ngx_queue_insert_head(&cache->queue, &entry->queue);
 		return;
 	}
 
-	resourceManager =
-		(ResourceManager *)ngx_http_51D_shm_resource_manager->data;
-	shpool = (ngx_slab_pool_t *)ngx_http_51D_shm_resource_manager->shm.addr;
-
-	// Lock the shared memory and free any memory allocated for the module
-	ngx_shmtx_lock(&shpool->mutex);
-	if (*ngx_http_51D_worker_count > 0) {
-		ngx_log_error(
-			NGX_LOG_WARN,
-			cycle->log,
-			0,
-			"51Degrees not all child processes has terminated at master process termination");
+	if (ngx_queue_empty(&cache->free)) {
+		q = ngx_queue_last(&cache->queue);
+		entry = ngx_queue_data(q, ngx_http_51D_cache_node_t, queue);
+		ngx_rbtree_delete(&cache->rbtree, &entry->node);
+		ngx_free(entry->value.data);
+	}
+	else {
+		q = ngx_queue_head(&cache->free);
+		entry = ngx_queue_data(q, ngx_http_51D_cache_node_t, queue);
 	}
+	ngx_queue_remove(q);
+
+	entry->key = key;
+	entry->check = check;
+	entry->node.key = (ngx_rbtree_key_t)key;
+	entry->value.data = data;
+	entry->value.len = length;
+	ngx_rbtree_insert(&cache->rbtree, &entry->node);
+	ngx_queue_insert_head(&cache->queue, &entry->queue);
+}
 
-	// All child process should have already been terminated at this point.
-	// Also once the master has terminated, any running worker process should
-	// not be of any use so proceed to free the resource.
-	Free = ngx_http_51D_shm_free;
-	FreeAligned = ngx_http_51D_shm_free;
-	ResourceManagerFree(resourceManager);
-	Free = MemoryStandardFree; 
-	FreeAligned = MemoryStandardFreeAligned;
-	ngx_http_51D_shm_free((void *)resourceManager);
-	ngx_http_51D_shm_free((void *)ngx_http_51D_worker_count);
-	ngx_shmtx_unlock(&shpool->mutex);
+/**
+ * Set the fingerprint mixed into the keys of the shared result cache zone
+ * from the settings and the data set the process uses. Every process using
+ * the same data set, including one respawned after a reload of the data
+ * file, finds the same entries.
+ * @param fdmcf module main config.
+ */
+static void
+ngx_http_51D_set_cache_zone_fingerprint(ngx_http_51D_main_conf_t *fdmcf)
+{
+	fdmcf->cacheZoneFingerprint = ngx_http_51D_hash(
+		fdmcf->cacheZoneSettings,
+		&fdmcf->dataSetTag,
+		sizeof(fdmcf->dataSetTag));
 }
 
 /**
- * Module definition. Set the module context, commands, type and init function.
+ * Get the key of an entry in the shared result cache zone. The fingerprint
+ * of the data file is mixed in so that processes using another data file do
+ * not find the entry, and the seed of the zone so that the bucket of evidence
+ * can not be known outside the server. 0 marks an empty slot so is never
+ * returned.
+ * @param fdmcf module main config.
+ * @param key of the evidence and header.
+ * @return the key of the entry in the zone.
  */
-ngx_module_t ngx_http_51D_module = {
-	NGX_MODULE_V1,
-	&ngx_http_51D_module_ctx,      /* module context */
-	ngx_http_51D_commands,         /* module directives */
-	NGX_HTTP_MODULE,               /* module type */
-	NULL,                          /* init master */
-	ngx_http_51D_init_module,      /* init module */
-	ngx_http_51D_init_process,     /* init process */
-	NULL,                          /* init thread */
-	NULL,                          /* exit thread */
-	ngx_http_51D_exit_process,     /* exit process */
-	ngx_http_51D_exit_master,      /* exit master */
-	NGX_MODULE_V1_PADDING
-};
+static uint64_t
+ngx_http_51D_cache_zone_key(ngx_http_51D_main_conf_t *fdmcf, uint64_t key) {
+	key = ngx_http_51D_hash(
+		key, &fdmcf->cacheZoneFingerprint, sizeof(fdmcf->cacheZoneFingerprint));
+	key = ngx_http_51D_hash(
+		key, &fdmcf->cacheZoneSh->seed, sizeof(fdmcf->cacheZoneSh->seed));
+	return key != 0 ? key : 1;
+}
 
 /**
- * Search headers function. Searched request headers for the name supplied.
- * Used when matching multiple http headers to find important headers.
- * See:
- * https://www.nginx.com/resources/wiki/start/topics/examples/headers_management
+ * Get the check of an entry in the shared result cache zone, which is
+ * compared when its key is found. The fingerprint of the data file is mixed
+ * in as it is for the key.
+ * @param fdmcf module main config.
+ * @param check keyed hash of the evidence and header.
+ * @return the check of the entry in the zone.
  */
-static ngx_table_elt_t *
-search_headers_in(ngx_http_request_t *r, u_char *name, size_t len) {
-    ngx_list_part_t            *part;
-    ngx_table_elt_t            *h;
-    ngx_uint_t                  i;
-
-    part = &r->headers_in.headers.part;
-    h = part->elts;
-
-    for (i = 0; /* void */ ; i++) {
-        if (i >= part->nelts) {
-            if (part->next == NULL) {
-                break;
-            }
-
-            part = part->next;
-            h = part->elts;
-            i = 0;
-        }
-
-        if (len != h[i].key.len || ngx_strcasecmp(name, h[i].key.data) != 0) {
-            continue;
-        }
-
-        return &h[i];
-    }
+static uint64_t
+ngx_http_51D_cache_zone_check(ngx_http_51D_main_conf_t *fdmcf, uint64_t check) {
+	return ngx_http_51D_check_hash(
+		check,
+		&fdmcf->cacheZoneFingerprint,
+		sizeof(fdmcf->cacheZoneFingerprint));
+}
 
-    return NULL;
+/**
+ * Get a slot in the bucket of the key in the shared result cache zone.
+ * @param sh the shared result cache zone.
+ * @param key of the entry in the zone.
+ * @param index of the slot in the bucket.
+ * @return the slot.
+ */
+static ngx_http_51D_cache_zone_slot_t *
+ngx_http_51D_cache_zone_slot(
+	ngx_http_51D_cache_zone_sh_t *sh,
+	uint64_t key,
+	ngx_uint_t index) {
+	return (ngx_http_51D_cache_zone_slot_t *)(sh->slots + sh->slotSize *
+		((key % sh->bucketCount) * FIFTYONE_DEGREES_CACHE_ZONE_WAYS + index));
 }
 
 /**
- * Add value function. Appends a string to a list separated by the
- * delimiter specified with 51D_valueSeparator, or a comma by default.
- * Values which do not fit in the remaining space are truncated.
- * @param delimiter to split values with.
- * @param val the string to add to dst.
- * @param dst the string to append the val to.
- * @param length the space remaining in dst, including the null terminator.
+ * Find the value with the key and check in the shared result cache zone. No
+ * lock is taken. The value is copied and only returned if the sequence of the
+ * slot did not change while it was copied.
+ * @param fdmcf module main config.
+ * @param r the current HTTP request, whose pool the value is copied to.
+ * @param key of the evidence and header.
+ * @param check keyed hash of the evidence and header.
+ * @return the value, or NULL if the evidence is not in the zone.
  */
-static void add_value(char *delimiter, char *val, char *dst, size_t length)
-{
-	// Reserve the byte for the null terminator written by strncat.
-	if (length == 0) {
+static u_char *
+ngx_http_51D_cache_zone_lookup(
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_http_request_t *r,
+	uint64_t key,
+	uint64_t check) {
+	ngx_uint_t i;
+	ngx_atomic_uint_t seq;
+	size_t length;
+	u_char *value;
+	ngx_http_51D_cache_zone_sh_t *sh = fdmcf->cacheZoneSh;
+	ngx_http_51D_cache_zone_slot_t *slot;
+
+	key = ngx_http_51D_cache_zone_key(fdmcf, key);
+	check = ngx_http_51D_cache_zone_check(fdmcf, check);
+	for (i = 0; i < FIFTYONE_DEGREES_CACHE_ZONE_WAYS; i++) {
+		slot = ngx_http_51D_cache_zone_slot(sh, key, i);
+		seq = slot->seq;
+		if (seq & 1) {
+			continue;
+		}
+		ngx_memory_barrier();
+		length = slot->len;
+		if (slot->key != key ||
+			slot->check != check ||
+			length > sh->valueSize) {
+			continue;
+		}
+
+		// The value is copied straight to the request's pool, and is
+		// discarded if the slot is written while it is copied.
+		value = (u_char *)ngx_pnalloc(r->pool, length + 1);
+		if (value == NULL) {
+			report_insufficient_memory_status(r->connection->log);
+			return NULL;
+		}
+		ngx_memcpy(value, slot->value, length);
+		ngx_memory_barrier();
+		if (slot->seq != seq) {
+			continue;
+		}
+		value[length] = '\0';
+		fdmcf->cacheZoneHits++;
+		return value;
+	}
+	fdmcf->cacheZoneMisses++;
+	return NULL;
+}
+
+/**
+ * Add a value to the shared result cache zone, replacing an empty slot in the
+ * bucket or otherwise one in rotation. If another process is writing to the
+ * slot then the value is not added.
+ * @param fdmcf module main config.
+ * @param key of the evidence and header.
+ * @param check keyed hash of the evidence and header.
+ * @param value the escaped value string to copy into the zone.
+ * @param length of the value.
+ */
+static void
+ngx_http_51D_cache_zone_insert(
+	ngx_http_51D_main_conf_t *fdmcf,
+	uint64_t key,
+	uint64_t check,
+	u_char *value,
+	size_t length) {
+	ngx_uint_t i;
+	ngx_atomic_uint_t seq;
+	ngx_http_51D_cache_zone_sh_t *sh = fdmcf->cacheZoneSh;
+	ngx_http_51D_cache_zone_slot_t *slot, *victim = NULL;
+
+	if (length > sh->valueSize) {
 		return;
 	}
-	length--;
 
-	// If the buffer already contains characters, append the delimiter.
-	if (dst[0] != '\0') {
-		size_t delimiterLength = strlen(delimiter);
-		if (delimiterLength > length) {
-			return;
+	key = ngx_http_51D_cache_zone_key(fdmcf, key);
+	check = ngx_http_51D_cache_zone_check(fdmcf, check);
+	for (i = 0; i < FIFTYONE_DEGREES_CACHE_ZONE_WAYS; i++) {
+		slot = ngx_http_51D_cache_zone_slot(sh, key, i);
+		if (slot->key == key || slot->key == 0) {
+			victim = slot;
+			break;
 		}
-		strncat(dst, delimiter, length);
-		length -= delimiterLength;
+	}
+	if (victim == NULL) {
+		victim = ngx_http_51D_cache_zone_slot(
+			sh,
+			key,
+			fdmcf->cacheZoneMisses % FIFTYONE_DEGREES_CACHE_ZONE_WAYS);
 	}
 
-	// Append the value.
-	strncat(dst, val, length);
+	seq = victim->seq;
+	if ((seq & 1) || ngx_atomic_cmp_set(&victim->seq, seq, seq + 1) == 0) {
+		return;
+	}
+	ngx_memory_barrier();
+	victim->key = key;
+	victim->check = check;
+	victim->len = length;
+	ngx_memcpy(victim->value, value, length);
+	ngx_memory_barrier();
+	victim->seq = seq + 2;
 }
 
 /**
- * Check if a property being requested is a meta data property.
- * @param val the string value.
+ * Connection pool cleanup. Drops the values held for the connection. Their
+ * memory is freed with the pool.
+ * @param data the connection cache.
  */
-static bool is_metadata(char *val) {
-	return StringCompare(val, "Iterations") == 0 ||
-		StringCompare(val, "Drift") == 0 ||
-		StringCompare(val, "Difference") == 0 ||
-		StringCompare(val, "Method") == 0 ||
-		StringCompare(val, "UserAgents") == 0 ||
-		StringCompare(val, "MatchedNodes") == 0 ||
-		StringCompare(val, "DeviceId") == 0;
+static void
+ngx_http_51D_connection_cache_cleanup(void *data)
+{
+	ngx_http_51D_connection_cache_t *cache = data;
+	ngx_uint_t i;
+
+	for (i = 0; i < FIFTYONE_DEGREES_CONNECTION_CACHE_SIZE; i++) {
+		cache->values[i].key = 0;
+	}
 }
 
 /**
- * Create an empty ngx string from the http request pool.
- * @param r pointer to a http request
- * @return pointer to an empty ngx string
+ * Get the values held for the connection of a request, adding a cleanup to
+ * the connection's pool to hold them if there is none. The values held are
+ * dropped if the data set has been reloaded since they were added.
+ * @param fdmcf module main config.
+ * @param r the current HTTP request.
+ * @return the connection cache, or NULL if there was not enough memory.
  */
-static ngx_str_t* empty_string(ngx_http_request_t *r) {
-	ngx_str_t *str = (ngx_str_t*)ngx_palloc(r->pool, sizeof(ngx_str_t));
-	if (str == NULL) {
-		report_insufficient_memory_status(r->connection->log);
-		return NULL;
+static ngx_http_51D_connection_cache_t *
+ngx_http_51D_connection_cache_get(
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_http_request_t *r) {
+	ngx_connection_t *c = r->connection;
+	ngx_http_51D_connection_cache_t *cache;
+	ngx_pool_cleanup_t *cln;
+
+#if (NGX_HTTP_V2)
+	// The streams of an HTTP/2 connection each have their own pool, so the
+	// values are held for the connection the streams share.
+	if (r->stream != NULL) {
+		c = r->stream->connection->connection;
+	}
+#endif
+
+	for (cln = c->pool->cleanup; cln != NULL; cln = cln->next) {
+		if (cln->handler == ngx_http_51D_connection_cache_cleanup) {
+			cache = cln->data;
+			if (cache->generation != fdmcf->reloadGeneration) {
+				ngx_http_51D_connection_cache_cleanup(cache);
+				cache->generation = fdmcf->reloadGeneration;
+			}
+			return cache;
+		}
 	}
 
-	str->len = 0;
-	str->data = (u_char *)ngx_palloc(r->pool, 1);
-	if (str->data == NULL) {
+	cln = ngx_pool_cleanup_add(c->pool, sizeof(ngx_http_51D_connection_cache_t));
+	if (cln == NULL) {
 		report_insufficient_memory_status(r->connection->log);
 		return NULL;
 	}
-
-	str->data[0] = '\0';
-	return str;
+	cache = cln->data;
+	ngx_memzero(cache, sizeof(ngx_http_51D_connection_cache_t));
+	cache->pool = c->pool;
+	cache->generation = fdmcf->reloadGeneration;
+	cln->handler = ngx_http_51D_connection_cache_cleanup;
+	return cache;
 }
 
 /**
- * Search and get the evidence from the query string.
- * @param r the nginx http request
- * @param variableName the variable name to search for
- * @return the evidence
+ * Find a value held for a connection.
+ * @param cache the connection cache.
+ * @param key of the evidence and header.
+ * @return the value, or NULL if it is not held.
  */
 static ngx_str_t *
-get_evidence_from_query_string_base(ngx_http_request_t *r, ngx_str_t *variableName) {
-	u_char *src, *dst;
-	ngx_uint_t variableNameHash;
-	ngx_variable_value_t *variable;
-	ngx_str_t *evidence;
-
-	variableNameHash = ngx_hash_strlow(variableName->data,
-		variableName->data,
-		variableName->len);
-	variable = ngx_http_get_variable(r, variableName, variableNameHash);
-	if (variable->not_found == 0 && (int)variable->len > 0) {
-		evidence = (ngx_str_t *)ngx_palloc(r->pool, sizeof(ngx_str_t));
-		if (evidence == NULL) {
-			report_insufficient_memory_status(r->connection->log);
-			return NULL;
-		}
+ngx_http_51D_connection_cache_find(
+	ngx_http_51D_connection_cache_t *cache,
+	uint64_t key) {
+	ngx_uint_t i;
 
-		evidence->data =
-			(u_char *)ngx_palloc(
-				r->pool, sizeof(u_char) * (size_t)variable->len + 1);
-		if (evidence->data == NULL) {
-			report_insufficient_memory_status(r->connection->log);
-			return NULL;
+	for (i = 0; i < FIFTYONE_DEGREES_CONNECTION_CACHE_SIZE; i++) {
+		if (key != 0 && cache->values[i].key == key) {
+			return &cache->values[i].value;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Hold a value for a connection, replacing the values in rotation. The
+ * memory of the value replaced is reused where the new value fits in it,
+ * otherwise memory of at least twice the size is taken from the
+ * connection's pool.
+ * @param cache the connection cache.
+ * @param key of the evidence and header.
+ * @param value the escaped value string to copy.
+ * @param length of the value.
+ */
+static void
+ngx_http_51D_connection_cache_insert(
+	ngx_http_51D_connection_cache_t *cache,
+	uint64_t key,
+	u_char *value,
+	size_t length) {
+	ngx_http_51D_connection_value_t *entry;
+	size_t size;
+	u_char *data;
+
+	entry = &cache->values[cache->next];
+	if (entry->size < length + 1) {
+		size = ngx_max(length + 1, entry->size * 2);
+		data = ngx_pnalloc(cache->pool, size);
+		if (data == NULL) {
+			return;
+		}
+		entry->value.data = data;
+		entry->size = size;
+	}
+	cache->next = (cache->next + 1) % FIFTYONE_DEGREES_CONNECTION_CACHE_SIZE;
+	ngx_memcpy(entry->value.data, value, length);
+	entry->value.data[length] = '\0';
+	entry->value.len = length;
+	entry->key = key;
+}
+
+/**
+ * Free the response header values held for the matched profiles. The table
+ * is created again when values are next inserted.
+ * @param fdmcf 51Degrees main config holding the table.
+ */
+static void
+ngx_http_51D_resp_header_cache_free(ngx_http_51D_main_conf_t *fdmcf) {
+	ngx_uint_t i;
+
+	if (fdmcf->respHeaderCache == NULL) {
+		return;
+	}
+	for (i = 0; i < FIFTYONE_DEGREES_RESP_HEADER_CACHE_SIZE; i++) {
+		if (fdmcf->respHeaderCache[i].values != NULL) {
+			ngx_free(fdmcf->respHeaderCache[i].values);
+		}
+	}
+	ngx_free(fdmcf->respHeaderCache);
+	fdmcf->respHeaderCache = NULL;
+}
+
+/**
+ * Find the response header values held for the matched profiles, copying
+ * them to the request, as the entry can be replaced while the response
+ * headers are still in use.
+ * @param r the request to copy the values to.
+ * @param fdmcf 51Degrees main config holding the table.
+ * @param key hash of the matched profiles.
+ * @param values set to the value of each response header to set.
+ * @return NGX_OK, NGX_DECLINED if the values are not held, or NGX_ERROR if
+ * they could not be copied.
+ */
+static ngx_int_t
+ngx_http_51D_resp_header_cache_find(
+	ngx_http_request_t *r,
+	ngx_http_51D_main_conf_t *fdmcf,
+	uint64_t key,
+	ngx_str_t *values) {
+	ngx_http_51D_resp_header_entry_t *entry;
+	u_char *data;
+	size_t length = 0;
+	ngx_uint_t i;
+
+	if (fdmcf->respHeaderCache == NULL) {
+		return NGX_DECLINED;
+	}
+	entry = &fdmcf->respHeaderCache[key % FIFTYONE_DEGREES_RESP_HEADER_CACHE_SIZE];
+	if (entry->values == NULL || entry->key != key) {
+		return NGX_DECLINED;
+	}
+
+	for (i = 0; i < fdmcf->setRespHeaderCount; i++) {
+		length += entry->values[i].len + 1;
+	}
+	data = (u_char *)ngx_pnalloc(r->pool, length);
+	if (data == NULL) {
+		report_insufficient_memory_status(r->connection->log);
+		return NGX_ERROR;
+	}
+	for (i = 0; i < fdmcf->setRespHeaderCount; i++) {
+		values[i].data = data;
+		values[i].len = entry->values[i].len;
+		data = ngx_cpymem(
+			data, entry->values[i].data, entry->values[i].len + 1);
+	}
+	return NGX_OK;
+}
+
+/**
+ * Hold the response header values for the matched profiles, replacing any
+ * held in the same slot. The values and the strings they point to are
+ * copied into one block of memory.
+ * @param fdmcf 51Degrees main config holding the table.
+ * @param key hash of the matched profiles.
+ * @param values the value of each response header to set.
+ * @param log to report errors to.
+ */
+static void
+ngx_http_51D_resp_header_cache_insert(
+	ngx_http_51D_main_conf_t *fdmcf,
+	uint64_t key,
+	ngx_str_t *values,
+	ngx_log_t *log) {
+	ngx_http_51D_resp_header_entry_t *entry;
+	ngx_str_t *copy;
+	u_char *data;
+	size_t length;
+	ngx_uint_t i;
+
+	if (fdmcf->respHeaderCache == NULL) {
+		fdmcf->respHeaderCache = ngx_calloc(
+			FIFTYONE_DEGREES_RESP_HEADER_CACHE_SIZE *
+				sizeof(ngx_http_51D_resp_header_entry_t),
+			log);
+		if (fdmcf->respHeaderCache == NULL) {
+			return;
+		}
+	}
+
+	length = fdmcf->setRespHeaderCount * sizeof(ngx_str_t);
+	for (i = 0; i < fdmcf->setRespHeaderCount; i++) {
+		length += values[i].len + 1;
+	}
+	copy = ngx_alloc(length, log);
+	if (copy == NULL) {
+		return;
+	}
+	data = (u_char *)&copy[fdmcf->setRespHeaderCount];
+	for (i = 0; i < fdmcf->setRespHeaderCount; i++) {
+		copy[i].data = data;
+		copy[i].len = values[i].len;
+		data = ngx_cpymem(data, values[i].data, values[i].len);
+		*data++ = '\0';
+	}
+
+	entry = &fdmcf->respHeaderCache[key % FIFTYONE_DEGREES_RESP_HEADER_CACHE_SIZE];
+	if (entry->values != NULL) {
+		ngx_free(entry->values);
+	}
+	entry->key = key;
+	entry->values = copy;
+}
+
+/**
+ * Release a reference to a Javascript body, freeing it if there are no
+ * others. Also used as the cleanup of the requests sending the body.
+ * @param data the Javascript entry.
+ */
+static void
+ngx_http_51D_javascript_release(void *data) {
+	ngx_http_51D_javascript_entry_t *entry = data;
+
+	if (--entry->refs == 0) {
+		ngx_free(entry);
+	}
+}
+
+/**
+ * Release the Javascript bodies held by the worker. Bodies which are still
+ * being sent are freed when the requests sending them finish.
+ * @param fdmcf 51Degrees main config holding the table.
+ */
+static void
+ngx_http_51D_javascript_cache_free(ngx_http_51D_main_conf_t *fdmcf) {
+	ngx_uint_t i;
+
+	if (fdmcf->javascriptCache == NULL) {
+		return;
+	}
+	for (i = 0; i < FIFTYONE_DEGREES_JAVASCRIPT_CACHE_SIZE; i++) {
+		if (fdmcf->javascriptCache[i] != NULL) {
+			ngx_http_51D_javascript_release(fdmcf->javascriptCache[i]);
+		}
+	}
+	ngx_free(fdmcf->javascriptCache);
+	fdmcf->javascriptCache = NULL;
+}
+
+/**
+ * Find the Javascript body held for the matched profiles.
+ * @param fdmcf 51Degrees main config holding the table.
+ * @param key hash of the matched profiles and the body.
+ * @return the entry, or NULL if the body is not held.
+ */
+static ngx_http_51D_javascript_entry_t *
+ngx_http_51D_javascript_cache_find(
+	ngx_http_51D_main_conf_t *fdmcf,
+	uint64_t key) {
+	ngx_http_51D_javascript_entry_t *entry;
+
+	if (fdmcf->javascriptCache == NULL) {
+		return NULL;
+	}
+	entry = fdmcf->javascriptCache[key % FIFTYONE_DEGREES_JAVASCRIPT_CACHE_SIZE];
+	return entry != NULL && entry->key == key ? entry : NULL;
+}
+
+#if (NGX_ZLIB)
+/**
+ * Compress a body with gzip encoding.
+ * @param dest buffer of at least deflateBound bytes for the body.
+ * @param length set to the length of the encoded body.
+ * @param src the body to compress.
+ * @param srcLength length of the body.
+ * @return NGX_OK, or NGX_ERROR if the body could not be compressed.
+ */
+static ngx_int_t
+ngx_http_51D_gzip(
+	u_char *dest,
+	size_t *length,
+	u_char *src,
+	size_t srcLength) {
+	z_stream stream;
+	int rc;
+
+	ngx_memzero(&stream, sizeof(z_stream));
+	if (deflateInit2(
+		&stream,
+		Z_BEST_COMPRESSION,
+		Z_DEFLATED,
+		MAX_WBITS + 16,
+		MAX_MEM_LEVEL,
+		Z_DEFAULT_STRATEGY) != Z_OK) {
+		return NGX_ERROR;
+	}
+	stream.next_in = src;
+	stream.avail_in = srcLength;
+	stream.next_out = dest;
+	stream.avail_out = *length;
+	rc = deflate(&stream, Z_FINISH);
+	*length = stream.total_out;
+	deflateEnd(&stream);
+	return rc == Z_STREAM_END ? NGX_OK : NGX_ERROR;
+}
+#endif
+
+/**
+ * Hold the Javascript body for the matched profiles, replacing any held in
+ * the same slot. The body is compressed once here, so that requests which
+ * accept gzip encoding are sent the compressed body without the gzip filter.
+ * @param fdmcf 51Degrees main config holding the table.
+ * @param key hash of the matched profiles and the body.
+ * @param body the Javascript body to copy.
+ * @param log to report errors to.
+ * @return the entry, or NULL if it could not be allocated.
+ */
+static ngx_http_51D_javascript_entry_t *
+ngx_http_51D_javascript_cache_insert(
+	ngx_http_51D_main_conf_t *fdmcf,
+	uint64_t key,
+	ngx_str_t *body,
+	ngx_log_t *log) {
+	ngx_http_51D_javascript_entry_t *entry, **slot;
+	size_t gzipLength = 0;
+
+	if (fdmcf->javascriptCache == NULL) {
+		fdmcf->javascriptCache = ngx_calloc(
+			FIFTYONE_DEGREES_JAVASCRIPT_CACHE_SIZE *
+				sizeof(ngx_http_51D_javascript_entry_t *),
+			log);
+		if (fdmcf->javascriptCache == NULL) {
+			return NULL;
+		}
+	}
+
+#if (NGX_ZLIB)
+	gzipLength = deflateBound(NULL, body->len) + 18;
+#endif
+	entry = ngx_alloc(
+		sizeof(ngx_http_51D_javascript_entry_t) + body->len + gzipLength,
+		log);
+	if (entry == NULL) {
+		return NULL;
+	}
+	entry->key = key;
+	entry->refs = 1;
+	entry->identity.data = (u_char *)&entry[1];
+	entry->identity.len = body->len;
+	ngx_memcpy(entry->identity.data, body->data, body->len);
+	entry->gzip.data = entry->identity.data + body->len;
+	entry->gzip.len = 0;
+#if (NGX_ZLIB)
+	if (ngx_http_51D_gzip(
+		entry->gzip.data,
+		&gzipLength,
+		body->data,
+		body->len) == NGX_OK &&
+		gzipLength < body->len) {
+		entry->gzip.len = gzipLength;
+	}
+#endif
+
+	slot = &fdmcf->javascriptCache[key % FIFTYONE_DEGREES_JAVASCRIPT_CACHE_SIZE];
+	if (*slot != NULL) {
+		ngx_http_51D_javascript_release(*slot);
+	}
+	*slot = entry;
+	return entry;
+}
+
+/**
+ * Keep a Javascript body until the request sending it finishes, as the
+ * worker can replace it in the meantime.
+ * @param r the request sending the body.
+ * @param entry the Javascript entry.
+ * @return NGX_OK, or NGX_ERROR if the cleanup could not be added.
+ */
+static ngx_int_t
+ngx_http_51D_javascript_acquire(
+	ngx_http_request_t *r,
+	ngx_http_51D_javascript_entry_t *entry) {
+	ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+	if (cln == NULL) {
+		report_insufficient_memory_status(r->connection->log);
+		return NGX_ERROR;
+	}
+	cln->handler = ngx_http_51D_javascript_release;
+	cln->data = entry;
+	entry->refs++;
+	return NGX_OK;
+}
+
+/**
+ * Set the strong ETag of a Javascript response. The tag is the hash of the
+ * data file and the matched profiles, with a suffix for the gzip encoded
+ * body. Any Last-Modified header, e.g. of the file the location serves, is
+ * removed as it does not apply to the Javascript.
+ * @param r the request to set the ETag for.
+ * @param fdmcf 51Degrees main config.
+ * @param key hash of the matched profiles and the body.
+ * @param gzip whether the gzip encoded body is sent.
+ * @return the ETag header, or NULL if it could not be allocated.
+ */
+static ngx_table_elt_t *
+ngx_http_51D_set_javascript_etag(
+	ngx_http_request_t *r,
+	ngx_http_51D_main_conf_t *fdmcf,
+	uint64_t key,
+	ngx_uint_t gzip) {
+	ngx_table_elt_t *etag = r->headers_out.etag;
+	u_char *data;
+
+	data = (u_char *)ngx_pnalloc(r->pool, NGX_INT64_LEN + 8);
+	if (data == NULL) {
+		report_insufficient_memory_status(r->connection->log);
+		return NULL;
+	}
+	if (etag == NULL) {
+		etag = ngx_list_push(&r->headers_out.headers);
+		if (etag == NULL) {
+			report_insufficient_memory_status(r->connection->log);
+			return NULL;
+		}
+		ngx_str_set(&etag->key, "ETag");
+		etag->lowcase_key = (u_char *)"etag";
+		r->headers_out.etag = etag;
+	}
+	etag->hash = 1;
+	etag->value.data = data;
+	etag->value.len = ngx_sprintf(
+		data,
+		"\"%016xL%s\"",
+		ngx_http_51D_hash(fdmcf->dataSetTag, &key, sizeof(key)),
+		gzip ? "-gz" : "") - data;
+	ngx_http_clear_last_modified(r);
+	return etag;
+}
+
+/**
+ * Whether the If-None-Match header of the request matches an ETag. Entity
+ * tags are compared weakly, as they are for If-None-Match.
+ * @param r the request.
+ * @param etag the ETag of the response.
+ * @return 1 if the request's copy of the response is current, otherwise 0.
+ */
+static ngx_uint_t
+ngx_http_51D_etag_match(ngx_http_request_t *r, ngx_str_t *etag) {
+	u_char *start, *pos, *end;
+
+	if (r->headers_in.if_none_match == NULL) {
+		return 0;
+	}
+	pos = r->headers_in.if_none_match->value.data;
+	end = pos + r->headers_in.if_none_match->value.len;
+	while (pos < end) {
+		while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == ',')) {
+			pos++;
+		}
+		if (end - pos >= 2 && pos[0] == 'W' && pos[1] == '/') {
+			pos += 2;
+		}
+		start = pos;
+		while (pos < end && *pos != ',') {
+			pos++;
+		}
+		while (pos > start && (pos[-1] == ' ' || pos[-1] == '\t')) {
+			pos--;
+		}
+		if ((pos - start == 1 && *start == '*') ||
+			((size_t)(pos - start) == etag->len &&
+				ngx_strncmp(start, etag->data, etag->len) == 0)) {
+			return 1;
+		}
+		while (pos < end && *pos != ',') {
+			pos++;
+		}
+	}
+	return 0;
+}
+
+static int is_header_allowed_for_UA_UACH_mode(const char * const headerName) {
+	// strip '\0' at the end
+	static const size_t client_hint_prefix_length = sizeof(NGX_HTTP_51D_HEADER_PREFIX_CLIENT_HINT) - 1;
+	static const size_t user_agent_length = sizeof(NGX_HTTP_51D_HEADER_USER_AGENT) - 1;
+
+	// Unike standard `strncasecmp` from `string.h`, `ngx_strncasecmp` requires non-const pointers.
+	// Therefore we must use explicit casts.
+	return (!ngx_strncasecmp((u_char *)headerName, (u_char *)NGX_HTTP_51D_HEADER_PREFIX_CLIENT_HINT, client_hint_prefix_length)
+			|| !ngx_strncasecmp((u_char *)headerName, (u_char *)NGX_HTTP_51D_HEADER_USER_AGENT, user_agent_length)
+			) ? 1 : 0;
+}
+
+/**
+ * Initialise the index of the unique evidence headers in the data set on
+ * their lower case names, so that the evidence can be collected in a single
+ * pass over the request headers.
+ * @param pool pool to allocate the index from.
+ * @param log to report errors to.
+ * @param fdmcf pointer to the 51Degrees main config object.
+ * @param dataSet pointer to the 51Degrees Hash dataset.
+ * @return status.
+ */
+static ngx_int_t
+ngx_http_51D_init_evidence_headers(
+	ngx_pool_t *pool,
+	ngx_log_t *log,
+	ngx_http_51D_main_conf_t *fdmcf,
+	DataSetHash *dataSet) {
+	ngx_uint_t i;
+	ngx_array_t keys;
+	ngx_hash_key_t *hk;
+	ngx_hash_init_t hash;
+	ngx_http_51D_evidence_header_t *header;
+	const char *headerName;
+
+	fdmcf->evidenceHeaderCount = dataSet->b.b.uniqueHeaders->count;
+	fdmcf->evidenceHeaders = (ngx_http_51D_evidence_header_t *)ngx_palloc(
+		pool,
+		fdmcf->evidenceHeaderCount * sizeof(ngx_http_51D_evidence_header_t));
+	fdmcf->evidenceHeaderFound = (u_char *)ngx_pcalloc(
+		pool, fdmcf->evidenceHeaderCount + 1);
+	if (fdmcf->evidenceHeaders == NULL ||
+		fdmcf->evidenceHeaderFound == NULL ||
+		ngx_array_init(
+			&keys,
+			pool,
+			fdmcf->evidenceHeaderCount,
+			sizeof(ngx_hash_key_t)) != NGX_OK) {
+		return report_insufficient_memory_status(log);
+	}
+
+	for (i = 0; i < fdmcf->evidenceHeaderCount; i++) {
+		headerName = dataSet->b.b.uniqueHeaders->items[i].name;
+		header = &fdmcf->evidenceHeaders[i];
+		header->index = i;
+		header->name = headerName;
+		header->nameLength = ngx_strlen(headerName);
+		header->clientHints = is_header_allowed_for_UA_UACH_mode(headerName);
+
+		hk = ngx_array_push(&keys);
+		if (hk == NULL) {
+			return report_insufficient_memory_status(log);
+		}
+		hk->key.len = ngx_strlen(headerName);
+		hk->key.data = (u_char *)ngx_pnalloc(pool, hk->key.len);
+		if (hk->key.data == NULL) {
+			return report_insufficient_memory_status(log);
+		}
+		hk->key_hash = ngx_hash_strlow(
+			hk->key.data, (u_char *)headerName, hk->key.len);
+		hk->value = header;
+	}
+
+	hash.hash = &fdmcf->evidenceHeaderIndex;
+	hash.key = ngx_hash_key;
+	hash.max_size = 512;
+	hash.bucket_size = ngx_align(64, ngx_cacheline_size);
+	hash.name = "51Degrees evidence headers hash";
+	hash.pool = pool;
+	hash.temp_pool = NULL;
+	if (ngx_hash_init(&hash, keys.elts, keys.nelts) != NGX_OK) {
+		return NGX_ERROR;
+	}
+	return NGX_OK;
+}
+
+/**
+ * Initialise the index of the overridable properties in the data set on
+ * their lower case evidence names, so that cookies and query arguments can
+ * be matched to them in a single pass. The names include the 51D_ prefix
+ * where the data set uses it.
+ * @param pool pool to allocate the index from.
+ * @param log to report errors to.
+ * @param fdmcf pointer to the 51Degrees main config object.
+ * @param dataSet pointer to the 51Degrees Hash dataset.
+ * @return status.
+ */
+static ngx_int_t
+ngx_http_51D_init_overrides(
+	ngx_pool_t *pool,
+	ngx_log_t *log,
+	ngx_http_51D_main_conf_t *fdmcf,
+	DataSetHash *dataSet) {
+	ngx_uint_t i;
+	ngx_array_t keys;
+	ngx_hash_key_t *hk;
+	ngx_hash_init_t hash;
+	ngx_http_51D_override_t *override;
+	String *fdString;
+	size_t prefixLength;
+
+	fdmcf->overrideCount = dataSet->b.b.overridable != NULL ?
+		dataSet->b.b.overridable->count : 0;
+	fdmcf->overrideMaxLength = 0;
+	if (fdmcf->overrideCount == 0) {
+		return NGX_OK;
+	}
+	prefixLength = dataSet->b.b.overridable->prefix ? ngx_strlen("51D_") : 0;
+
+	fdmcf->overrides = (ngx_http_51D_override_t *)ngx_palloc(
+		pool, fdmcf->overrideCount * sizeof(ngx_http_51D_override_t));
+	if (fdmcf->overrides == NULL ||
+		ngx_array_init(
+			&keys,
+			pool,
+			fdmcf->overrideCount,
+			sizeof(ngx_hash_key_t)) != NGX_OK) {
+		return report_insufficient_memory_status(log);
+	}
+
+	for (i = 0; i < fdmcf->overrideCount; i++) {
+		fdString = (String *)
+			dataSet->b.b.overridable->items[i].available->name.data.ptr;
+		override = &fdmcf->overrides[i];
+		override->index = i;
+		override->name.len = prefixLength + fdString->size - 1;
+		override->name.data =
+			(u_char *)ngx_pnalloc(pool, override->name.len + 1);
+		if (override->name.data == NULL) {
+			return report_insufficient_memory_status(log);
+		}
+		ngx_memcpy(override->name.data, "51D_", prefixLength);
+		ngx_memcpy(
+			override->name.data + prefixLength,
+			&fdString->value,
+			fdString->size - 1);
+		override->name.data[override->name.len] = '\0';
+		if (override->name.len > fdmcf->overrideMaxLength) {
+			fdmcf->overrideMaxLength = override->name.len;
+		}
+
+		hk = ngx_array_push(&keys);
+		if (hk == NULL) {
+			return report_insufficient_memory_status(log);
+		}
+		hk->key.len = override->name.len;
+		hk->key.data = (u_char *)ngx_pnalloc(pool, hk->key.len);
+		if (hk->key.data == NULL) {
+			return report_insufficient_memory_status(log);
+		}
+		hk->key_hash = ngx_hash_strlow(
+			hk->key.data, override->name.data, hk->key.len);
+		hk->value = override;
+	}
+
+	fdmcf->overrideLowerName = (u_char *)ngx_pnalloc(
+		pool, fdmcf->overrideMaxLength + 1);
+	fdmcf->overrideValues = (ngx_str_t *)ngx_palloc(
+		pool, fdmcf->overrideCount * 2 * sizeof(ngx_str_t));
+	if (fdmcf->overrideLowerName == NULL || fdmcf->overrideValues == NULL) {
+		return report_insufficient_memory_status(log);
+	}
+
+	hash.hash = &fdmcf->overrideIndex;
+	hash.key = ngx_hash_key;
+	hash.max_size = 512;
+	hash.bucket_size = ngx_align(64, ngx_cacheline_size);
+	hash.name = "51Degrees overrides hash";
+	hash.pool = pool;
+	hash.temp_pool = NULL;
+	if (ngx_hash_init(&hash, keys.elts, keys.nelts) != NGX_OK) {
+		return NGX_ERROR;
+	}
+	return NGX_OK;
+}
+
+/**
+ * Build everything the requests need from the data set: the resolved
+ * properties of the headers and bodies to set, and the indexes of evidence
+ * headers and overrides. This is done once for each data set, so nothing is
+ * looked up by name or formatted when a request is processed. The indexes
+ * are held in a pool of their own, which is replaced when the data set
+ * changes. The evidence array reused by each match is also sized here, and
+ * the profile cache, response header values and Javascript bodies emptied.
+ * The indexes are built aside, and only replace the ones in use once all of
+ * them have been built, so a failure leaves the old ones in place.
+ * @param cycle the current nginx cycle.
+ * @param fdmcf pointer to the 51Degrees main config object.
+ * @param dataSet pointer to the 51Degrees Hash dataset.
+ * @param generation of the data set. A data set at a new address may be in
+ * the same generation, and a new one at the address of an old one, so the
+ * generation identifies the data set the indexes were built from.
+ * @return ngx_int_t nginx status.
+ */
+static ngx_int_t
+ngx_http_51D_index_data_set(
+	ngx_cycle_t *cycle,
+	ngx_http_51D_main_conf_t *fdmcf,
+	DataSetHash *dataSet,
+	ngx_atomic_uint_t generation) {
+	ngx_int_t status;
+	ngx_uint_t i;
+	ngx_pool_t *pool;
+	ngx_http_51D_data_to_set **dataToSet;
+	ngx_http_51D_main_conf_t indexes;
+	EvidenceKeyValuePairArray *evidence;
+
+	if (fdmcf->dataSetPool != NULL &&
+		fdmcf->indexedGeneration == generation) {
+		return NGX_OK;
+	}
+
+	// Resolve the properties of all the headers and bodies to set.
+	dataToSet = fdmcf->dataToSet->elts;
+	for (i = 0; i < fdmcf->dataToSet->nelts; i++) {
+		if ((status = ngx_http_51D_resolve_properties(
+			cycle, dataSet, dataToSet[i])) != NGX_OK) {
+			return status;
+		}
+	}
+
+	// Response headers are found from the data set when the process starts,
+	// and their properties resolved again for a reloaded data set.
+	for (i = 0; i < fdmcf->setRespHeaderCount; i++) {
+		if ((status = ngx_http_51D_resolve_properties(
+			cycle, dataSet, &fdmcf->setRespHeader[i])) != NGX_OK) {
+			return status;
+		}
+	}
+
+	// Initialise the indexes of evidence headers and overrides.
+	pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, cycle->log);
+	if (pool == NULL) {
+		return report_insufficient_memory_status(cycle->log);
+	}
+	ngx_memzero(&indexes, sizeof(indexes));
+	if ((status = ngx_http_51D_init_evidence_headers(
+		pool, cycle->log, &indexes, dataSet)) != NGX_OK ||
+		(status = ngx_http_51D_init_overrides(
+		pool, cycle->log, &indexes, dataSet)) != NGX_OK) {
+		ngx_destroy_pool(pool);
+		return status;
+	}
+
+	// Create the evidence array for the matches. A header can be found in
+	// the request headers and the query string, and an override in a cookie
+	// and the query string, so each can add two items.
+	evidence = EvidenceCreate(
+		(uint32_t)(indexes.evidenceHeaderCount + indexes.overrideCount) * 2);
+	if (evidence == NULL) {
+		ngx_destroy_pool(pool);
+		return report_insufficient_memory_status(cycle->log);
+	}
+
+	fdmcf->evidenceHeaderIndex = indexes.evidenceHeaderIndex;
+	fdmcf->evidenceHeaders = indexes.evidenceHeaders;
+	fdmcf->evidenceHeaderCount = indexes.evidenceHeaderCount;
+	fdmcf->evidenceHeaderFound = indexes.evidenceHeaderFound;
+	fdmcf->overrideIndex = indexes.overrideIndex;
+	fdmcf->overrides = indexes.overrides;
+	fdmcf->overrideCount = indexes.overrideCount;
+	fdmcf->overrideMaxLength = indexes.overrideMaxLength;
+	fdmcf->overrideLowerName = indexes.overrideLowerName;
+	fdmcf->overrideValues = indexes.overrideValues;
+
+	if (fdmcf->evidence != NULL) {
+		EvidenceFree(fdmcf->evidence);
+	}
+	fdmcf->evidence = evidence;
+	if (fdmcf->dataSetPool != NULL) {
+		ngx_destroy_pool(fdmcf->dataSetPool);
+	}
+	fdmcf->dataSetPool = pool;
+	fdmcf->indexedGeneration = generation;
+
+	// Profiles are only the same within a data set, so the profile cache
+	// starts empty for each one.
+	if (fdmcf->profileCacheSize > 0) {
+		if (fdmcf->profileCache != NULL) {
+			ngx_http_51D_cache_free(fdmcf->profileCache);
+		}
+		fdmcf->profileCache = ngx_http_51D_cache_create(
+			cycle->log, fdmcf->profileCacheSize);
+		if (fdmcf->profileCache == NULL) {
+			return report_insufficient_memory_status(cycle->log);
+		}
+	}
+	ngx_http_51D_resp_header_cache_free(fdmcf);
+	ngx_http_51D_javascript_cache_free(fdmcf);
+	fdmcf->dataSetTag = ngx_http_51D_hash(
+		FIFTYONE_DEGREES_HASH_OFFSET,
+		&dataSet->header,
+		sizeof(dataSet->header));
+	return NGX_OK;
+}
+
+#if (NGX_THREADS)
+/**
+ * Free a match created for the thread pool, along with its results and
+ * evidence.
+ * @param match to free.
+ */
+static void
+ngx_http_51D_thread_match_free(ngx_http_51D_thread_match_t *match)
+{
+	if (match->results != NULL) {
+		ResultsHashFree(match->results);
+	}
+	if (match->evidence != NULL) {
+		EvidenceFree(match->evidence);
+	}
+	ngx_free(match);
+}
+
+#endif
+
+/**
+ * Close the listening sockets and connections the helper process inherits
+ * from the worker, so that connections the worker closes are not kept open
+ * while the helper reads the data file. Closing the helper's copies does not
+ * affect the worker's.
+ * @param cycle the current nginx cycle.
+ */
+static void
+ngx_http_51D_close_inherited(ngx_cycle_t *cycle)
+{
+	ngx_uint_t i;
+	ngx_listening_t *ls = cycle->listening.elts;
+	ngx_connection_t *c = cycle->connections;
+
+	for (i = 0; i < cycle->connection_n; i++) {
+		if (c[i].fd != (ngx_socket_t)-1) {
+			close(c[i].fd);
+			c[i].fd = (ngx_socket_t)-1;
+		}
+	}
+	for (i = 0; i < cycle->listening.nelts; i++) {
+		// Listening sockets with a connection were closed above.
+		if (ls[i].connection == NULL && ls[i].fd != (ngx_socket_t)-1) {
+			close(ls[i].fd);
+			ls[i].fd = (ngx_socket_t)-1;
+		}
+	}
+}
+
+/**
+ * Load a data file which has been replaced, in the helper process started by
+ * ngx_http_51D_check_data_file. The file is only loaded if its contents
+ * differ from the file last loaded. The file is read and checksummed, and
+ * copied into the shared memory zone, without the zone's lock, which is only
+ * held while memory is allocated from the zone and the data set is built
+ * over the copy. The new data set replaces the old one in the resource
+ * manager, which frees the old one once no process uses it. The worker
+ * processes move on to it when they see the generation change.
+ * @param fdmcf module main config.
+ * @param id identity of the data file.
+ * @param log the log to write to.
+ */
+static void
+ngx_http_51D_reload_data_file(
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_http_51D_file_id_t *id,
+	ngx_log_t *log)
+{
+	uint64_t checksum;
+	u_char *map;
+	void *copy;
+	size_t size = 0;
+	DataSetHash *dataSet;
+
+	map = ngx_http_51D_map_reload_file(fdmcf, &size, log);
+	if (map == NULL) {
+		return;
+	}
+	checksum = ngx_http_51D_hash(FIFTYONE_DEGREES_HASH_OFFSET, map, size);
+	ngx_http_51D_reload->loaded = *id;
+	if (checksum == ngx_http_51D_reload->checksum ||
+		ngx_http_51D_per_worker(fdmcf)) {
+		munmap(map, size);
+		if (checksum != ngx_http_51D_reload->checksum) {
+			// Each worker process reloads its own resource manager.
+			ngx_http_51D_reload->checksum = checksum;
+			ngx_atomic_fetch_add(&ngx_http_51D_reload->generation, 1);
+		}
+		// Otherwise the file has been touched or copied, but not changed.
+		return;
+	}
+	ngx_http_51D_reload->checksum = checksum;
+
+	ngx_http_51D_shm_enter();
+	copy = Malloc(size);
+	ngx_http_51D_shm_leave();
+	if (copy == NULL) {
+		munmap(map, size);
+		report_insufficient_memory_status(log);
+		return;
+	}
+	ngx_memcpy(copy, map, size);
+	munmap(map, size);
+
+	EXCEPTION_CREATE
+	ngx_http_51D_shm_enter();
+	fiftyoneDegreesHashReloadManagerFromMemory(
+		fdmcf->resourceManager,
+		copy,
+		(long)size,
+		exception);
+	if (EXCEPTION_OKAY) {
+		// The copy is freed with the data set built over it.
+		dataSet = (DataSetHash *)DataSetGet(fdmcf->resourceManager);
+		if (dataSet->b.b.memoryToFree == NULL) {
+			dataSet->b.b.memoryToFree = copy;
+		}
+		DataSetRelease((DataSetBase *)dataSet);
+	}
+	else {
+		Free(copy);
+	}
+	ngx_http_51D_shm_leave();
+	if (EXCEPTION_FAILED) {
+		// The old data set is still used, and the file is not loaded again
+		// until it changes.
+		report_status(
+			log,
+			exception->status,
+			(const char *)fdmcf->dataFile.data);
+		return;
+	}
+	ngx_atomic_fetch_add(&ngx_http_51D_reload->generation, 1);
+	ngx_log_error(
+		NGX_LOG_NOTICE,
+		log,
+		0,
+		"51Degrees reloaded data file \"%V\".",
+		&fdmcf->dataFile);
+}
+
+/**
+ * Check whether the data file has been replaced. A changed file is only
+ * loaded once it is the same at two checks in a row, so one which is still
+ * being written is not loaded. The file is read and loaded by a helper
+ * process, so the worker's event loop is not held up while the file is
+ * read, and the lock of the shared memory zone is not held by the worker.
+ * The helper has its own memory functions, so the worker's allocations are
+ * unaffected while the zone's are used to load the data set. Only the first
+ * worker process checks the file, and only one helper runs at a time.
+ * @param fdmcf module main config.
+ * @param log the log to write to.
+ */
+static void
+ngx_http_51D_check_data_file(ngx_http_51D_main_conf_t *fdmcf, ngx_log_t *log)
+{
+	ngx_http_51D_file_id_t id;
+	ngx_pid_t pid;
+
+	if (ngx_http_51D_reload->running) {
+		// The helper is still loading the last file seen, unless it ended
+		// without clearing the flag, e.g. it was killed. Its PID may have
+		// been reused once the worker has reaped it, so it is only used to
+		// find a helper which has gone.
+		if (kill(ngx_http_51D_reload->pid, 0) == 0 ||
+			ngx_errno != NGX_ESRCH) {
+			return;
+		}
+		ngx_http_51D_reload->running = 0;
+	}
+
+	if (ngx_http_51D_get_file_id(fdmcf, &id, log) != NGX_OK ||
+		ngx_http_51D_file_id_equal(&id, &ngx_http_51D_reload->loaded)) {
+		return;
+	}
+	if (ngx_http_51D_file_id_equal(&id, &fdmcf->reloadPending) == 0) {
+		// Wait for the file to stop changing.
+		fdmcf->reloadPending = id;
+		return;
+	}
+
+	ngx_http_51D_reload->running = 1;
+	pid = fork();
+	switch (pid) {
+
+	case -1:
+		// Try again at the next check.
+		ngx_http_51D_reload->running = 0;
+		ngx_log_error(
+			NGX_LOG_ALERT,
+			log,
+			ngx_errno,
+			"fork() failed while reloading 51Degrees data file \"%V\"",
+			&fdmcf->dataFile);
+		return;
+
+	case 0:
+		// The worker reaps the helper when it exits.
+		ngx_pid = ngx_getpid();
+		ngx_process = NGX_PROCESS_HELPER;
+		ngx_http_51D_close_inherited((ngx_cycle_t *)ngx_cycle);
+		ngx_http_51D_reload_data_file(fdmcf, &id, log);
+		ngx_memory_barrier();
+		ngx_http_51D_reload->running = 0;
+		_exit(0);
+
+	default:
+		ngx_log_debug1(
+			NGX_LOG_DEBUG_ALL,
+			log,
+			0,
+			"51Degrees started reload process %P",
+			pid);
+		ngx_http_51D_reload->pid = pid;
+	}
+}
+
+/**
+ * Move the process on to the data set which replaced the one it uses, if
+ * the data file has been reloaded. The results, indexes and caches built
+ * from the old data set are replaced, and the process releases the old
+ * data set so that it can be freed.
+ * @param fdmcf module main config.
+ * @param cycle the current nginx cycle.
+ */
+static void
+ngx_http_51D_refresh_data_set(
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_cycle_t *cycle)
+{
+	ngx_atomic_uint_t generation = ngx_http_51D_reload->generation;
+	DataSetHash *dataSet;
+	ResultsHash *results;
+
+	if (generation == fdmcf->reloadGeneration) {
+		return;
+	}
+#if (NGX_THREADS)
+	// Releasing a data set in the shared memory zone swaps the memory
+	// functions, which thread pool tasks may be using, so the process moves
+	// on at the next check after they complete.
+	if (fdmcf->threadMatchesPosted > 0 &&
+		ngx_http_51D_per_worker(fdmcf) == 0) {
+		return;
+	}
+#endif
+
+	if (ngx_http_51D_per_worker(fdmcf)) {
+		EXCEPTION_CREATE
+		fiftyoneDegreesHashReloadManagerFromFile(
+			fdmcf->resourceManager,
+			(const char *)fdmcf->dataFile.data,
+			exception);
+		if (EXCEPTION_FAILED) {
+			// Carry on with the old data set until the file changes again.
+			report_status(
+				cycle->log,
+				exception->status,
+				(const char *)fdmcf->dataFile.data);
+			fdmcf->reloadGeneration = generation;
+			return;
+		}
+	}
+
+	dataSet = (DataSetHash *)DataSetGet(fdmcf->resourceManager);
+	results = ResultsHashCreate(
+		fdmcf->resourceManager,
+		dataSet->b.b.overridable != NULL ?
+			dataSet->b.b.overridable->count : 0);
+	if (results == NULL ||
+		ngx_http_51D_index_data_set(
+			cycle, fdmcf, dataSet, generation) != NGX_OK) {
+		// Carry on with the old data set, and try again at the next check.
+		ngx_log_error(
+			NGX_LOG_ALERT,
+			cycle->log,
+			0,
+			"51Degrees could not use the reloaded data file \"%V\".",
+			&fdmcf->dataFile);
+		ngx_http_51D_release_enter(fdmcf);
+		if (results != NULL) {
+			ResultsHashFree(results);
+		}
+		DataSetRelease((DataSetBase *)dataSet);
+		ngx_http_51D_release_leave(fdmcf);
+		return;
+	}
+
+	// Releasing the old results may free the old data set.
+	ngx_http_51D_release_enter(fdmcf);
+	ResultsHashFree(fdmcf->results);
+#if (NGX_THREADS)
+	ngx_http_51D_thread_match_t *match;
+	while (fdmcf->freeThreadMatches != NULL) {
+		match = fdmcf->freeThreadMatches;
+		fdmcf->freeThreadMatches = match->next;
+		ngx_http_51D_thread_match_free(match);
+	}
+#endif
+	DataSetRelease((DataSetBase *)dataSet);
+	ngx_http_51D_release_leave(fdmcf);
+	fdmcf->results = results;
+	fdmcf->reloadGeneration = generation;
+	fdmcf->matchSequence++;
+
+	// Cached values are from the old data set.
+	if (fdmcf->cache != NULL) {
+		ngx_http_51D_cache_free(fdmcf->cache);
+		fdmcf->cache = ngx_http_51D_cache_create(cycle->log, fdmcf->cacheSize);
+		if (fdmcf->cache == NULL) {
+			report_insufficient_memory_status(cycle->log);
+		}
+	}
+	ngx_http_51D_set_cache_zone_fingerprint(fdmcf);
+}
+
+/**
+ * Reload timer handler. The first worker process checks the data file, then
+ * each process moves on to a reloaded data set.
+ * @param ev the timer event, whose data is the module main config.
+ */
+static void
+ngx_http_51D_reload_handler(ngx_event_t *ev)
+{
+	ngx_http_51D_main_conf_t *fdmcf = ev->data;
+
+	if (ngx_exiting) {
+		return;
+	}
+	if (ngx_worker == 0) {
+		ngx_http_51D_check_data_file(fdmcf, ev->log);
+	}
+	ngx_http_51D_refresh_data_set(fdmcf, (ngx_cycle_t *)ngx_cycle);
+	ngx_add_timer(ev, fdmcf->reloadInterval);
+}
+
+/**
+ * Initialise a resource manager for this worker process only, used by the
+ * performance profiles which read the data file as needed. Memory is
+ * allocated by the process, and the process has its own file handles and
+ * caches.
+ * @param cycle the current nginx cycle.
+ * @param fdmcf module main config.
+ * @return ngx_int_t nginx status.
+ */
+static ngx_int_t
+ngx_http_51D_init_worker_resource_manager(
+	ngx_cycle_t *cycle,
+	ngx_http_51D_main_conf_t *fdmcf)
+{
+	ResourceManager *manager;
+	ConfigHash config = get_config_hash(fdmcf);
+	PropertiesRequired properties = get_properties_hash(fdmcf);
+
+	manager = (ResourceManager *)ngx_calloc(sizeof(ResourceManager), cycle->log);
+	if (manager == NULL) {
+		return report_insufficient_memory_status(cycle->log);
+	}
+
+	EXCEPTION_CREATE
+	HashInitManagerFromFile(
+		manager,
+		&config,
+		&properties,
+		(const char *)fdmcf->dataFile.data,
+		exception);
+	if (EXCEPTION_FAILED) {
+		ngx_free(manager);
+		return report_status(
+			cycle->log,
+			exception->status,
+			(const char *)fdmcf->dataFile.data);
+	}
+	fdmcf->resourceManager = manager;
+	ngx_log_error(
+		NGX_LOG_INFO,
+		cycle->log,
+		0,
+		"51Degrees worker process %P loaded its own data set from \"%V\".",
+		ngx_pid,
+		&fdmcf->dataFile);
+	return NGX_OK;
+}
+
+/**
+ * Init process function. Creates a result set from the shared resource
+ * manager.
+ * This result set is local to the process.
+ * Here is where the ResultsHash will be initialised.
+ * @param cycle the current nginx cycle.
+ * @return ngx_int_t nginx status.
+ */
+static ngx_int_t
+ngx_http_51D_init_process(ngx_cycle_t *cycle)
+{
+	ngx_int_t status;
+	ngx_http_51D_main_conf_t *fdmcf;
+
+	if (ngx_http_51D_shm_resource_manager == NULL) {
+		return NGX_OK;
+	}
+	fdmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_51D_module);
+	fdmcf->cacheSeed = fdmcf->cacheZoneSh != NULL ?
+		fdmcf->cacheZoneSh->seed :
+		((uint64_t)ngx_random() << 32) ^ (uint64_t)ngx_random();
+	// The generation is read first, so a data set reloaded from here on is
+	// picked up by the first check.
+	fdmcf->reloadGeneration = ngx_http_51D_reload->generation;
+	if (ngx_http_51D_per_worker(fdmcf) &&
+		(status = ngx_http_51D_init_worker_resource_manager(
+			cycle, fdmcf)) != NGX_OK) {
+		return status;
+	}
+	DataSetHash *dataSet = (DataSetHash *)DataSetGet(fdmcf->resourceManager);
+	ngx_uint_t overridesCount =
+		dataSet->b.b.overridable != NULL ? dataSet->b.b.overridable->count : 0;
+
+	// A data set over the mapped file holds no copy of the data to free.
+	if (fdmcf->loadMode == ngx_http_51D_load_mode_mmap &&
+		fdmcf->dataFileMap != NULL &&
+		dataSet->b.b.memoryToFree == NULL) {
+		ngx_log_error(
+			NGX_LOG_INFO,
+			cycle->log,
+			0,
+			"51Degrees data set uses the data file \"%V\" mapped at %p.",
+			&fdmcf->dataFile,
+			fdmcf->dataFileMap);
+	}
+	
+	// There can only be one result per unique header, so the max number of results
+	// is the number of unique headers.
+	fdmcf->results = ResultsHashCreate(
+		fdmcf->resourceManager,
+		overridesCount);
+
+	// Build the properties and indexes used by each request.
+	if ((status = ngx_http_51D_index_data_set(
+		cycle, fdmcf, dataSet, fdmcf->reloadGeneration)) != NGX_OK) {
+		DataSetRelease((DataSetBase *)dataSet);
+		return status;
+	}
+	ngx_http_51D_set_cache_zone_fingerprint(fdmcf);
+
+	// Initialise the response headers array.
+	if ((status = initRespHeaders(cycle, fdmcf, dataSet)) != NGX_OK) {
+		return status;
+	};
+
+	// Release the dataset
+	DataSetRelease((DataSetBase *)dataSet);
+
+	if (fdmcf->results == NULL) {
+		return report_insufficient_memory_status(cycle->log);
+	}
+
+	// Create the result cache if one has been configured.
+	if (fdmcf->cacheSize > 0) {
+		fdmcf->cache = ngx_http_51D_cache_create(cycle->log, fdmcf->cacheSize);
+		if (fdmcf->cache == NULL) {
+			return report_insufficient_memory_status(cycle->log);
+		}
+	}
+
+	// Check the data file for changes at each interval.
+	if (fdmcf->reloadInterval > 0) {
+		fdmcf->reloadEvent.handler = ngx_http_51D_reload_handler;
+		fdmcf->reloadEvent.data = fdmcf;
+		fdmcf->reloadEvent.log = cycle->log;
+		fdmcf->reloadEvent.cancelable = 1;
+		ngx_add_timer(&fdmcf->reloadEvent, fdmcf->reloadInterval);
+	}
+
+	// Increment the workers which are using the dataset.
+	ngx_atomic_fetch_add(ngx_http_51D_worker_count, 1);
+	return NGX_OK;
+}
+
+/**
+ * Exit process function. Frees the results set that was created on process
+ * init.
+ * @param cycle the current nginx cycle.
+ */
+void
+ngx_http_51D_exit_process(ngx_cycle_t *cycle)
+{
+	ngx_http_51D_main_conf_t *fdmcf;
+
+	if (ngx_http_51D_shm_resource_manager == NULL) {
+		return;
+	}
+
+	fdmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_51D_module);
+
+	// The results may hold the last reference to a data set which has been
+	// replaced by a reload, so they are freed in the shared memory zone.
+	// Requests wait for their thread pool tasks, so none are in progress
+	// when the process exits.
+	ngx_http_51D_release_enter(fdmcf);
+	ResultsHashFree(fdmcf->results);
+#if (NGX_THREADS)
+	ngx_http_51D_thread_match_t *match;
+	while (fdmcf->freeThreadMatches != NULL) {
+		match = fdmcf->freeThreadMatches;
+		fdmcf->freeThreadMatches = match->next;
+		ngx_http_51D_thread_match_free(match);
+	}
+	while (fdmcf->staleThreadMatches != NULL) {
+		match = fdmcf->staleThreadMatches;
+		fdmcf->staleThreadMatches = match->next;
+		ngx_http_51D_thread_match_free(match);
+	}
+#endif
+	ngx_http_51D_release_leave(fdmcf);
+
+	if (ngx_http_51D_per_worker(fdmcf) && fdmcf->resourceManager != NULL) {
+		ResourceManagerFree(fdmcf->resourceManager);
+		ngx_free(fdmcf->resourceManager);
+		fdmcf->resourceManager = NULL;
+	}
+
+	if (fdmcf->evidence != NULL) {
+		EvidenceFree(fdmcf->evidence);
+		fdmcf->evidence = NULL;
+	}
+	if (fdmcf->dataSetPool != NULL) {
+		ngx_destroy_pool(fdmcf->dataSetPool);
+		fdmcf->dataSetPool = NULL;
+	}
+
+	if (fdmcf->cache != NULL) {
+		ngx_log_error(
+			NGX_LOG_INFO,
+			cycle->log,
+			0,
+			"51Degrees result cache hits %ui, misses %ui.",
+			fdmcf->cache->hits,
+			fdmcf->cache->misses);
+		ngx_http_51D_cache_free(fdmcf->cache);
+		fdmcf->cache = NULL;
+	}
+	if (fdmcf->profileCache != NULL) {
+		ngx_log_error(
+			NGX_LOG_INFO,
+			cycle->log,
+			0,
+			"51Degrees profile cache hits %ui, misses %ui.",
+			fdmcf->profileCache->hits,
+			fdmcf->profileCache->misses);
+		ngx_http_51D_cache_free(fdmcf->profileCache);
+		fdmcf->profileCache = NULL;
+	}
+	ngx_http_51D_resp_header_cache_free(fdmcf);
+	ngx_http_51D_javascript_cache_free(fdmcf);
+	if (fdmcf->cacheZoneSh != NULL) {
+		ngx_log_error(
+			NGX_LOG_INFO,
+			cycle->log,
+			0,
+			"51Degrees shared result cache hits %ui, misses %ui.",
+			fdmcf->cacheZoneHits,
+			fdmcf->cacheZoneMisses);
+	}
+	if (fdmcf->connectionCache == 1) {
+		ngx_log_error(
+			NGX_LOG_INFO,
+			cycle->log,
+			0,
+			"51Degrees connection cache hits %ui, misses %ui.",
+			fdmcf->connectionCacheHits,
+			fdmcf->connectionCacheMisses);
+	}
+#if (NGX_THREADS)
+	if (fdmcf->threadPoolUsed) {
+		ngx_log_error(
+			NGX_LOG_INFO,
+			cycle->log,
+			0,
+			"51Degrees thread pool matches %ui, worker matches %ui.",
+			fdmcf->threadPoolMatches,
+			fdmcf->workerMatches);
+	}
+#endif
+
+	// Decrement the worker count. Try 5 times if not succeed.
+	ngx_uint_t i;
+	for (
+		i = 5;
+		i > 0 && ngx_atomic_fetch_add(ngx_http_51D_worker_count, -1) != 1;
+		i--) {}
+}
+
+/**
+ * Exit master process. Frees resource created for the 51Degrees module.
+ * @param cycle the current nginx cycle.
+ */
+void
+ngx_http_51D_exit_master(ngx_cycle_t *cycle)
+{
+	ngx_slab_pool_t *shpool;
+	ResourceManager *resourceManager;
+	if (ngx_http_51D_shm_resource_manager == NULL) {
+		return;
+	}
+
+	resourceManager =
+		(ResourceManager *)ngx_http_51D_shm_resource_manager->data;
+	shpool = (ngx_slab_pool_t *)ngx_http_51D_shm_resource_manager->shm.addr;
+
+	// Lock the shared memory and free any memory allocated for the module
+	ngx_shmtx_lock(&shpool->mutex);
+	if (*ngx_http_51D_worker_count > 0) {
+		ngx_log_error(
+			NGX_LOG_WARN,
+			cycle->log,
+			0,
+			"51Degrees not all child processes has terminated at master process termination");
+	}
+
+	// All child process should have already been terminated at this point.
+	// Also once the master has terminated, any running worker process should
+	// not be of any use so proceed to free the resource.
+	Free = ngx_http_51D_shm_free;
+	FreeAligned = ngx_http_51D_shm_free;
+	if (resourceManager->active != NULL) {
+		ResourceManagerFree(resourceManager);
+	}
+	Free = MemoryStandardFree; 
+	FreeAligned = MemoryStandardFreeAligned;
+	if (ngx_http_51D_arena.start != NULL) {
+		ngx_slab_free_locked(shpool, ngx_http_51D_arena.start);
+		ngx_memzero(&ngx_http_51D_arena, sizeof(ngx_http_51D_arena_t));
+	}
+	ngx_http_51D_shm_free((void *)resourceManager);
+	ngx_http_51D_shm_free((void *)ngx_http_51D_worker_count);
+	if (ngx_http_51D_reload != NULL) {
+		ngx_http_51D_shm_free((void *)ngx_http_51D_reload);
+		ngx_http_51D_reload = NULL;
+	}
+	ngx_shmtx_unlock(&shpool->mutex);
+}
+
+/**
+ * Module definition. Set the module context, commands, type and init function.
+ */
+ngx_module_t ngx_http_51D_module = {
+	NGX_MODULE_V1,
+	&ngx_http_51D_module_ctx,      /* module context */
+	ngx_http_51D_commands,         /* module directives */
+	NGX_HTTP_MODULE,               /* module type */
+	NULL,                          /* init master */
+	ngx_http_51D_init_module,      /* init module */
+	ngx_http_51D_init_process,     /* init process */
+	NULL,                          /* init thread */
+	NULL,                          /* exit thread */
+	ngx_http_51D_exit_process,     /* exit process */
+	ngx_http_51D_exit_master,      /* exit master */
+	NGX_MODULE_V1_PADDING
+};
+
+/**
+ * Add value function. Appends a string to a list separated by the
+ * delimiter specified with 51D_valueSeparator, or a comma by default.
+ * Values which do not fit in the remaining space are truncated.
+ * @param delimiter to split values with.
+ * @param val the string to add to dst.
+ * @param dst the string to append the val to.
+ * @param length the space remaining in dst, including the null terminator.
+ */
+static void add_value(char *delimiter, char *val, char *dst, size_t length)
+{
+	// Reserve the byte for the null terminator written by strncat.
+	if (length == 0) {
+		return;
+	}
+	length--;
+
+	// If the buffer already contains characters, append the delimiter.
+	if (dst[0] != '\0') {
+		size_t delimiterLength = strlen(delimiter);
+		if (delimiterLength > length) {
+			return;
+		}
+		strncat(dst, delimiter, length);
+		length -= delimiterLength;
+	}
+
+	// Append the value.
+	strncat(dst, val, length);
+}
+
+/**
+ * Create an empty ngx string from the http request pool.
+ * @param r pointer to a http request
+ * @return pointer to an empty ngx string
+ */
+static ngx_str_t* empty_string(ngx_http_request_t *r) {
+	ngx_str_t *str = (ngx_str_t*)ngx_palloc(r->pool, sizeof(ngx_str_t));
+	if (str == NULL) {
+		report_insufficient_memory_status(r->connection->log);
+		return NULL;
+	}
+
+	str->len = 0;
+	str->data = (u_char *)ngx_palloc(r->pool, 1);
+	if (str->data == NULL) {
+		report_insufficient_memory_status(r->connection->log);
+		return NULL;
+	}
+
+	str->data[0] = '\0';
+	return str;
+}
+
+/**
+ * Search and get the evidence from the query string.
+ * @param r the nginx http request
+ * @param variableName the variable name to search for
+ * @return the evidence
+ */
+static ngx_str_t *
+get_evidence_from_query_string_base(ngx_http_request_t *r, ngx_str_t *variableName) {
+	u_char *src, *dst;
+	ngx_uint_t variableNameHash;
+	ngx_variable_value_t *variable;
+	ngx_str_t *evidence;
+
+	variableNameHash = ngx_hash_strlow(variableName->data,
+		variableName->data,
+		variableName->len);
+	variable = ngx_http_get_variable(r, variableName, variableNameHash);
+	if (variable->not_found == 0 && (int)variable->len > 0) {
+		evidence = (ngx_str_t *)ngx_palloc(r->pool, sizeof(ngx_str_t));
+		if (evidence == NULL) {
+			report_insufficient_memory_status(r->connection->log);
+			return NULL;
+		}
+
+		evidence->data =
+			(u_char *)ngx_palloc(
+				r->pool, sizeof(u_char) * (size_t)variable->len + 1);
+		if (evidence->data == NULL) {
+			report_insufficient_memory_status(r->connection->log);
+			return NULL;
 		}
 
 		src = variable->data;
 		dst = evidence->data;
-		ngx_unescape_uri(&dst, &src, variable->len, 0);
+		ngx_unescape_uri(&dst, &src, variable->len, 0);
+		evidence->len = dst - evidence->data;
+		evidence->data[evidence->len] = '\0';
+	}
+	else {
+		evidence = empty_string(r);
+	}
+	return evidence;
+}
+
+/**
+ * Get the module context of the request, creating it if this is the first
+ * time it is needed.
+ * @param r the nginx http request
+ * @return the context, or NULL if there was not enough memory.
+ */
+static ngx_http_51D_ctx_t *
+ngx_http_51D_get_ctx(ngx_http_request_t *r) {
+	ngx_http_51D_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_51D_module);
+	if (ctx == NULL) {
+		ctx = (ngx_http_51D_ctx_t *)ngx_pcalloc(
+			r->pool, sizeof(ngx_http_51D_ctx_t));
+		if (ctx == NULL) {
+			report_insufficient_memory_status(r->connection->log);
+			return NULL;
+		}
+		ngx_http_set_ctx(r, ctx, ngx_http_51D_module);
+	}
+	return ctx;
+}
+
+/**
+ * Get the arguments in the query string of the request. The query string is
+ * only parsed the first time this is called for the request. As with the
+ * $arg_ variables, arguments without a '=' are ignored.
+ * @param r the nginx http request
+ * @return array of ngx_http_51D_query_arg_t, or NULL if there was not enough
+ * memory.
+ */
+static ngx_array_t *
+get_query_args(ngx_http_request_t *r) {
+	u_char *p, *end, *next, *equals;
+	ngx_http_51D_query_arg_t *arg;
+	ngx_http_51D_ctx_t *ctx = ngx_http_51D_get_ctx(r);
+	if (ctx == NULL) {
+		return NULL;
+	}
+	if (ctx->queryArgs != NULL) {
+		return ctx->queryArgs;
+	}
+
+	ctx->queryArgs = ngx_array_create(
+		r->pool, 4, sizeof(ngx_http_51D_query_arg_t));
+	if (ctx->queryArgs == NULL) {
+		report_insufficient_memory_status(r->connection->log);
+		return NULL;
+	}
+
+	p = r->args.data;
+	end = p + r->args.len;
+	while (p < end) {
+		next = ngx_strlchr(p, end, '&');
+		if (next == NULL) {
+			next = end;
+		}
+		equals = ngx_strlchr(p, next, '=');
+		if (equals != NULL && equals > p) {
+			arg = ngx_array_push(ctx->queryArgs);
+			if (arg == NULL) {
+				report_insufficient_memory_status(r->connection->log);
+				return NULL;
+			}
+			arg->name.data = p;
+			arg->name.len = equals - p;
+			arg->value.data = equals + 1;
+			arg->value.len = next - (equals + 1);
+		}
+		p = next + 1;
+	}
+	return ctx->queryArgs;
+}
+
+/**
+ * Get the evidence with the name supplied from the query string. Names are
+ * compared without case, and the first argument with the name is used, as
+ * with the $arg_ variables.
+ * @param r the nginx http request
+ * @param name the name of the argument
+ * @param length the length of the name
+ * @return the unescaped evidence, or NULL if it is not in the query string or
+ * is empty.
+ */
+static ngx_str_t *
+get_evidence_from_query_args(
+	ngx_http_request_t *r,
+	const char *name,
+	size_t length) {
+	u_char *src, *dst;
+	ngx_uint_t i;
+	ngx_str_t *evidence;
+	ngx_http_51D_query_arg_t *arg;
+	ngx_array_t *args = get_query_args(r);
+	if (args == NULL) {
+		return NULL;
+	}
+
+	arg = args->elts;
+	for (i = 0; i < args->nelts; i++) {
+		if (arg[i].name.len != length ||
+			ngx_strncasecmp(arg[i].name.data, (u_char *)name, length) != 0) {
+			continue;
+		}
+		if (arg[i].value.len == 0) {
+			return NULL;
+		}
+
+		evidence = (ngx_str_t *)ngx_palloc(r->pool, sizeof(ngx_str_t));
+		if (evidence == NULL) {
+			report_insufficient_memory_status(r->connection->log);
+			return NULL;
+		}
+		evidence->data = (u_char *)ngx_pnalloc(r->pool, arg[i].value.len + 1);
+		if (evidence->data == NULL) {
+			report_insufficient_memory_status(r->connection->log);
+			return NULL;
+		}
+		src = arg[i].value.data;
+		dst = evidence->data;
+		ngx_unescape_uri(&dst, &src, arg[i].value.len, 0);
 		evidence->len = dst - evidence->data;
 		evidence->data[evidence->len] = '\0';
+		return evidence;
+	}
+	return NULL;
+}
+
+/**
+ * Add a string to the evidence of the match state and fold it into the key
+ * and check of the state, so that the result cache is keyed on the exact
+ * evidence used for the match.
+ * @param state the match state holding the evidence.
+ * @param prefix the type of evidence.
+ * @param field the name of the evidence.
+ * @param value the value of the evidence.
+ */
+static void
+add_evidence_string(
+	ngx_http_51D_match_state_t *state,
+	EvidencePrefix prefix,
+	const char *field,
+	const char *value) {
+	size_t fieldLength = ngx_strlen(field) + 1;
+	size_t valueLength = ngx_strlen(value) + 1;
+	EvidenceAddString(state->evidence, prefix, field, value);
+	state->key = ngx_http_51D_hash(state->key, &prefix, sizeof(prefix));
+	state->key = ngx_http_51D_hash(state->key, field, fieldLength);
+	state->key = ngx_http_51D_hash(state->key, value, valueLength);
+	state->check = ngx_http_51D_check_hash(
+		state->check, &prefix, sizeof(prefix));
+	state->check = ngx_http_51D_check_hash(state->check, field, fieldLength);
+	state->check = ngx_http_51D_check_hash(state->check, value, valueLength);
+}
+
+/**
+ * Find the override with the name supplied, comparing without case.
+ * @param fdmcf module main config holding the index of overrides
+ * @param name the name of a cookie or query argument
+ * @param length the length of the name
+ * @return the override, or NULL if the name is not an override.
+ */
+static ngx_http_51D_override_t *
+find_override(ngx_http_51D_main_conf_t *fdmcf, u_char *name, size_t length) {
+	u_char *lowerName = fdmcf->overrideLowerName;
+	ngx_uint_t hash;
+	if (length == 0 || length > fdmcf->overrideMaxLength) {
+		return NULL;
+	}
+	hash = ngx_hash_strlow(lowerName, name, length);
+	return ngx_hash_find(&fdmcf->overrideIndex, hash, lowerName, length);
+}
+
+/**
+ * Copy a value into the request pool as a null terminated string.
+ * @param r pointer to a http request
+ * @param value the value to copy
+ * @param unescape whether the value is a query argument to unescape
+ * @param copy the string to set to the copy
+ * @return NGX_OK, or NGX_ERROR if there was not enough memory.
+ */
+static ngx_int_t
+copy_evidence_value(
+	ngx_http_request_t *r,
+	u_char *value,
+	size_t length,
+	ngx_uint_t unescape,
+	ngx_str_t *copy) {
+	u_char *dst;
+	copy->data = (u_char *)ngx_pnalloc(r->pool, length + 1);
+	if (copy->data == NULL) {
+		report_insufficient_memory_status(r->connection->log);
+		return NGX_ERROR;
+	}
+	if (unescape) {
+		dst = copy->data;
+		ngx_unescape_uri(&dst, &value, length, 0);
+		copy->len = dst - copy->data;
 	}
 	else {
-		evidence = empty_string(r);
+		ngx_memcpy(copy->data, value, length);
+		copy->len = length;
+	}
+	copy->data[copy->len] = '\0';
+	return NGX_OK;
+}
+
+/**
+ * Find the override values in a Cookie header in a single pass. Where a
+ * cookie is repeated, the first value is used.
+ * @param fdmcf module main config holding the index of overrides
+ * @param r pointer to a http request
+ * @param header the value of a Cookie header
+ * @param values the values of the overrides, indexed as the overrides
+ * @return NGX_OK, or NGX_ERROR if there was not enough memory.
+ */
+static ngx_int_t
+find_override_cookies(
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_http_request_t *r,
+	ngx_str_t *header,
+	ngx_str_t *values) {
+	u_char *p = header->data, *end = header->data + header->len;
+	u_char *name, *nameEnd, *value;
+	ngx_http_51D_override_t *override;
+
+	while (p < end) {
+		// Skip to the start of the next cookie name.
+		while (p < end && (*p == ' ' || *p == ';' || *p == ',')) {
+			p++;
+		}
+		name = p;
+		while (p < end && *p != '=' && *p != ';' && *p != ',') {
+			p++;
+		}
+		nameEnd = p;
+		while (nameEnd > name && nameEnd[-1] == ' ') {
+			nameEnd--;
+		}
+		if (p == end || *p != '=') {
+			continue;
+		}
+
+		// The value runs to the next ';'.
+		p++;
+		while (p < end && *p == ' ') {
+			p++;
+		}
+		value = p;
+		while (p < end && *p != ';') {
+			p++;
+		}
+
+		override = find_override(fdmcf, name, nameEnd - name);
+		if (override != NULL && values[override->index].data == NULL &&
+			copy_evidence_value(
+				r, value, p - value, 0, &values[override->index]) != NGX_OK) {
+			return NGX_ERROR;
+		}
+	}
+	return NGX_OK;
+}
+
+/**
+ * Add evidence required by the Hash device detection from cookie and query
+ * string. Cookies and query arguments are each scanned once, and matched to
+ * the overridable properties using the index built when the process started.
+ * @param fdmcf module main config holding the index of overrides
+ * @param r pointer to a http request
+ * @param state the match state holding the evidence collection, whose
+ * overrides describe which sources to scan
+ * @return NGX_OK, or NGX_ERROR if there was not enough memory to copy the
+ * values.
+ */
+static ngx_int_t
+add_override_evidence_from_cookie_and_query(
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_http_request_t *r,
+	ngx_http_51D_match_state_t *state) {
+	ngx_uint_t i;
+	ngx_array_t *args;
+	ngx_http_51D_query_arg_t *arg;
+	ngx_http_51D_override_t *override;
+	ngx_str_t *cookieValues, *queryValues;
+
+	if (fdmcf->overrideCount == 0 ||
+		state->overrides == ngx_http_51D_overrides_off) {
+		return NGX_OK;
+	}
+	cookieValues = fdmcf->overrideValues;
+	queryValues = cookieValues + fdmcf->overrideCount;
+	ngx_memzero(cookieValues, fdmcf->overrideCount * 2 * sizeof(ngx_str_t));
+
+	// Find evidence in cookies
+	if (state->overrides & ngx_http_51D_overrides_cookie) {
+#if nginx_version >= 1023000
+		ngx_table_elt_t *cookie;
+		for (cookie = r->headers_in.cookie; cookie != NULL; cookie = cookie->next) {
+			if (find_override_cookies(
+				fdmcf, r, &cookie->value, cookieValues) != NGX_OK) {
+				return NGX_ERROR;
+			}
+		}
+#else
+		ngx_table_elt_t **cookies = r->headers_in.cookies.elts;
+		for (i = 0; i < r->headers_in.cookies.nelts; i++) {
+			if (find_override_cookies(
+				fdmcf, r, &cookies[i]->value, cookieValues) != NGX_OK) {
+				return NGX_ERROR;
+			}
+		}
+#endif
+	}
+
+	// Find evidence in query string
+	if ((state->overrides & ngx_http_51D_overrides_query) &&
+		(args = get_query_args(r)) != NULL) {
+		arg = args->elts;
+		for (i = 0; i < args->nelts; i++) {
+			override = find_override(fdmcf, arg[i].name.data, arg[i].name.len);
+			if (override != NULL &&
+				queryValues[override->index].data == NULL &&
+				arg[i].value.len > 0 &&
+				copy_evidence_value(
+					r,
+					arg[i].value.data,
+					arg[i].value.len,
+					1,
+					&queryValues[override->index]) != NGX_OK) {
+				return NGX_ERROR;
+			}
+		}
+	}
+
+	// Add the evidence in the order of the overridable properties, cookie
+	// before query string.
+	for (i = 0; i < fdmcf->overrideCount; i++) {
+		if (cookieValues[i].data != NULL) {
+			add_evidence_string(
+				state,
+				FIFTYONE_DEGREES_EVIDENCE_COOKIE,
+				(const char *)fdmcf->overrides[i].name.data,
+				(const char *)cookieValues[i].data);
+		}
+		if (queryValues[i].data != NULL && queryValues[i].len > 0) {
+			add_evidence_string(
+				state,
+				FIFTYONE_DEGREES_EVIDENCE_QUERY,
+				(const char *)fdmcf->overrides[i].name.data,
+				(const char *)queryValues[i].data);
+		}
+	}
+	return NGX_OK;
+}
+
+/**
+ * Create an evidence array and added the evidence from the http request.
+ * This should consider the evidence sent from cookies and query, since
+ * overrides are required by customer.
+ * This requires parsing the query string for the override values. For MVP
+ * might consider the override from cookies only.
+ * The evidence is set in the match state, along with a key which is the hash
+ * of the match mode and all the evidence added.
+ * @param fdmcf module main config holding the results and the index of
+ * evidence headers
+ * @param r the http request that contains the evidence
+ * @param state the match state to set the evidence in. The multi mode of the
+ * state describes which headers to use for evidence.
+ * @return an array of evidence
+ */
+static EvidenceKeyValuePairArray *get_evidence(
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_http_request_t *r,
+	ngx_http_51D_match_state_t *state) {
+	ngx_http_51D_multi_header_mode multiMode = state->multi;
+	ngx_http_51D_evidence_header_t *header;
+	ngx_list_part_t *part;
+	ngx_table_elt_t *h;
+	ngx_str_t *queryEvidence;
+	ngx_uint_t i;
+	u_char *found = fdmcf->evidenceHeaderFound;
+
+	// Reuse the worker's evidence array, which was sized for all the
+	// evidence the data set can use when the process started. Only one
+	// match is in progress at a time in a worker.
+	EvidenceKeyValuePairArray *evidence = fdmcf->evidence;
+	if (evidence != NULL) {
+		evidence->count = 0;
+	}
+	state->evidence = evidence;
+	state->key = ngx_http_51D_hash(
+		FIFTYONE_DEGREES_HASH_OFFSET, &multiMode, sizeof(multiMode));
+	state->check = ngx_http_51D_check_hash(
+		fdmcf->cacheSeed, &multiMode, sizeof(multiMode));
+	state->hasKey = 1;
+	if (evidence != NULL) {
+		// Create the evidence from the http headers in a single pass over
+		// the request headers. Where a header is repeated, the first is
+		// used.
+		ngx_memzero(found, fdmcf->evidenceHeaderCount);
+		part = &r->headers_in.headers.part;
+		h = part->elts;
+		for (i = 0; /* void */ ; i++) {
+			if (i >= part->nelts) {
+				if (part->next == NULL) {
+					break;
+				}
+				part = part->next;
+				h = part->elts;
+				i = 0;
+			}
+			if (h[i].hash == 0 || h[i].lowcase_key == NULL) {
+				continue;
+			}
+			header = ngx_hash_find(
+				&fdmcf->evidenceHeaderIndex,
+				h[i].hash,
+				h[i].lowcase_key,
+				h[i].key.len);
+			// Note:
+			// using strong mask EQUALITY check to ignore filter
+			// in case `all_evidence` bit is also present.
+			if (header == NULL ||
+				found[header->index] ||
+				(multiMode == ngx_http_51D_multi_mode_mask_client_hints &&
+					!header->clientHints)) {
+				continue;
+			}
+			found[header->index] = 1;
+			add_evidence_string(
+				state,
+				FIFTYONE_DEGREES_EVIDENCE_HTTP_HEADER_STRING,
+				header->name,
+				(const char *)h[i].value.data);
+		}
+
+		for (i = 0; i < fdmcf->evidenceHeaderCount; i++) {
+			const char *headerName = fdmcf->evidenceHeaders[i].name;
+			if (multiMode == ngx_http_51D_multi_mode_mask_client_hints &&
+				!fdmcf->evidenceHeaders[i].clientHints) {
+				continue;
+			}
+
+			// Find evidence in query string
+			queryEvidence = get_evidence_from_query_args(
+				r, headerName, fdmcf->evidenceHeaders[i].nameLength);
+			if (queryEvidence != NULL && queryEvidence->len > 0) {
+				add_evidence_string(
+					state,
+					FIFTYONE_DEGREES_EVIDENCE_QUERY,
+					headerName,
+					(const char *)queryEvidence->data);	
+			}
+		}
+
+		if (add_override_evidence_from_cookie_and_query(
+			fdmcf, r, state) != NGX_OK) {
+			// Not enough memory to copy the override values, which has
+			// been reported.
+			evidence = NULL;
+			state->evidence = NULL;
+			state->hasKey = 0;
+		}
 	}
+	else {
+		report_insufficient_memory_status(r->connection->log);
+	}
+
 	return evidence;
 }
 
 /**
- * Search and get the evidence from the query string. If the variable does not
- * contains 'arg_' prefix, add it as this is required by nginx.
- * @param r the nginx http request
- * @param variableName the variable name to search for
- * @return the evidence
+ * Initialise the state of a match which has not yet been performed.
+ * @param state to initialise.
+ * @param multi Bit mask: what headers to use.
+ * @param userAgent pointer to the user agent to perform the match on.
+ * @param overrides sources of override evidence for the location.
  */
-static ngx_str_t *
-get_evidence_from_query_string(ngx_http_request_t *r, ngx_str_t *variableName) {
-	u_char *src, *dst;
-	ngx_uint_t variableNameHash;
-	ngx_variable_value_t *variable;
-	ngx_str_t *evidence;
-	ngx_str_t queryVarName;
-
-	// Check if the variable contains the prefix 'arg_' required for query
-	// string arguments
-	if (ngx_strstr((char *)variableName->data, "arg_") !=
-			(char *)variableName->data) {
-		queryVarName.len = ngx_strlen("arg_") + variableName->len;
-		queryVarName.data = (u_char *)ngx_palloc(r->pool, queryVarName.len + 1);
-		if (queryVarName.data == NULL) {
-			report_insufficient_memory_status(r->connection->log);
+static void ngx_http_51D_init_match_state(
+	ngx_http_51D_match_state_t *state,
+	ngx_http_51D_multi_header_mode multi,
+	ngx_str_t *userAgent,
+	ngx_uint_t overrides)
+{
+	state->multi = multi;
+	state->overrides = overrides;
+	state->userAgent = userAgent;
+	state->evidence = NULL;
+	state->key = 0;
+	state->check = 0;
+	state->hasKey = 0;
+	state->hasMatch = 0;
+	state->connectionKey = 0;
+	state->hasConnectionKey = 0;
+}
+
+/**
+ * Release the evidence held by a match state. The evidence array belongs to
+ * the worker and is emptied when it is next used, so its items, which point
+ * to memory in the request pool, are only forgotten here.
+ * @param state to free.
+ */
+static void ngx_http_51D_free_match_state(ngx_http_51D_match_state_t *state)
+{
+	state->evidence = NULL;
+}
+
+/**
+ * Get the key which identifies the evidence of a match state in the result
+ * cache. For User-Agent only matches, this is the hash of the User-Agent.
+ * Otherwise, the evidence is collected from the request and hashed as it is
+ * added, so it is ready for the match if one is needed.
+ * @param fdmcf module main config.
+ * @param r the current HTTP request.
+ * @param state the state of the match.
+ * @return Nginx status code.
+ */
+static ngx_int_t ngx_http_51D_get_match_key(
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_http_request_t *r,
+	ngx_http_51D_match_state_t *state)
+{
+	if (state->hasKey) {
+		return NGX_OK;
+	}
+	if (state->multi & ngx_http_51D_multi_mode_mask_ua_only) {
+		state->key = ngx_http_51D_hash(
+			FIFTYONE_DEGREES_HASH_OFFSET,
+			&state->multi,
+			sizeof(state->multi));
+		state->key = ngx_http_51D_hash(
+			state->key,
+			state->userAgent->data,
+			state->userAgent->len);
+		state->check = ngx_http_51D_check_hash(
+			fdmcf->cacheSeed,
+			&state->multi,
+			sizeof(state->multi));
+		state->check = ngx_http_51D_check_hash(
+			state->check,
+			state->userAgent->data,
+			state->userAgent->len);
+		state->hasKey = 1;
+	}
+	else if (get_evidence(fdmcf, r, state) == NULL) {
+		return NGX_ERROR;
+	}
+	return NGX_OK;
+}
+
+/**
+ * Get the key of the evidence in the connection cache, unless it has already
+ * been computed for the state. For multiple header matches this is a hash of
+ * the raw values of the evidence headers, the query string and, where they
+ * are used for overrides, the cookies, found in one pass over the request
+ * headers. The evidence the result caches are keyed on is not built, so a
+ * request whose values are all held for the connection is not parsed any
+ * further.
+ * @param fdmcf module main config holding the index of evidence headers.
+ * @param r the http request.
+ * @param state the state of the match to set the key in.
+ * @return NGX_OK, or NGX_ERROR.
+ */
+static ngx_int_t
+ngx_http_51D_get_connection_key(
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_http_request_t *r,
+	ngx_http_51D_match_state_t *state)
+{
+	ngx_http_51D_evidence_header_t *header;
+	ngx_list_part_t *part;
+	ngx_table_elt_t *h;
+	ngx_uint_t i, cookies;
+	uint64_t key;
+
+	if (state->hasConnectionKey) {
+		return NGX_OK;
+	}
+	if (state->multi & ngx_http_51D_multi_mode_mask_ua_only) {
+		// The key of the User-Agent is already found without parsing.
+		if (ngx_http_51D_get_match_key(fdmcf, r, state) != NGX_OK) {
+			return NGX_ERROR;
+		}
+		state->connectionKey = state->key;
+		state->hasConnectionKey = 1;
+		return NGX_OK;
+	}
+
+	cookies = state->overrides & ngx_http_51D_overrides_cookie;
+	key = ngx_http_51D_hash(
+		FIFTYONE_DEGREES_HASH_OFFSET, &state->multi, sizeof(state->multi));
+	key = ngx_http_51D_hash(key, &state->overrides, sizeof(state->overrides));
+	part = &r->headers_in.headers.part;
+	h = part->elts;
+	for (i = 0; /* void */ ; i++) {
+		if (i >= part->nelts) {
+			if (part->next == NULL) {
+				break;
+			}
+			part = part->next;
+			h = part->elts;
+			i = 0;
+		}
+		if (h[i].hash == 0 || h[i].lowcase_key == NULL) {
+			continue;
+		}
+		header = fdmcf->evidenceHeaderCount > 0 ?
+			ngx_hash_find(
+				&fdmcf->evidenceHeaderIndex,
+				h[i].hash,
+				h[i].lowcase_key,
+				h[i].key.len) :
+			NULL;
+		if (header == NULL &&
+			(cookies == 0 ||
+			h[i].key.len != sizeof("cookie") - 1 ||
+			ngx_strncmp(h[i].lowcase_key, "cookie", h[i].key.len) != 0)) {
+			continue;
+		}
+		key = ngx_http_51D_hash(key, &h[i].key.len, sizeof(h[i].key.len));
+		key = ngx_http_51D_hash(key, h[i].lowcase_key, h[i].key.len);
+		key = ngx_http_51D_hash(key, &h[i].value.len, sizeof(h[i].value.len));
+		key = ngx_http_51D_hash(key, h[i].value.data, h[i].value.len);
+	}
+	key = ngx_http_51D_hash(key, &r->args.len, sizeof(r->args.len));
+	key = ngx_http_51D_hash(key, r->args.data, r->args.len);
+
+	state->connectionKey = key;
+	state->hasConnectionKey = 1;
+	return NGX_OK;
+}
+
+#if (NGX_THREADS)
+/**
+ * Get a match for the thread pool from the free list, creating one if the
+ * list is empty. The evidence array is recreated if it is smaller than the
+ * one used by the worker, as it is a copy of that evidence.
+ * @param fdmcf module main config.
+ * @param log the log to write errors to.
+ * @return the match, or NULL if there was not enough memory.
+ */
+static ngx_http_51D_thread_match_t *
+ngx_http_51D_thread_match_get(
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_log_t *log)
+{
+	ngx_http_51D_thread_match_t *match = fdmcf->freeThreadMatches;
+
+	if (match != NULL) {
+		fdmcf->freeThreadMatches = match->next;
+	}
+	else {
+		match = ngx_calloc(sizeof(ngx_http_51D_thread_match_t), log);
+		if (match == NULL) {
+			report_insufficient_memory_status(log);
 			return NULL;
 		}
-		if (sprintf((char *)queryVarName.data,
-			"arg_%s",
-			variableName->data) < 0) {
-			ngx_log_error(
-				NGX_LOG_ERR,
-				r->connection->log,
-				0,
-				"51Degrees failed to compose query argument string.");
-			return NULL; 
-		};
+		match->results = ResultsHashCreate(
+			fdmcf->resourceManager,
+			fdmcf->overrideCount);
+	}
+	if (match->evidence != NULL &&
+		match->evidence->capacity < fdmcf->evidence->capacity) {
+		EvidenceFree(match->evidence);
+		match->evidence = NULL;
+	}
+	if (match->evidence == NULL) {
+		match->evidence = EvidenceCreate(fdmcf->evidence->capacity);
+	}
+	if (match->results == NULL || match->evidence == NULL) {
+		ngx_http_51D_thread_match_free(match);
+		report_insufficient_memory_status(log);
+		return NULL;
+	}
+	match->next = NULL;
+	match->done = 0;
+	match->status = FIFTYONE_DEGREES_STATUS_SUCCESS;
+	return match;
+}
+
+/**
+ * Free the matches of replaced data sets once no matches are in the thread
+ * pool, as their results may hold the last reference to a data set in the
+ * shared memory zone.
+ * @param fdmcf module main config.
+ */
+static void
+ngx_http_51D_thread_match_free_stale(ngx_http_51D_main_conf_t *fdmcf)
+{
+	ngx_http_51D_thread_match_t *match;
+
+	if (fdmcf->staleThreadMatches == NULL ||
+		(fdmcf->threadMatchesPosted > 0 &&
+			ngx_http_51D_per_worker(fdmcf) == 0)) {
+		return;
+	}
+	ngx_http_51D_release_enter(fdmcf);
+	while (fdmcf->staleThreadMatches != NULL) {
+		match = fdmcf->staleThreadMatches;
+		fdmcf->staleThreadMatches = match->next;
+		ngx_http_51D_thread_match_free(match);
+	}
+	ngx_http_51D_release_leave(fdmcf);
+}
+
+/**
+ * Return a match to the free list once its task has completed and the
+ * request no longer needs it.
+ * @param fdmcf module main config.
+ * @param match to return.
+ */
+static void
+ngx_http_51D_thread_match_release(
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_http_51D_thread_match_t *match)
+{
+	if (match->results->b.b.dataSet != fdmcf->results->b.b.dataSet) {
+		// The data set has been reloaded since the match was created.
+		match->next = fdmcf->staleThreadMatches;
+		fdmcf->staleThreadMatches = match;
+		ngx_http_51D_thread_match_free_stale(fdmcf);
+		return;
+	}
+	match->evidence->count = 0;
+	match->next = fdmcf->freeThreadMatches;
+	fdmcf->freeThreadMatches = match;
+}
+
+/**
+ * Thread pool task handler. Performs the match on the evidence copied into
+ * the task. Nothing else is touched, so no locking is needed.
+ * @param data the match.
+ * @param log the log of the thread.
+ */
+static void
+ngx_http_51D_thread_match_handler(void *data, ngx_log_t *log)
+{
+	ngx_http_51D_thread_match_t *match = data;
+
+	EXCEPTION_CREATE
+	// Reset overrides array as we want a free detection per request.
+	fiftyoneDegreesOverrideValuesReset(match->results->b.overrides);
+	ResultsHashFromEvidence(match->results, match->evidence, exception);
+	match->status = exception->status;
+}
+
+/**
+ * Called in the worker when the thread pool task completes. Marks the match
+ * done and resumes the request, which runs the module handler again to set
+ * the headers from the results.
+ * @param ev the event of the task, whose data is the request.
+ */
+static void
+ngx_http_51D_thread_match_event_handler(ngx_event_t *ev)
+{
+	ngx_connection_t *c;
+	ngx_http_request_t *r;
+	ngx_http_51D_ctx_t *ctx;
+	ngx_http_51D_main_conf_t *fdmcf;
+
+	r = ev->data;
+	c = r->connection;
+
+	ngx_http_set_log_request(c->log, r);
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_51D_module);
+	ctx->threadMatch->done = 1;
+	fdmcf = ngx_http_get_module_main_conf(r, ngx_http_51D_module);
+	fdmcf->threadMatchesPosted--;
+	ngx_http_51D_thread_match_free_stale(fdmcf);
+
+	r->main->blocked--;
+	r->aio = 0;
+
+	if (r->done) {
+		// The request was finalized while the task was running.
+		c->write->handler(c->write);
 	}
 	else {
-		queryVarName = *variableName;
+		r->write_event_handler(r);
+		ngx_http_run_posted_requests(c);
 	}
-
-	return get_evidence_from_query_string_base(r, &queryVarName);
 }
 
 /**
- * Check whether there is a cookie with the name supplied.
- * @param r pointer to a http request
- * @param s name of the cookie to look for
- * @param cookie pointer to an ngx_str_t to write the value to
- * @return true if the cookie was found
+ * Request pool cleanup. Returns a match which the request did not take,
+ * for example because every header was found in a cache when it resumed.
+ * @param data the module context of the request.
  */
-static bool has_cookie_value(
-	ngx_http_request_t *r,
-	ngx_str_t *s,
-	ngx_str_t *cookie) {
-#if nginx_version >= 1023002
-	return ngx_http_parse_multi_header_lines(r, r->headers_in.cookie, s, cookie)
-		!= NULL;
-#else
-	return ngx_http_parse_multi_header_lines(&r->headers_in.cookies, s, cookie)
-		!= NGX_DECLINED;
-#endif
+static void
+ngx_http_51D_thread_match_cleanup(void *data)
+{
+	ngx_http_51D_ctx_t *ctx = data;
+	ngx_http_51D_main_conf_t *fdmcf;
+
+	if (ctx->threadMatch != NULL) {
+		fdmcf = ngx_http_cycle_get_module_main_conf(
+			ngx_cycle,
+			ngx_http_51D_module);
+		ngx_http_51D_thread_match_release(fdmcf, ctx->threadMatch);
+		ctx->threadMatch = NULL;
+	}
 }
 
 /**
- * Add evidence required by the Hash device detection from cookie and query
- * string.
- * @param r pointer to a http request
- * @param results pointers to results hash instance
- * @param evidence pointer to the evidence collection
- * @param cookies pointer to the array of cookies
+ * Post the all evidence match of a request to the location's thread pool.
+ * The request is suspended until the task completes, then the handler runs
+ * again and ngx_http_51D_get_match takes the results. Nothing is posted if
+ * the location has no all evidence headers, or if their values are all in
+ * the result cache. Any failure falls back to matching in the worker.
+ * @param fdmcf module main config.
+ * @param fdlcf module location config.
+ * @param r the current HTTP request.
+ * @param matchConf the match configs of the location, server and main.
+ * @param userAgent the User-Agent of the request.
+ * @return NGX_DONE if the request must wait for the task, otherwise
+ * NGX_DECLINED.
  */
-static void
-add_override_evidence_from_cookie_and_query(
+static ngx_int_t
+ngx_http_51D_post_thread_match(
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_http_51D_loc_conf_t *fdlcf,
 	ngx_http_request_t *r,
-	ResultsHash *results,
-	EvidenceKeyValuePairArray *evidence) {
-	ngx_uint_t i;
-	ngx_str_t s, cookie;
-	OverrideProperty property;
-	String *fdString;
-	DataSetHash *dataSet =
-		(DataSetHash *)results->b.b.dataSet;
-	if (dataSet->b.b.overridable != NULL) {
-		for (i = 0; i < dataSet->b.b.overridable->count; i++) {
-			property = dataSet->b.b.overridable->items[i];
-			fdString = (String *)property.available->name.data.ptr;
-			s.len = fdString->size - 1;
-			if (dataSet->b.b.overridable->prefix) {
-				s.len += ngx_strlen("51D_");
-				s.data = (u_char *)ngx_palloc(r->pool, s.len + 1);
-				if (s.data == NULL) {
-					report_insufficient_memory_status(r->connection->log);
-					break;
-				}
+	ngx_http_51D_match_conf_t *matchConf[],
+	ngx_str_t *userAgent)
+{
+	ngx_http_51D_ctx_t *ctx;
+	ngx_http_51D_thread_match_t *match;
+	ngx_http_51D_data_to_set *header;
+	ngx_http_51D_match_state_t state;
+	EvidenceKeyValuePair *item;
+	ngx_thread_task_t *task;
+	ngx_pool_cleanup_t *cln;
+	ngx_http_51D_connection_cache_t *connectionCache;
+	ngx_uint_t i, cached;
+	uint64_t key, check;
+	int matchConfIndex;
+
+	if (fdlcf->threadPool == NULL || userAgent == NULL) {
+		return NGX_DECLINED;
+	}
 
-				if (sprintf((char *)s.data, "51D_%s", &fdString->value) < 0) {
-					ngx_log_error(
-						NGX_LOG_ERR,
-						r->connection->log,
-						0,
-						"51Degrees failed to compose evidence key string.");
-					break;
-				}
-			}
-			else {
-				s.data = (u_char *)&fdString->value;
-			}
+	ctx = ngx_http_get_module_ctx(r, ngx_http_51D_module);
+	if (ctx != NULL && ctx->threadMatch != NULL) {
+		// Still waiting for the task, or resuming once it has completed.
+		return ctx->threadMatch->done ? NGX_DECLINED : NGX_DONE;
+	}
 
-			// Find evidence in cookie
-			if (has_cookie_value(r, &s, &cookie) == true) {
-				EvidenceAddString(
-					evidence,
-					FIFTYONE_DEGREES_EVIDENCE_COOKIE,
-					(const char *)s.data,
-					(const char *)cookie.data);
+	// The data set is only sized for this many threads to use it at once,
+	// so further matches are performed in the worker.
+	if (fdmcf->threadMatchesPosted >=
+		(ngx_uint_t)fdmcf->threadConcurrency) {
+		return NGX_DECLINED;
+	}
+
+	// The state takes the match mode of the first all evidence header, as
+	// it does in the handler, so the key is the same.
+	ngx_http_51D_init_match_state(&state, 0, userAgent, fdlcf->overrides);
+	for (matchConfIndex = 0;
+		matchConfIndex < FIFTYONE_DEGREES_CONFIG_LEVELS && state.multi == 0;
+		matchConfIndex++) {
+		for (header = matchConf[matchConfIndex]->header;
+			header != NULL;
+			header = header->next) {
+			if ((header->multi & ngx_http_51D_multi_mode_mask_all_evidence) &&
+				(int)header->variableName.len <= 0) {
+				state.multi = header->multi;
+				break;
 			}
+		}
+	}
+	if (state.multi == 0 ||
+		(state.multi & ngx_http_51D_multi_mode_mask_ua_only)) {
+		ngx_http_51D_free_match_state(&state);
+		return NGX_DECLINED;
+	}
 
-			// Find evidence in query string
-			ngx_str_t *queryEvidence = get_evidence_from_query_string(r, &s);
-			if (queryEvidence != NULL && queryEvidence->len > 0) {
-				EvidenceAddString(
-					evidence,
-					FIFTYONE_DEGREES_EVIDENCE_QUERY,
-					(const char *)s.data,
-					(const char *)queryEvidence->data);
+	// There is nothing to wait for if the values are already cached.
+	connectionCache = fdmcf->connectionCache == 1 &&
+		ngx_http_51D_get_connection_key(fdmcf, r, &state) == NGX_OK ?
+		ngx_http_51D_connection_cache_get(fdmcf, r) : NULL;
+	if (fdmcf->cache != NULL || connectionCache != NULL) {
+		cached = 1;
+		for (matchConfIndex = 0;
+			matchConfIndex < FIFTYONE_DEGREES_CONFIG_LEVELS && cached;
+			matchConfIndex++) {
+			for (header = matchConf[matchConfIndex]->header;
+				header != NULL && cached;
+				header = header->next) {
+				if ((header->multi &
+						ngx_http_51D_multi_mode_mask_all_evidence) &&
+					(int)header->variableName.len <= 0) {
+					key = ngx_http_51D_hash(
+						state.connectionKey,
+						&header->key,
+						sizeof(header->key));
+					cached = connectionCache != NULL &&
+						ngx_http_51D_connection_cache_find(
+							connectionCache, key) != NULL;
+					if (cached == 0 && fdmcf->cache != NULL &&
+						ngx_http_51D_get_match_key(
+							fdmcf, r, &state) == NGX_OK) {
+						key = ngx_http_51D_hash(
+							state.key, &header->key, sizeof(header->key));
+						check = ngx_http_51D_check_hash(
+							state.check, &header->key, sizeof(header->key));
+						cached = ngx_http_51D_cache_find(
+							fdmcf->cache, key, check) != NULL;
+					}
+				}
 			}
 		}
+		if (cached) {
+			ngx_http_51D_free_match_state(&state);
+			return NGX_DECLINED;
+		}
+	}
+	if (ngx_http_51D_get_match_key(fdmcf, r, &state) != NGX_OK) {
+		ngx_http_51D_free_match_state(&state);
+		return NGX_DECLINED;
 	}
-}
 
-static int is_header_allowed_for_UA_UACH_mode(const char * const headerName) {
-	// strip '\0' at the end
-	static const size_t client_hint_prefix_length = sizeof(NGX_HTTP_51D_HEADER_PREFIX_CLIENT_HINT) - 1;
-	static const size_t user_agent_length = sizeof(NGX_HTTP_51D_HEADER_USER_AGENT) - 1;
+	ctx = ngx_http_51D_get_ctx(r);
+	if (ctx == NULL) {
+		ngx_http_51D_free_match_state(&state);
+		return NGX_DECLINED;
+	}
+	match = ngx_http_51D_thread_match_get(fdmcf, r->connection->log);
+	if (match == NULL) {
+		ngx_http_51D_free_match_state(&state);
+		return NGX_DECLINED;
+	}
 
-	// Unike standard `strncasecmp` from `string.h`, `ngx_strncasecmp` requires non-const pointers.
-	// Therefore we must use explicit casts.
-	return (!ngx_strncasecmp((u_char *)headerName, (u_char *)NGX_HTTP_51D_HEADER_PREFIX_CLIENT_HINT, client_hint_prefix_length)
-			|| !ngx_strncasecmp((u_char *)headerName, (u_char *)NGX_HTTP_51D_HEADER_USER_AGENT, user_agent_length)
-			) ? 1 : 0;
+	// Copy the evidence, as the worker's array is used by other requests
+	// while the task runs. The values remain in the request pool.
+	for (i = 0; i < state.evidence->count; i++) {
+		item = &state.evidence->items[i];
+		EvidenceAddString(
+			match->evidence,
+			item->prefix,
+			item->field,
+			(const char *)item->originalValue);
+	}
+	match->key = state.key;
+	ngx_http_51D_free_match_state(&state);
+
+	task = ngx_thread_task_alloc(r->pool, 0);
+	cln = ngx_pool_cleanup_add(r->pool, 0);
+	if (task == NULL || cln == NULL) {
+		ngx_http_51D_thread_match_release(fdmcf, match);
+		report_insufficient_memory_status(r->connection->log);
+		return NGX_DECLINED;
+	}
+	cln->handler = ngx_http_51D_thread_match_cleanup;
+	cln->data = ctx;
+
+	task->ctx = match;
+	task->handler = ngx_http_51D_thread_match_handler;
+	task->event.handler = ngx_http_51D_thread_match_event_handler;
+	task->event.data = r;
+
+	if (ngx_thread_task_post(fdlcf->threadPool, task) != NGX_OK) {
+		ngx_http_51D_thread_match_release(fdmcf, match);
+		return NGX_DECLINED;
+	}
+
+	fdmcf->threadMatchesPosted++;
+	ctx->threadMatch = match;
+	r->main->blocked++;
+	r->aio = 1;
+	return NGX_DONE;
 }
 
 /**
- * Create an evidence array and added the evidence from the http request.
- * This should consider the evidence sent from cookies and query, since
- * overrides are required by customer.
- * This requires parsing the query string for the override values. For MVP
- * might consider the override from cookies only.
- * @param results the results to hold the return value of the detection
- * @param r the http request that contains the evidence
- * @param multiMode describes which headers to use for evidence.
- * @return an array of evidence
+ * Take the results of a completed thread pool match if they are for the
+ * evidence of the state. The results are swapped with those of the worker,
+ * so the values are then read from the worker's results as they are for a
+ * match performed in the worker.
+ * @param fdmcf module main config.
+ * @param r the current HTTP request.
+ * @param state the state of the match.
+ * @return NGX_OK if the results were taken, NGX_DECLINED if there are none
+ * for the evidence, or NGX_ERROR.
  */
-static EvidenceKeyValuePairArray *get_evidence(
-	ResultsHash *results,
+static ngx_int_t
+ngx_http_51D_take_thread_match(
+	ngx_http_51D_main_conf_t *fdmcf,
 	ngx_http_request_t *r,
-	ngx_http_51D_multi_header_mode multiMode) {
-	DataSetHash *dataSet =
-		(DataSetHash *)results->b.b.dataSet;
-	ngx_table_elt_t *searchResult;
-	ngx_str_t *queryEvidence;
-	// Calculate the size to allocate. 2 for overrides from cookies and query.
-	// 2 from the header and query.
-	size_t size = dataSet->b.b.uniqueHeaders->count * 2;
-	if (dataSet->b.b.overridable != NULL) {
-		size += dataSet->b.b.overridable->count * 2;
+	ngx_http_51D_match_state_t *state)
+{
+	ngx_http_51D_ctx_t *ctx;
+	ngx_http_51D_thread_match_t *match;
+	ResultsHash *results;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_51D_module);
+	if (ctx == NULL ||
+		ctx->threadMatch == NULL ||
+		ctx->threadMatch->done == 0) {
+		return NGX_DECLINED;
+	}
+	match = ctx->threadMatch;
+	if (ngx_http_51D_get_match_key(fdmcf, r, state) != NGX_OK) {
+		return NGX_ERROR;
+	}
+	if (state->key != match->key) {
+		return NGX_DECLINED;
 	}
 
-	EvidenceKeyValuePairArray *evidence =
-		EvidenceCreate(size);
-	if (evidence != NULL) {
-		// Create the evidence from the http headers
-		ngx_uint_t i;
-		for (i = 0; i < dataSet->b.b.uniqueHeaders->count; i++) {
-			const char *headerName =
-				dataSet->b.b.uniqueHeaders->items[i].name;
-
-			// Note:
-			// using strong mask EQUALITY check to ignore filter
-			// in case `all_evidence` bit is also present.
-			if ((multiMode == ngx_http_51D_multi_mode_mask_client_hints) 
-				&& !is_header_allowed_for_UA_UACH_mode(headerName))
-			{
-				continue;
-			}
-			searchResult =
-				search_headers_in(
-					r, (u_char *)headerName, ngx_strlen(headerName));
-			if (searchResult) {
-				EvidenceAddString(
-					evidence,
-					FIFTYONE_DEGREES_EVIDENCE_HTTP_HEADER_STRING,
-					headerName,
-					(const char *)searchResult->value.data);
-			}
-
-			// Find evidence in query string
-			ngx_str_t ngxHeaderName;
-			ngxHeaderName.len = ngx_strlen(headerName);
-			ngxHeaderName.data =
-				(u_char *)ngx_palloc(r->pool, ngxHeaderName.len + 1);
-			if (ngxHeaderName.data == NULL) {
-				report_insufficient_memory_status(r->connection->log);
-				return evidence;
-			}
-
-			ngx_memcpy(ngxHeaderName.data, headerName, ngxHeaderName.len + 1);
-			queryEvidence = get_evidence_from_query_string(r, &ngxHeaderName);
-			if (queryEvidence != NULL && queryEvidence->len > 0) {
-				EvidenceAddString(
-					evidence,
-					FIFTYONE_DEGREES_EVIDENCE_QUERY,
-					headerName,
-					(const char *)queryEvidence->data);	
-			}
-		}
+	ctx->threadMatch = NULL;
+	if (match->results->b.b.dataSet != fdmcf->results->b.b.dataSet) {
+		// The data set has been reloaded while the task ran.
+		ngx_http_51D_thread_match_release(fdmcf, match);
+		return NGX_DECLINED;
+	}
+	if (match->status != FIFTYONE_DEGREES_STATUS_SUCCESS) {
+		ngx_http_51D_thread_match_release(fdmcf, match);
+		return report_status(
+			r->connection->log,
+			match->status,
+			(const char *)fdmcf->dataFile.data);
+	}
+	results = fdmcf->results;
+	fdmcf->results = match->results;
+	match->results = results;
+	ngx_http_51D_thread_match_release(fdmcf, match);
+	return NGX_OK;
+}
+#endif
 
-		add_override_evidence_from_cookie_and_query(
-			r, results, evidence);
+/**
+ * Whether the worker's results hold the match of the request for the
+ * evidence of the state, so that it need not be performed again. A match for
+ * any other request replaces the results and increments the match sequence.
+ * @param fdmcf module main config.
+ * @param r the current HTTP request.
+ * @param state the state of the match.
+ * @return 1 if the results hold the match, otherwise 0.
+ */
+static ngx_uint_t
+ngx_http_51D_match_is_current(
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_http_request_t *r,
+	ngx_http_51D_match_state_t *state)
+{
+	ngx_http_51D_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_51D_module);
+
+	if (ctx == NULL ||
+		ctx->matchSequence == 0 ||
+		ctx->matchSequence != fdmcf->matchSequence ||
+		ctx->matchMulti != state->multi ||
+		ctx->matchOverrides != state->overrides) {
+		return 0;
 	}
-	else {
-		report_insufficient_memory_status(r->connection->log);
+	if (state->multi & ngx_http_51D_multi_mode_mask_ua_only) {
+		return ctx->matchUserAgent != NULL &&
+			state->userAgent != NULL &&
+			ctx->matchUserAgent->len == state->userAgent->len &&
+			ngx_strncmp(
+				ctx->matchUserAgent->data,
+				state->userAgent->data,
+				state->userAgent->len) == 0;
 	}
+	return 1;
+}
 
-	return evidence;
+/**
+ * Record in the request's context that the worker's results hold its match
+ * for the evidence of the state.
+ * @param fdmcf module main config.
+ * @param r the current HTTP request.
+ * @param state the state of the match.
+ */
+static void
+ngx_http_51D_set_match_current(
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_http_request_t *r,
+	ngx_http_51D_match_state_t *state)
+{
+	ngx_http_51D_ctx_t *ctx = ngx_http_51D_get_ctx(r);
+
+	fdmcf->matchSequence++;
+	if (ctx != NULL) {
+		ctx->matchSequence = fdmcf->matchSequence;
+		ctx->matchMulti = state->multi;
+		ctx->matchOverrides = state->overrides;
+		ctx->matchUserAgent = state->userAgent;
+	}
+	state->hasMatch = 1;
 }
 
 /**
  * Get match function. Gets a match for either a single User-Agent or 
- * all request headers.
+ * all request headers. Any evidence already collected in the state is used
+ * rather than collecting it again. The match is not performed again if the
+ * worker's results still hold it from an earlier phase of the request.
  *
  * @param fdmcf module main config.
  * @param r the current HTTP request.
- * @param multi Bit mask: what headers to use.
- * @param userAgent pointer to the user agent to perform the match on.
+ * @param state the state of the match.
  * @return Nginx status code.
  */
 static ngx_uint_t ngx_http_51D_get_match(
 	ngx_http_51D_main_conf_t *fdmcf,
 	ngx_http_request_t *r,
-	ngx_http_51D_multi_header_mode multi,
-	ngx_str_t *userAgent)
+	ngx_http_51D_match_state_t *state)
 {
 	ResultsHash *results = fdmcf->results;
-	
+
+	if (ngx_http_51D_match_is_current(fdmcf, r, state)) {
+		state->hasMatch = 1;
+		return NGX_OK;
+	}
+
 	EXCEPTION_CREATE
 	// If single requested, match for single User-Agent.
-	if (multi & ngx_http_51D_multi_mode_mask_ua_only)  {
+	if (state->multi & ngx_http_51D_multi_mode_mask_ua_only)  {
 		ResultsHashFromUserAgent(
 			results,
-			(const char *)userAgent->data,
-			userAgent->len,
+			(const char *)state->userAgent->data,
+			state->userAgent->len,
 			exception);
 		if (EXCEPTION_FAILED) {
 			return report_status(
@@ -1968,59 +6508,222 @@ static ngx_uint_t ngx_http_51D_get_match(
 				(const char *)fdmcf->dataFile.data);
 		}
 	}
-	else if (multi & ngx_http_51D_multi_mode_mask_non_ua_only)
+	else if (state->multi & ngx_http_51D_multi_mode_mask_non_ua_only)
 	{
+#if (NGX_THREADS)
+		// Use the results of the thread pool if it performed this match.
+		switch (ngx_http_51D_take_thread_match(fdmcf, r, state)) {
+		case NGX_OK:
+			fdmcf->threadPoolMatches++;
+			ngx_http_51D_set_match_current(fdmcf, r, state);
+			return NGX_OK;
+		case NGX_DECLINED:
+			break;
+		default:
+			return NGX_ERROR;
+		}
+		fdmcf->workerMatches++;
+#endif
 		// Reset overrides array as we want a free
 		// detection per request.
 		fiftyoneDegreesOverrideValuesReset(results->b.overrides);
 
-		EvidenceKeyValuePairArray *evidence =
-			get_evidence(results, r, multi);
-		if (evidence != NULL) {
-			ResultsHashFromEvidence(
-				results,
-				evidence,
-				exception);
-			EvidenceFree(evidence);
-			if (EXCEPTION_FAILED) {
-				return report_status(
-					r->connection->log,
-					exception->status,
-					(const char *)fdmcf->dataFile.data);
-			}
-		}
-		else {
+		if (state->evidence == NULL &&
+			get_evidence(fdmcf, r, state) == NULL) {
 			return NGX_ERROR;
 		}
+		ResultsHashFromEvidence(
+			results,
+			state->evidence,
+			exception);
+		if (EXCEPTION_FAILED) {
+			return report_status(
+				r->connection->log,
+				exception->status,
+				(const char *)fdmcf->dataFile.data);
+		}
 	}
+	ngx_http_51D_set_match_current(fdmcf, r, state);
 	return NGX_OK;
 }
 
 /**
- * Remove Unknown string from a given string and updated
- * the number of characers added with 'Unknown' being removed.
- * @param dest pointer to the string to be updated
- * @param charsAdded number of characters added to the string
- * that might contains Unknown. This will be updated after
- * 'Unknown' string is removed.
+ * Get the key which identifies the profiles of the current match in the
+ * profile cache. Values which come from override evidence do not belong to
+ * the profiles, so a match with overridden values has no key.
+ * @param fdmcf module main config.
+ * @param key set to the hash of the matched profiles.
+ * @param check set to the keyed hash of the matched profiles, or NULL if it
+ * is not needed.
+ * @return NGX_OK, or NGX_DECLINED if the values of the match can not be found
+ * from its profiles.
  */
-static void removeUnknown(char *dest, ngx_int_t *charsAdded)
-{
-	const char *unknown = "Unknown";
-	size_t unknownLen = ngx_strlen(unknown);	
-	size_t destLen = ngx_strlen(dest);
-	size_t memToMove = 0;
-	dest = dest + (destLen - *charsAdded);
+static ngx_int_t
+ngx_http_51D_get_profiles_key(
+	ngx_http_51D_main_conf_t *fdmcf,
+	uint64_t *key,
+	uint64_t *check) {
+	ngx_uint_t i;
+	ResultsHash *results = fdmcf->results;
+	DataSetHash *dataSet = (DataSetHash *)results->b.b.dataSet;
+	size_t profilesLength =
+		dataSet->componentsList.count * sizeof(*results->items->profileOffsets);
+
+	if (results->count == 0 ||
+		(results->b.overrides != NULL && results->b.overrides->count > 0)) {
+		return NGX_DECLINED;
+	}
+	*key = ngx_http_51D_hash(
+		FIFTYONE_DEGREES_HASH_OFFSET, &results->count, sizeof(results->count));
+	for (i = 0; i < results->count; i++) {
+		*key = ngx_http_51D_hash(
+			*key, results->items[i].profileOffsets, profilesLength);
+	}
+	if (check != NULL) {
+		*check = ngx_http_51D_check_hash(
+			fdmcf->cacheSeed, &results->count, sizeof(results->count));
+		for (i = 0; i < results->count; i++) {
+			*check = ngx_http_51D_check_hash(
+				*check, results->items[i].profileOffsets, profilesLength);
+		}
+	}
+	return NGX_OK;
+}
+
+/**
+ * Initialise a value builder. No memory is allocated until the first value
+ * is appended.
+ * @param builder to initialise.
+ * @param pool to allocate the buffer from.
+ * @param escape whether values are escaped as they are appended.
+ */
+static void
+ngx_http_51D_value_init(
+	ngx_http_51D_value_builder_t *builder,
+	ngx_pool_t *pool,
+	ngx_uint_t escape) {
+	builder->pool = pool;
+	builder->data = NULL;
+	builder->len = 0;
+	builder->capacity = 0;
+	builder->escape = escape;
+	builder->failed = 0;
+}
+
+/**
+ * Make sure there is space for a number of characters after the end of the
+ * string in a value builder, growing the buffer if there is not.
+ * @param builder to reserve the space in.
+ * @param size number of characters to reserve.
+ * @return pointer to the end of the string, or NULL if the buffer could not
+ * be grown.
+ */
+static u_char *
+ngx_http_51D_value_reserve(
+	ngx_http_51D_value_builder_t *builder,
+	size_t size) {
+	u_char *data;
+	size_t capacity;
+	if (builder->failed) {
+		return NULL;
+	}
+	if (builder->capacity - builder->len < size) {
+		capacity = ngx_max(
+			builder->capacity * 2,
+			ngx_max(builder->len + size, FIFTYONE_DEGREES_VALUE_BUFFER_SIZE));
+		data = (u_char *)ngx_pnalloc(builder->pool, capacity + 1);
+		if (data == NULL) {
+			builder->failed = 1;
+			return NULL;
+		}
+		if (builder->data != NULL) {
+			ngx_memcpy(data, builder->data, builder->len);
+			ngx_pfree(builder->pool, builder->data);
+		}
+		builder->data = data;
+		builder->capacity = capacity;
+	}
+	return builder->data + builder->len;
+}
+
+/**
+ * Complete the characters which were written to the end of the string in a
+ * value builder, escaping them if the builder escapes values. The characters
+ * must fit in the space already reserved.
+ * @param builder the characters were written to.
+ * @param size number of characters written.
+ */
+static void
+ngx_http_51D_value_commit(
+	ngx_http_51D_value_builder_t *builder,
+	size_t size) {
+	u_char *dst, *src;
+	size_t escapedChars = 0;
+	if (builder->escape) {
+		escapedChars = (size_t)ngx_escape_json(
+			NULL, builder->data + builder->len, size);
+	}
+	if (escapedChars > 0) {
+		// Characters which cannot be added in a header value, most
+		// importantly '\n' and '\r', are rare so the unescaped copy is only
+		// made when they are present.
+		src = (u_char *)ngx_pnalloc(builder->pool, size);
+		if (src == NULL) {
+			builder->failed = 1;
+			return;
+		}
+		ngx_memcpy(src, builder->data + builder->len, size);
+		dst = ngx_http_51D_value_reserve(builder, size + escapedChars);
+		if (dst == NULL) {
+			return;
+		}
+		ngx_escape_json(dst, src, size);
+	}
+	builder->len += size + escapedChars;
+	builder->data[builder->len] = '\0';
+}
+
+/**
+ * Append characters to the string in a value builder.
+ * @param builder to append to.
+ * @param value the characters to append.
+ * @param size number of characters to append.
+ */
+static void
+ngx_http_51D_value_append(
+	ngx_http_51D_value_builder_t *builder,
+	const u_char *value,
+	size_t size) {
+	u_char *dst = ngx_http_51D_value_reserve(builder, size);
+	if (dst != NULL) {
+		ngx_memcpy(dst, value, size);
+		ngx_http_51D_value_commit(builder, size);
+	}
+}
 
-	char *unknownPos = NULL;
-	while (*charsAdded > 0 &&
-		(unknownPos = ngx_strstr(dest, unknown)) != NULL) {
-		*charsAdded -= unknownLen;
-		memToMove = ngx_strlen(unknownPos) - unknownLen;
-		ngx_memmove(unknownPos, unknownPos + unknownLen, memToMove);
-		unknownPos[memToMove] = '\0';
-		dest = unknownPos;
+/**
+ * Remove the 'Unknown' strings from characters, moving the remaining
+ * characters down in a single pass.
+ * @param value the characters to remove 'Unknown' from.
+ * @param size number of characters.
+ * @return the number of characters left.
+ */
+static size_t
+ngx_http_51D_remove_unknown(u_char *value, size_t size) {
+	static const char unknown[] = "Unknown";
+	const size_t unknownLength = sizeof(unknown) - 1;
+	u_char *src = value, *dst = value, *end = value + size;
+	while (src < end) {
+		if (*src == 'U' &&
+			(size_t)(end - src) >= unknownLength &&
+			ngx_strncmp(src, unknown, unknownLength) == 0) {
+			src += unknownLength;
+		}
+		else {
+			*dst++ = *src++;
+		}
 	}
+	return dst - value;
 }
 
 /**
@@ -2029,9 +6732,8 @@ static void removeUnknown(char *dest, ngx_int_t *charsAdded)
  * with 51D_valueSeparator.
  * @param fdmcf 51Degrees module main config.
  * @param r the current HTTP request.
- * @param values_string the string to append the returned value to.
- * @param requiredPropertyName the name of the property to get the value for.
- * @param length the size allocated to the values_string variable.
+ * @param builder the value string to append the returned value to.
+ * @param property the resolved property to get the value for.
  * @param includeNotAvailable whether or not, property whose hasValues=false or
  * value is 'Unknown' should be included as part of the valuesString. In all cases
  * whether properties are required by "51D_match_*" directives, this has to be 1
@@ -2045,152 +6747,167 @@ static void removeUnknown(char *dest, ngx_int_t *charsAdded)
 void ngx_http_51D_get_value(
 	ngx_http_51D_main_conf_t *fdmcf,
 	ngx_http_request_t *r,
-	char *values_string,
-	const char *requiredPropertyName,
-	size_t length,
+	ngx_http_51D_value_builder_t *builder,
+	ngx_http_51D_property_t *property,
 	ngx_uint_t includeNotAvailable,
 	const char *customSeparator) {
-	size_t remainingLength = length - strlen(values_string);
 	ResultsHash *results = fdmcf->results;
-	DataSetHash *dataSet =
-		(DataSetHash *)results->b.b.dataSet;
-	const char *valueDelimiter;
-	if (customSeparator == NULL) {
-		valueDelimiter = (const char *)fdmcf->valueSeparator.data;
-	}
-	else {
-		valueDelimiter = (const char *)customSeparator;
-	}
-	ngx_int_t charsAdded = 0;
-	char *dest = values_string + strlen(values_string);
-
-	if (values_string[0] != '\0') {
-		charsAdded = snprintf(dest, remainingLength, "%s", valueDelimiter);
-		if (charsAdded >= 0 && charsAdded < (ngx_int_t)remainingLength) {
-			remainingLength -= strlen(valueDelimiter);
-			dest += strlen(valueDelimiter);
+	u_char number[NGX_INT_T_LEN];
+	u_char *dest;
+	size_t available, charsAdded;
+	const char *value = NULL;
+
+	if (builder->len > 0) {
+		if (customSeparator == NULL) {
+			ngx_http_51D_value_append(
+				builder,
+				fdmcf->valueSeparator.data,
+				fdmcf->valueSeparator.len);
+		}
+		else {
+			ngx_http_51D_value_append(
+				builder,
+				(const u_char *)customSeparator,
+				ngx_strlen(customSeparator));
 		}
 	}
 
-	if (charsAdded >= 0 && charsAdded < (ngx_int_t)remainingLength) {
-		EXCEPTION_CREATE
-		if (StringCompare(
-			requiredPropertyName, "Iterations") == 0) {
-			charsAdded = snprintf(
-				dest, remainingLength, "%d", results->items->iterations);
+	EXCEPTION_CREATE
+	switch (property->type) {
+	case ngx_http_51D_property_iterations:
+		ngx_http_51D_value_append(
+			builder,
+			number,
+			ngx_sprintf(number, "%d", results->items->iterations) - number);
+		break;
+	case ngx_http_51D_property_drift:
+		ngx_http_51D_value_append(
+			builder,
+			number,
+			ngx_sprintf(number, "%d", results->items->drift) - number);
+		break;
+	case ngx_http_51D_property_difference:
+		ngx_http_51D_value_append(
+			builder,
+			number,
+			ngx_sprintf(number, "%d", results->items->difference) - number);
+		break;
+	case ngx_http_51D_property_method:
+		switch (results->items->method) {
+			case FIFTYONE_DEGREES_HASH_MATCH_METHOD_PERFORMANCE:
+				value = "PERFORMANCE";
+				break;
+			case FIFTYONE_DEGREES_HASH_MATCH_METHOD_COMBINED:
+				value = "COMBINED";
+				break;
+			case FIFTYONE_DEGREES_HASH_MATCH_METHOD_PREDICTIVE:
+				value = "PREDICTIVE";
+				break;
+			case FIFTYONE_DEGREES_HASH_MATCH_METHOD_NONE:
+			default:
+				value = "NONE";
+				break;
+		}
+		break;
+	case ngx_http_51D_property_user_agents:
+		value = results->items->b.matchedUserAgent;
+		break;
+	case ngx_http_51D_property_matched_nodes:
+		ngx_http_51D_value_append(
+			builder,
+			number,
+			ngx_sprintf(number, "%d", results->items->matchedNodes) - number);
+		break;
+	case ngx_http_51D_property_device_id: {
+		char deviceId[40];
+		HashGetDeviceIdFromResults(
+			results,
+			deviceId,
+			sizeof(deviceId),
+			exception);
+		if (EXCEPTION_FAILED) {
+			report_status(
+				r->connection->log,
+				exception->status,
+				(const char *)fdmcf->dataFile.data);
+		}
+		else {
+			ngx_http_51D_value_append(
+				builder, (u_char *)deviceId, ngx_strlen(deviceId));
 		}
-		else if (StringCompare(
-			requiredPropertyName, "Drift") == 0) {
+		break;
+	}
+	case ngx_http_51D_property_data:
+	default: {
+		bool hasValues = property->requiredPropertyIndex >= 0 &&
+			ResultsHashGetHasValues(
+				results,
+				property->requiredPropertyIndex,
+				exception);
+		if (hasValues) {
+			// Write the values straight into the buffer, growing it to the
+			// length returned if they did not fit.
+			available = ngx_max(
+				builder->capacity - builder->len,
+				FIFTYONE_DEGREES_VALUE_BUFFER_SIZE);
+			dest = ngx_http_51D_value_reserve(builder, available);
+			if (dest == NULL) {
+				break;
+			}
 			charsAdded =
-				snprintf(dest, remainingLength, "%d", results->items->drift);
-		}
-		else if (StringCompare(
-			requiredPropertyName, "Difference") == 0) {
-			charsAdded = snprintf(
-				dest, remainingLength, "%d", results->items->difference);
-		}
-		else if (StringCompare(
-			requiredPropertyName, "Method") == 0) {
-			const char *method;
-			switch (results->items->method) {
-				case FIFTYONE_DEGREES_HASH_MATCH_METHOD_PERFORMANCE:
-					method = "PERFORMANCE";
-					break;
-				case FIFTYONE_DEGREES_HASH_MATCH_METHOD_COMBINED:
-					method = "COMBINED";
-					break;
-				case FIFTYONE_DEGREES_HASH_MATCH_METHOD_PREDICTIVE:
-					method = "PREDICTIVE";
-					break;
-				case FIFTYONE_DEGREES_HASH_MATCH_METHOD_NONE:
-				default:
-					method = "NONE";
+				fiftyoneDegreesResultsHashGetValuesStringByRequiredPropertyIndex(
+					results,
+					property->requiredPropertyIndex,
+					(char *)dest,
+					available + 1,
+					"|",
+					exception);
+			if (EXCEPTION_OKAY && charsAdded > available) {
+				dest = ngx_http_51D_value_reserve(builder, charsAdded);
+				if (dest == NULL) {
 					break;
+				}
+				charsAdded =
+					fiftyoneDegreesResultsHashGetValuesStringByRequiredPropertyIndex(
+						results,
+						property->requiredPropertyIndex,
+						(char *)dest,
+						charsAdded + 1,
+						"|",
+						exception);
 			}
-			charsAdded = snprintf(dest, remainingLength, "%s", method);
-		}
-		else if (StringCompare(
-			requiredPropertyName, "UserAgents") == 0) {
-			charsAdded = snprintf(
-				dest, remainingLength, "%s", results->items->b.matchedUserAgent);
-		}
-		else if (StringCompare(
-			requiredPropertyName, "MatchedNodes") == 0) {
-			charsAdded = snprintf(
-				dest, remainingLength, "%d", results->items->matchedNodes);
-		}
-		else if (StringCompare(
-			requiredPropertyName, "DeviceId") == 0) {
-			char deviceId[40];
-			HashGetDeviceIdFromResults(
-				results,
-				deviceId,
-				sizeof(deviceId),
-				exception);
 			if (EXCEPTION_FAILED) {
 				report_status(
 					r->connection->log,
 					exception->status,
 					(const char *)fdmcf->dataFile.data);
-				snprintf(dest, remainingLength, "%c", '\0');
-				charsAdded = 0;
-			}
-			else {
-				charsAdded = snprintf(dest, remainingLength, "%s", deviceId);
+				break;
 			}
-		}
-		else {
-			int requiredPropertyIndex =
-				PropertiesGetRequiredPropertyIndexFromName(
-					dataSet->b.b.available, requiredPropertyName);
-
-			bool hasValues = ResultsHashGetHasValues(
-				results,
-				requiredPropertyIndex,
-				exception);
-			if (hasValues) {
-				charsAdded = ResultsHashGetValuesString(
-					results,
-					requiredPropertyName,
-					dest,
-					remainingLength,
-					"|",
-					exception);
-				if (EXCEPTION_FAILED) {
-					report_status(
-						r->connection->log,
-						exception->status,
-						(const char *)fdmcf->dataFile.data);
-				}
 
-				// Remove 'Unknown' string.
-				if (!includeNotAvailable) {
-					removeUnknown(dest, &charsAdded);
-				}
-			}
-			else if (includeNotAvailable) {
-				charsAdded = snprintf(
-					dest, remainingLength,
-					"%s",
-					FIFTYONE_DEGREES_PROPERTY_NOT_AVAILABLE);
+			// Remove 'Unknown' string.
+			if (!includeNotAvailable) {
+				charsAdded = ngx_http_51D_remove_unknown(dest, charsAdded);
 			}
+			ngx_http_51D_value_commit(builder, charsAdded);
 		}
+		else if (includeNotAvailable) {
+			value = FIFTYONE_DEGREES_PROPERTY_NOT_AVAILABLE;
+		}
+		break;
+	}
 	}
 
-	if (charsAdded < 0) {
+	if (value != NULL) {
+		ngx_http_51D_value_append(
+			builder, (const u_char *)value, ngx_strlen(value));
+	}
+	if (builder->failed) {
 		ngx_log_error(
 			NGX_LOG_ERR,
 			r->connection->log,
 			0,
 			"51Degrees failed to construct value string.");
 	}
-	else if (charsAdded > (ngx_int_t)remainingLength) {
-		ngx_log_error(
-			NGX_LOG_WARN,
-			r->connection->log,
-			0,
-			"51Degrees value string is bigger than the available buffer.");
-	}
 }
 
 /**
@@ -2222,37 +6939,73 @@ ngx_http_51D_get_user_agent(
  * @param r a ngx_http_request_t.
  * @param fdmcf a main config object.
  * @param header a header to construct value string for.
- * @param haveMatch whether a match has already been perfomed for the
- * input User-Agents.
+ * @param state the state of the match to get the values from. A match is
+ * performed if the state does not have one yet. If NULL, the values are taken
+ * from the current results.
  * @param includeNotAvailable whether not available property (e.g. 'Unknown'
  * or hasValues=false) should be included in the value string.
- * @param userAgent a User-Agent string to perform the match on.
  * @param customSeparator custom separator to be used instead of the
  * 51D_value_separator.
- * @ return an escaped value string. NULL if error occurred.
+ * @param value set to the escaped value string, allocated from the request
+ * pool and null terminated.
+ * @return NGX_OK, or NGX_ERROR if error occurred.
  */
-u_char *getEscapedMatchedValueString(
+ngx_int_t getEscapedMatchedValueString(
 	ngx_http_request_t *r,
 	ngx_http_51D_main_conf_t *fdmcf,
 	ngx_http_51D_data_to_set *header,
-	int haveMatch,
+	ngx_http_51D_match_state_t *state,
 	ngx_uint_t includeNotAvailable,
-	ngx_str_t *userAgent,
-	const char *customSeparator) {
-	memset(fdmcf->valueString, 0, FIFTYONE_DEGREES_MAX_STRING);
+	const char *customSeparator,
+	ngx_str_t *value) {
+	ngx_http_51D_value_builder_t builder;
+	ngx_http_51D_cache_node_t *entry;
+	ngx_uint_t profileCacheMiss = 0;
+	uint64_t key = 0, check = 0;
 
 	// Get a match. If there are multiple instances of
 	// 51D_match_single, 51D_match_ua, 51D_match_ua_client_hints or 51D_match_all, then don't get the
 	// match if it has already been fetched.
-	if (haveMatch == 0) {
+	if (state != NULL && state->hasMatch == 0) {
 		ngx_uint_t ngxCode = 
-			ngx_http_51D_get_match(fdmcf, r, header->multi, userAgent);
+			ngx_http_51D_get_match(fdmcf, r, state);
 		if (ngxCode != NGX_OK) {
-			return NULL;
+			return NGX_ERROR;
 		}	
 	}
 
-	// For each property, set the value in value_string_array.
+	// Look for the values of the matched profiles before formatting them.
+	if (fdmcf->profileCache != NULL && header->profileValues &&
+		ngx_http_51D_get_profiles_key(fdmcf, &key, &check) == NGX_OK) {
+		key = ngx_http_51D_hash(key, &header->key, sizeof(header->key));
+		key = ngx_http_51D_hash(
+			key, &includeNotAvailable, sizeof(includeNotAvailable));
+		check = ngx_http_51D_check_hash(
+			check, &header->key, sizeof(header->key));
+		check = ngx_http_51D_check_hash(
+			check, &includeNotAvailable, sizeof(includeNotAvailable));
+		if (customSeparator != NULL) {
+			key = ngx_http_51D_hash(
+				key, customSeparator, ngx_strlen(customSeparator));
+			check = ngx_http_51D_check_hash(
+				check, customSeparator, ngx_strlen(customSeparator));
+		}
+		entry = ngx_http_51D_cache_lookup(fdmcf->profileCache, key, check);
+		if (entry != NULL) {
+			value->data = (u_char *)ngx_pnalloc(r->pool, entry->value.len + 1);
+			if (value->data == NULL) {
+				report_insufficient_memory_status(r->connection->log);
+				return NGX_ERROR;
+			}
+			ngx_memcpy(value->data, entry->value.data, entry->value.len + 1);
+			value->len = entry->value.len;
+			return NGX_OK;
+		}
+		profileCacheMiss = 1;
+	}
+
+	// For each property, append the escaped value to the value string.
+	ngx_http_51D_value_init(&builder, r->pool, 1);
 	int property_index;
 	for (property_index = 0;
 		property_index < (int)header->propertyCount;
@@ -2260,29 +7013,173 @@ u_char *getEscapedMatchedValueString(
 		ngx_http_51D_get_value(
 			fdmcf,
 			r,
-			fdmcf->valueString,
-			(const char *)header->property[property_index]->data,
-			FIFTYONE_DEGREES_MAX_STRING,
+			&builder,
+			&header->properties[property_index],
 			includeNotAvailable,
 			customSeparator);
 	}
 
-	// Escape characters which cannot be added in a header value, most
-	// importantly '\n' and '\r'.
-	size_t valueStringLength = strlen(fdmcf->valueString);
-	size_t escapedChars =
-		(size_t)ngx_escape_json(NULL, (u_char *)fdmcf->valueString, valueStringLength);
-	u_char *escapedValueString =
-		(u_char *)ngx_palloc(
-			r->pool, (valueStringLength + escapedChars + 1) * sizeof(char));
-	if (escapedValueString == NULL) {
+	if (builder.failed) {
 		report_insufficient_memory_status(r->connection->log);
-		return NULL;
+		return NGX_ERROR;
+	}
+	value->data = builder.data != NULL ? builder.data : (u_char *)"";
+	value->len = builder.len;
+	if (profileCacheMiss) {
+		ngx_http_51D_cache_insert(
+			fdmcf->profileCache,
+			key,
+			check,
+			value->data,
+			value->len,
+			r->connection->log);
+	}
+	return NGX_OK;
+}
+
+/**
+ * Get the escaped value string for a header, from the result caches where
+ * they hold it, otherwise by performing detection if required and adding
+ * the value to the caches.
+ * @param r the http request
+ * @param fdmcf the main configuration of 51Degrees module
+ * @param header the header to get the value string for
+ * @param state the state of the match, shared by all headers which use the
+ * same evidence
+ * @param value set to the escaped value string
+ * @return code to indicate the status of the operation.
+ */
+static ngx_int_t
+ngx_http_51D_get_header_value(
+	ngx_http_request_t *r,
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_http_51D_data_to_set *header,
+	ngx_http_51D_match_state_t *state,
+	ngx_str_t *value) {
+	ngx_str_t escapedValueString = ngx_null_string;
+	ngx_http_51D_cache_node_t *entry;
+	ngx_http_51D_connection_cache_t *connectionCache = NULL;
+	ngx_str_t *connectionValue;
+	uint64_t key = 0, check = 0, connectionKey = 0;
+
+	// The values of the previous requests on the connection are looked at
+	// first, as they nearly always have the same evidence. They are keyed on
+	// the raw evidence, so nothing more is parsed when they are found.
+	if (fdmcf->connectionCache == 1) {
+		if (ngx_http_51D_get_connection_key(fdmcf, r, state) != NGX_OK) {
+			return NGX_ERROR;
+		}
+		connectionKey = ngx_http_51D_hash(
+			state->connectionKey, &header->key, sizeof(header->key));
+		connectionCache = ngx_http_51D_connection_cache_get(fdmcf, r);
+		connectionValue = connectionCache != NULL ?
+			ngx_http_51D_connection_cache_find(
+				connectionCache, connectionKey) : NULL;
+		if (connectionValue == NULL) {
+			fdmcf->connectionCacheMisses++;
+		}
+		else {
+			fdmcf->connectionCacheHits++;
+			ngx_log_debug1(
+				NGX_LOG_DEBUG_HTTP,
+				r->connection->log,
+				0,
+				"51Degrees connection cache hit for \"%V\".",
+				&header->headerName);
+			value->data = (u_char *)ngx_pnalloc(r->pool, connectionValue->len + 1);
+			if (value->data == NULL) {
+				report_insufficient_memory_status(r->connection->log);
+				return NGX_ERROR;
+			}
+			ngx_memcpy(value->data, connectionValue->data, connectionValue->len + 1);
+			value->len = connectionValue->len;
+			return NGX_OK;
+		}
+	}
+
+	// Look for the value in the result caches before performing a match.
+	if (fdmcf->cache != NULL || fdmcf->cacheZoneSh != NULL) {
+		if (ngx_http_51D_get_match_key(fdmcf, r, state) != NGX_OK) {
+			return NGX_ERROR;
+		}
+		key = ngx_http_51D_hash(state->key, &header->key, sizeof(header->key));
+		check = ngx_http_51D_check_hash(
+			state->check, &header->key, sizeof(header->key));
+	}
+	if (fdmcf->cache != NULL) {
+		entry = ngx_http_51D_cache_lookup(fdmcf->cache, key, check);
+		if (entry != NULL) {
+			ngx_log_debug1(
+				NGX_LOG_DEBUG_HTTP,
+				r->connection->log,
+				0,
+				"51Degrees result cache hit for \"%V\".",
+				&header->headerName);
+			// Copy the value, as the entry can be evicted by a later header
+			// in this request.
+			escapedValueString.data =
+				(u_char *)ngx_pnalloc(r->pool, entry->value.len + 1);
+			if (escapedValueString.data == NULL) {
+				report_insufficient_memory_status(r->connection->log);
+				return NGX_ERROR;
+			}
+			ngx_memcpy(
+				escapedValueString.data,
+				entry->value.data,
+				entry->value.len + 1);
+			escapedValueString.len = entry->value.len;
+		}
+	}
+	if (escapedValueString.data == NULL && fdmcf->cacheZoneSh != NULL) {
+		escapedValueString.data =
+			ngx_http_51D_cache_zone_lookup(fdmcf, r, key, check);
+		if (escapedValueString.data != NULL) {
+			escapedValueString.len = ngx_strlen(escapedValueString.data);
+			if (fdmcf->cache != NULL) {
+				ngx_http_51D_cache_insert(
+					fdmcf->cache,
+					key,
+					check,
+					escapedValueString.data,
+					escapedValueString.len,
+					r->connection->log);
+			}
+		}
+	}
+
+	if (escapedValueString.data == NULL) {
+		if (getEscapedMatchedValueString(
+			r, fdmcf, header, state, 1, NULL, &escapedValueString) != NGX_OK) {
+			return NGX_ERROR;
+		}
+		if (fdmcf->cache != NULL) {
+			ngx_http_51D_cache_insert(
+				fdmcf->cache,
+				key,
+				check,
+				escapedValueString.data,
+				escapedValueString.len,
+				r->connection->log);
+		}
+		if (fdmcf->cacheZoneSh != NULL) {
+			ngx_http_51D_cache_zone_insert(
+				fdmcf,
+				key,
+				check,
+				escapedValueString.data,
+				escapedValueString.len);
+		}
+	}
+	if (connectionCache != NULL) {
+		ngx_http_51D_connection_cache_insert(
+			connectionCache,
+			connectionKey,
+			escapedValueString.data,
+			escapedValueString.len);
 	}
-	ngx_escape_json(escapedValueString, (u_char *)fdmcf->valueString, valueStringLength);
-	escapedValueString[valueStringLength + escapedChars] = '\0';
 
-	return escapedValueString;
+	*value = escapedValueString;
+	return NGX_OK;
 }
 
 /**
@@ -2294,9 +7191,8 @@ u_char *getEscapedMatchedValueString(
  * @param header the header name to set
  * @param h the list of headers to store the match result
  * @param matchIndex the index in the headers list to store the match values
- * @param haveMatch indicate of a match has already been performed for input
- * userAgent
- * @param userAgent the user agent to perform the match for
+ * @param state the state of the match, shared by all headers which use the
+ * same evidence
  * @return code to indicate the status of the operation.
  */
 ngx_uint_t
@@ -2305,25 +7201,137 @@ process(ngx_http_request_t *r,
 		ngx_http_51D_data_to_set *header,
 		ngx_table_elt_t *h[],
 		int matchIndex,
-		int haveMatch,
-		ngx_str_t *userAgent) {
-	u_char *escapedValueString = getEscapedMatchedValueString(
-		r, fdmcf, header, haveMatch, 1, userAgent, NULL);
-	if (escapedValueString == NULL) {
+		ngx_http_51D_match_state_t *state) {
+	ngx_str_t escapedValueString;
+
+	if (ngx_http_51D_get_header_value(
+		r, fdmcf, header, state, &escapedValueString) != NGX_OK) {
 		return NGX_ERROR;
 	}
 
 	// For each property value pair, set a new header name and value.
 	h[matchIndex] = ngx_list_push(&r->headers_in.headers);
 	h[matchIndex]->key.data = (u_char *)header->headerName.data;
-	h[matchIndex]->key.len = ngx_strlen(h[matchIndex]->key.data);
-	h[matchIndex]->hash = ngx_hash_key(h[matchIndex]->key.data, h[matchIndex]->key.len);
-	h[matchIndex]->value.data = escapedValueString;
-	h[matchIndex]->value.len = ngx_strlen(h[matchIndex]->value.data);
+	h[matchIndex]->key.len = header->headerName.len;
+	h[matchIndex]->hash = header->headerHash;
+	h[matchIndex]->value = escapedValueString;
 	h[matchIndex]->lowcase_key = (u_char *)header->lowerHeaderName.data;
 	return NGX_OK;
 }
 
+/**
+ * Determine if the response headers should be set for the request. Always
+ * prioritise the lower level, so the order is location, server, main.
+ * @param fdlcf 51Degrees location config.
+ * @param fdscf 51Degrees server config.
+ * @param fdmcf 51Degrees main config.
+ * @return 1 if the response headers are set, otherwise 0.
+ */
+static ngx_uint_t
+ngx_http_51D_set_headers_enabled(
+	ngx_http_51D_loc_conf_t *fdlcf,
+	ngx_http_51D_srv_conf_t *fdscf,
+	ngx_http_51D_main_conf_t *fdmcf)
+{
+	if (fdlcf->matchConf.setHeaders != NGX_CONF_UNSET_UINT) {
+		return fdlcf->matchConf.setHeaders;
+	}
+	if (fdscf->matchConf.setHeaders != NGX_CONF_UNSET_UINT) {
+		return fdscf->matchConf.setHeaders;
+	}
+	return fdmcf->matchConf.setHeaders != NGX_CONF_UNSET_UINT ?
+		fdmcf->matchConf.setHeaders : 0;
+}
+
+/**
+ * Get the key of the profiles of the request's last match, which the
+ * worker's results must hold. The key is kept in the request's context, so
+ * is only found once for the match.
+ * @param fdmcf module main config.
+ * @param ctx the request's context.
+ * @param key set to the hash of the matched profiles.
+ * @return NGX_OK, or NGX_DECLINED if the match has no profiles key.
+ */
+static ngx_int_t
+ngx_http_51D_get_ctx_profiles_key(
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_http_51D_ctx_t *ctx,
+	uint64_t *key)
+{
+	if (ctx->profilesKeySequence == 0 ||
+		ctx->profilesKeySequence != ctx->matchSequence) {
+		if (ngx_http_51D_get_profiles_key(
+			fdmcf, &ctx->profilesKey, NULL) !=
+			NGX_OK) {
+			return NGX_DECLINED;
+		}
+		ctx->profilesKeySequence = ctx->matchSequence;
+	}
+	*key = ctx->profilesKey;
+	return NGX_OK;
+}
+
+/**
+ * Format the values of the response headers for the request's last match,
+ * which the worker's results must hold, and keep them in the request's
+ * context for the header filter. The values only depend on the matched
+ * profiles, so are used from the worker's table if they have been formatted
+ * for them before.
+ * @param r the HTTP request.
+ * @param fdmcf module main config.
+ * @param ctx the request's context.
+ * @return NGX_OK, or NGX_ERROR if the values could not be formatted.
+ */
+static ngx_int_t
+ngx_http_51D_format_resp_headers(
+	ngx_http_request_t *r,
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_http_51D_ctx_t *ctx)
+{
+	ngx_str_t *values;
+	ngx_uint_t i, cacheable;
+	ngx_int_t cached = NGX_DECLINED;
+	uint64_t key = 0;
+
+	values = (ngx_str_t *)ngx_palloc(
+		r->pool, fdmcf->setRespHeaderCount * sizeof(ngx_str_t));
+	if (values == NULL) {
+		report_insufficient_memory_status(r->connection->log);
+		return NGX_ERROR;
+	}
+
+	cacheable = fdmcf->setRespHeaderProfileValues &&
+		ngx_http_51D_get_ctx_profiles_key(fdmcf, ctx, &key) == NGX_OK;
+	if (cacheable) {
+		cached = ngx_http_51D_resp_header_cache_find(r, fdmcf, key, values);
+		if (cached == NGX_ERROR) {
+			return NGX_ERROR;
+		}
+	}
+
+	if (cached != NGX_OK) {
+		for (i = 0; i < fdmcf->setRespHeaderCount; i++) {
+			if (getEscapedMatchedValueString(
+				r,
+				fdmcf,
+				&fdmcf->setRespHeader[i],
+				NULL,
+				0,
+				",",
+				&values[i]) != NGX_OK) {
+				return NGX_ERROR;
+			}
+		}
+		if (cacheable) {
+			ngx_http_51D_resp_header_cache_insert(
+				fdmcf, key, values, r->connection->log);
+		}
+	}
+
+	ctx->respHeaderValues = values;
+	return NGX_OK;
+}
+
 /**
  * Module handler, gets a match using either the User-Agent or multiple http
  * headers, then sets properties as headers.
@@ -2340,10 +7348,12 @@ ngx_http_51D_handler(ngx_http_request_t *r)
 	ngx_http_51D_srv_conf_t *fdscf;
 	ngx_http_51D_loc_conf_t *fdlcf;
 	ngx_http_51D_match_conf_t *matchConf[FIFTYONE_DEGREES_CONFIG_LEVELS];
-	ngx_uint_t matchIndex = 0, rawMulti, haveMatch;
+	ngx_uint_t matchIndex = 0, rawMulti;
 	ngx_http_51D_data_to_set *currentHeader;
 	int totalHeaderCount, matchConfIndex;
 	ngx_str_t *userAgent, *nextUserAgent;
+	ngx_http_51D_match_state_t state;
+	ngx_http_51D_ctx_t *ctx;
 
 	if (r->main->internal ||
 		ngx_http_51D_shm_resource_manager == NULL ||
@@ -2376,6 +7386,16 @@ ngx_http_51D_handler(ngx_http_request_t *r)
 	if ((int)totalHeaderCount == 0) {
 		return NGX_DECLINED;
 	}
+
+#if (NGX_THREADS)
+	// Wait for the all evidence match to be performed in the thread pool
+	// if one is set. The handler runs again when it completes.
+	if (ngx_http_51D_post_thread_match(
+		fdmcf, fdlcf, r, matchConf, userAgent) == NGX_DONE) {
+		r->main->internal = 0;
+		return NGX_DONE;
+	}
+#endif
 	// Look for single User-Agent matches, then multiple HTTP header
 	// matches. Single and multi matches are done separately to reuse
 	// a match instead of retrieving it multiple times. Start with
@@ -2383,7 +7403,10 @@ ngx_http_51D_handler(ngx_http_request_t *r)
 	for (rawMulti = ngx_http_51D_multi_mode_bit_ua_only;
 		rawMulti < ngx_http_51D_multi_mode_bits_count;
 		rawMulti++) {
-		haveMatch = 0;
+		// The state is shared by all headers in this pass, and takes the
+		// match mode of the first header.
+		ngx_http_51D_init_match_state(
+			&state, 0, userAgent, fdlcf->overrides);
 
 		// Go through the requested matches in location, server and
 		// main configs.
@@ -2398,16 +7421,22 @@ ngx_http_51D_handler(ngx_http_request_t *r)
 				if ((currentHeader->multi & (1<<rawMulti)) &&
 					(int)currentHeader->variableName.len <= 0 &&
 					userAgent != NULL) {
-					haveMatch = (process(r, fdmcf, currentHeader, h, matchIndex, haveMatch, userAgent) == NGX_OK);
+					if (state.multi == 0) {
+						state.multi = currentHeader->multi;
+					}
+					process(r, fdmcf, currentHeader, h, matchIndex, &state);
 					matchIndex++;
 				}
 				// Look at the next header.
 				currentHeader = currentHeader->next;
 			}
 		}
+		ngx_http_51D_free_match_state(&state);
 	}
 
-	userAgent = &(ngx_str_t)ngx_string("");
+	// Headers which take the User-Agent from a variable share a match only
+	// with the headers before them which have the same User-Agent.
+	ngx_http_51D_init_match_state(&state, 0, NULL, fdlcf->overrides);
 	for (matchConfIndex = 0;
 		matchConfIndex < FIFTYONE_DEGREES_CONFIG_LEVELS;
 		matchConfIndex++) {
@@ -2416,39 +7445,149 @@ ngx_http_51D_handler(ngx_http_request_t *r)
 			if ((currentHeader->multi & ngx_http_51D_multi_mode_mask_ua_only) && (int)currentHeader->variableName.len > 0) {
 				nextUserAgent = ngx_http_51D_get_user_agent(r, currentHeader);
 				if (nextUserAgent != NULL) {
-					if (userAgent != NULL &&
+					if (state.userAgent == NULL ||
 						strcmp(
-							(const char *)userAgent->data,
-							(const char *)nextUserAgent->data) == 0) {
-						const int newHaveMatch = 1;
-						process(r, fdmcf, currentHeader, h, matchIndex, newHaveMatch, userAgent);
-					}
-					else {
-						userAgent = nextUserAgent;
-						const int newHaveMatch = 0;
-						process(r, fdmcf, currentHeader, h, matchIndex, newHaveMatch, userAgent);
+							(const char *)state.userAgent->data,
+							(const char *)nextUserAgent->data) != 0) {
+						ngx_http_51D_free_match_state(&state);
+						ngx_http_51D_init_match_state(
+							&state,
+							currentHeader->multi,
+							nextUserAgent,
+							fdlcf->overrides);
 					}
+					process(r, fdmcf, currentHeader, h, matchIndex, &state);
 					matchIndex++;
 				}
 			}
 			currentHeader = currentHeader->next;
 		}
 	}
+	ngx_http_51D_free_match_state(&state);
+
+	// Format the response headers while the worker's results still hold the
+	// request's last match, so the header filter does not match again if
+	// another request is matched before the response is sent. If they can
+	// not be formatted here, the header filter formats them.
+	if (fdmcf->setRespHeaderCount > 0 &&
+		ngx_http_51D_set_headers_enabled(fdlcf, fdscf, fdmcf)) {
+		ctx = ngx_http_get_module_ctx(r, ngx_http_51D_module);
+		if (ctx != NULL &&
+			ctx->matchSequence != 0 &&
+			ctx->matchSequence == fdmcf->matchSequence) {
+			ngx_http_51D_format_resp_headers(r, fdmcf, ctx);
+		}
+	}
 
 	// Tell nginx to continue with other module handlers.
 	return NGX_DECLINED;
 }
 
 /**
- * Find a header in the response header list.
+ * Add the Vary header to a Javascript response which depends on the match,
+ * so that browsers and shared caches do not send the Javascript for one
+ * device to another. It lists the request headers the match of the body
+ * uses, the Cookie header where overrides can come from cookies, and
+ * Accept-Encoding where the body can be sent gzip encoded. nginx's own
+ * Vary, set by the gzip check, is cleared as it is already included.
+ * @param r the request to set the Vary header for.
+ * @param fdmcf 51Degrees main config holding the evidence headers.
+ * @param body the Javascript body to set.
+ * @param overrides sources of override evidence the match uses.
+ * @param encodings whether the body can be sent gzip encoded.
+ * @return NGX_OK, or NGX_ERROR if the header could not be allocated.
+ */
+static ngx_int_t
+ngx_http_51D_set_javascript_vary(
+	ngx_http_request_t *r,
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_http_51D_data_to_set *body,
+	ngx_uint_t overrides,
+	ngx_uint_t encodings) {
+	ngx_http_51D_value_builder_t vary;
+	ngx_http_51D_evidence_header_t *header;
+	ngx_table_elt_t *h;
+	ngx_uint_t i;
+
+	ngx_http_51D_value_init(&vary, r->pool, 0);
+	if (body->multi & ngx_http_51D_multi_mode_mask_ua_only) {
+		// A User-Agent from a variable is not known to come from a header.
+		if ((int)body->variableName.len <= 0) {
+			ngx_http_51D_value_append(
+				&vary,
+				(const u_char *)NGX_HTTP_51D_HEADER_USER_AGENT,
+				ngx_strlen(NGX_HTTP_51D_HEADER_USER_AGENT));
+		}
+	}
+	else {
+		for (i = 0; i < fdmcf->evidenceHeaderCount; i++) {
+			header = &fdmcf->evidenceHeaders[i];
+			if ((body->multi & ngx_http_51D_multi_mode_mask_all_evidence) ||
+				header->clientHints) {
+				if (vary.len > 0) {
+					ngx_http_51D_value_append(&vary, (const u_char *)", ", 2);
+				}
+				ngx_http_51D_value_append(
+					&vary, (const u_char *)header->name, header->nameLength);
+			}
+		}
+	}
+	if (overrides & ngx_http_51D_overrides_cookie) {
+		if (vary.len > 0) {
+			ngx_http_51D_value_append(&vary, (const u_char *)", ", 2);
+		}
+		ngx_http_51D_value_append(&vary, (const u_char *)"Cookie", 6);
+	}
+	if (encodings) {
+		if (vary.len > 0) {
+			ngx_http_51D_value_append(&vary, (const u_char *)", ", 2);
+		}
+		ngx_http_51D_value_append(
+			&vary, (const u_char *)"Accept-Encoding", 15);
+#if (NGX_HTTP_GZIP)
+		r->gzip_vary = 0;
+#endif
+	}
+	if (vary.failed) {
+		report_insufficient_memory_status(r->connection->log);
+		return NGX_ERROR;
+	}
+	if (vary.len == 0) {
+		return NGX_OK;
+	}
+
+	h = ngx_list_push(&r->headers_out.headers);
+	if (h == NULL) {
+		report_insufficient_memory_status(r->connection->log);
+		return NGX_ERROR;
+	}
+	h->hash = 1;
+	ngx_str_set(&h->key, "Vary");
+	h->value.data = vary.data;
+	h->value.len = vary.len;
+	h->lowcase_key = (u_char *)"vary";
+	return NGX_OK;
+}
+
+/**
+ * Find the response headers to set which are already in the response, in a
+ * single pass over the response header list. Names are compared without case.
  * @param r a ngx_http_request_t
- * @param headerName header name to find.
- * @return pointer to the header that match.
+ * @param fdmcf 51Degrees main config holding the headers to set.
+ * @param found set to the response header for each header to set, or NULL
+ * if it is not in the response.
  */
-static ngx_table_elt_t *findResponseHeader(ngx_http_request_t *r, ngx_str_t headerName) {
+static void
+ngx_http_51D_find_response_headers(
+	ngx_http_request_t *r,
+	ngx_http_51D_main_conf_t *fdmcf,
+	ngx_table_elt_t **found) {
 	ngx_list_part_t *part = &r->headers_out.headers.part;
 	ngx_table_elt_t *header = part->elts;
-	ngx_uint_t i;
+	ngx_http_51D_data_to_set *respHeader;
+	ngx_uint_t i, j;
+
+	ngx_memzero(found, fdmcf->setRespHeaderCount * sizeof(ngx_table_elt_t *));
 	for (i = 0; /* void */; i++) {
 		if (i >= part->nelts) {
 			if (part->next == NULL) {
@@ -2460,16 +7599,26 @@ static ngx_table_elt_t *findResponseHeader(ngx_http_request_t *r, ngx_str_t head
 			i = 0;
 		}
 
-		if (header[i].hash == 0)  {
+		if (header[i].hash == 0 ||
+			header[i].key.len > fdmcf->setRespHeaderLength)  {
 			continue;
 		}
 
-		if (header[i].key.len == headerName.len &&
-			ngx_strcmp(header[i].key.data, headerName.data) == 0) {
-			return &header[i];
+		for (j = 0; j < fdmcf->setRespHeaderCount; j++) {
+			respHeader = &fdmcf->setRespHeader[j];
+			if (found[j] == NULL &&
+				header[i].key.len == respHeader->lowerHeaderName.len &&
+				ngx_tolower(header[i].key.data[0]) ==
+					respHeader->lowerHeaderName.data[0] &&
+				ngx_strncasecmp(
+					header[i].key.data,
+					respHeader->lowerHeaderName.data,
+					header[i].key.len) == 0) {
+				found[j] = &header[i];
+				break;
+			}
 		}
 	}
-	return NULL;
 }
 
 /**
@@ -2487,9 +7636,15 @@ ngx_http_51D_header_filter(ngx_http_request_t *r) {
 	ngx_http_51D_loc_conf_t *fdlcf;
 	ngx_http_51D_srv_conf_t *fdscf;
 	ngx_http_51D_main_conf_t *fdmcf;
-	ngx_http_51D_match_conf_t *lMatchConf, *sMatchConf, *mMatchConf;
-	ngx_str_t *userAgent;
-	size_t contentLength = 0;
+	ngx_http_51D_match_conf_t *lMatchConf;
+	ngx_http_51D_match_state_t state;
+	ngx_http_51D_ctx_t *ctx;
+	ngx_http_51D_javascript_entry_t *entry;
+	ngx_http_51D_value_builder_t value;
+	ngx_table_elt_t *h;
+	ngx_str_t *userAgent, javascript;
+	ngx_uint_t cacheable, gzip, encodings;
+	uint64_t key = 0;
 	ngx_uint_t i = 0;
 
 	if (ngx_http_51D_shm_resource_manager == NULL ||
@@ -2503,69 +7658,96 @@ ngx_http_51D_header_filter(ngx_http_request_t *r) {
 	fdmcf = ngx_http_get_module_main_conf(r, ngx_http_51D_module);
 
 	lMatchConf = &fdlcf->matchConf;
-	sMatchConf = &fdscf->matchConf;
-	mMatchConf = &fdmcf->matchConf;
-
-	// Determine if Set Headers should be set.
-	// Always prioritise the lower level, so the order is
-	// location, server, main.
-	ngx_uint_t setHeaders = 0;
-	if (lMatchConf->setHeaders == NGX_CONF_UNSET_UINT) {
-		if (sMatchConf->setHeaders == NGX_CONF_UNSET_UINT) {
-			setHeaders = mMatchConf->setHeaders != NGX_CONF_UNSET_UINT ?
-				mMatchConf->setHeaders : 0;
-		}
-		else {
-			setHeaders = sMatchConf->setHeaders;
-		}
-	}
-	else {
-		setHeaders = lMatchConf->setHeaders;
-	}
-
 
 	// Setting the headers
-	if (setHeaders) {
-		ngx_table_elt_t *h;
-		ngx_http_51D_data_to_set *currentHeader = fdmcf->setRespHeader;
-		for (i = 0; currentHeader != NULL; i++) {
-			u_char *escapedValueString = getEscapedMatchedValueString(
-				r, fdmcf, currentHeader, i, 0, NULL, ",");
-			if (escapedValueString == NULL) {
+	if (ngx_http_51D_set_headers_enabled(fdlcf, fdscf, fdmcf)) {
+		ngx_table_elt_t **found;
+		ngx_http_51D_data_to_set *currentHeader;
+		ngx_str_t *values;
+		u_char *buffer;
+		size_t length = 0;
+
+		found = (ngx_table_elt_t **)ngx_palloc(
+			r->pool, fdmcf->setRespHeaderCount * sizeof(ngx_table_elt_t *));
+		ctx = ngx_http_51D_get_ctx(r);
+		if (found == NULL || ctx == NULL) {
+			report_insufficient_memory_status(r->connection->log);
+			return NGX_ERROR;
+		}
+
+		// Response headers use the results of the request's last match,
+		// which the handler formats them for. If it did not, the match is
+		// performed again unless the worker's results still hold it.
+		// Requests without a match use all of their evidence.
+		if (ctx->respHeaderValues == NULL) {
+			if (ctx->matchSequence != 0) {
+				ngx_http_51D_init_match_state(
+					&state,
+					ctx->matchMulti,
+					ctx->matchUserAgent,
+					ctx->matchOverrides);
+			}
+			else {
+				ngx_http_51D_init_match_state(
+					&state,
+					ngx_http_51D_multi_mode_mask_all_evidence,
+					ngx_http_51D_get_user_agent(r, NULL),
+					fdlcf->overrides);
+			}
+			rc = ngx_http_51D_get_match(fdmcf, r, &state);
+			ngx_http_51D_free_match_state(&state);
+			if (rc != NGX_OK ||
+				ngx_http_51D_format_resp_headers(r, fdmcf, ctx) != NGX_OK) {
 				return NGX_ERROR;
 			}
+		}
+		values = ctx->respHeaderValues;
+
+		// Find the headers already in the response, so that the values
+		// appended to them can be written to one buffer.
+		ngx_http_51D_find_response_headers(r, fdmcf, found);
+		for (i = 0; i < fdmcf->setRespHeaderCount; i++) {
+			if (found[i] != NULL) {
+				length += found[i]->value.len + values[i].len + 2;
+			}
+		}
 
-			ngx_table_elt_t *header = findResponseHeader(r, currentHeader->headerName);
+		buffer = NULL;
+		if (length > 0) {
+			buffer = (u_char *)ngx_pnalloc(r->pool, length);
+			if (buffer == NULL) {
+				report_insufficient_memory_status(r->connection->log);
+				return NGX_ERROR;
+			}
+		}
 
-			if (header == NULL) {
+		for (i = 0; i < fdmcf->setRespHeaderCount; i++) {
+			currentHeader = &fdmcf->setRespHeader[i];
+			if (found[i] == NULL) {
 				// For each property value pair, set a new header name and value.
 				h = ngx_list_push(&r->headers_out.headers);
+				if (h == NULL) {
+					report_insufficient_memory_status(r->connection->log);
+					return NGX_ERROR;
+				}
 				h->key.data = (u_char *)currentHeader->headerName.data;
-				h->key.len = ngx_strlen(h->key.data);
-				h->hash = ngx_hash_key(h->key.data, h->key.len);
-				h->value.data = escapedValueString;
-				h->value.len = ngx_strlen(h->value.data);
+				h->key.len = currentHeader->headerName.len;
+				h->hash = currentHeader->headerHash;
+				h->value = values[i];
 				h->lowcase_key = (u_char *)currentHeader->lowerHeaderName.data;
 			}
 			else {
-				size_t len = header->value.len + ngx_strlen(escapedValueString) + ngx_strlen(",") + 1;
-				u_char *newHeaderValue = (u_char *)ngx_palloc(r->pool, len);
-				if (newHeaderValue == NULL) {
-					report_insufficient_memory_status(r->connection->log);
-					return NGX_ERROR;
-				}
-
-				ngx_sprintf(
-					newHeaderValue,
-					"%s%s%s",
-					header->value.data,
-					",",
-					escapedValueString) ;
-				newHeaderValue[len] = '\0';
-				header->value.data = newHeaderValue;
-				header->value.len = len;
+				// Append the value to the existing header, null terminated.
+				h = found[i];
+				*ngx_sprintf(
+					buffer,
+					"%V,%V",
+					&h->value,
+					&values[i]) = '\0';
+				h->value.data = buffer;
+				h->value.len = h->value.len + values[i].len + 1;
+				buffer += h->value.len + 1;
 			}
-			currentHeader = currentHeader->next;
 		}
 	}
 
@@ -2579,48 +7761,166 @@ ngx_http_51D_header_filter(ngx_http_request_t *r) {
 			ngx_http_51D_get_user_agent(r, NULL) :
 			ngx_http_51D_get_user_agent(r, lMatchConf->body);
 
-		memset(fdmcf->valueString, 0, FIFTYONE_DEGREES_MAX_STRING);
+		ngx_http_51D_value_init(&value, r->pool, 0);
+		entry = NULL;
+		cacheable = 0;
+		gzip = 0;
+		encodings = 0;
+
+		ctx = ngx_http_51D_get_ctx(r);
+		if (ctx == NULL) {
+			return NGX_ERROR;
+		}
+
+		// Let browsers and CDNs cache the Javascript, including when it is
+		// not modified.
+		if (fdlcf->javascriptCacheControl.len > 0) {
+			h = ngx_list_push(&r->headers_out.headers);
+			if (h == NULL) {
+				report_insufficient_memory_status(r->connection->log);
+				return NGX_ERROR;
+			}
+			h->hash = 1;
+			ngx_str_set(&h->key, "Cache-Control");
+			h->value = fdlcf->javascriptCacheControl;
+			h->lowcase_key = (u_char *)"cache-control";
+		}
+
+		if (lMatchConf->body->propertyCount > 0) {
+			// Get a match. If the worker's results still hold the same
+			// match for the request, e.g. from setting the response headers,
+			// then it is not performed again.
+			ngx_http_51D_init_match_state(
+				&state,
+				lMatchConf->body->multi,
+				userAgent,
+				fdlcf->overrides);
+			rc = ngx_http_51D_get_match(fdmcf, r, &state);
+			ngx_http_51D_free_match_state(&state);
+			if (rc != NGX_OK) {
+				return rc;
+			}
+
+			// The Javascript is the same for every match of the same
+			// profiles, so is only formatted if the worker does not hold it.
+			if (lMatchConf->body->profileValues &&
+				ngx_http_51D_get_ctx_profiles_key(fdmcf, ctx, &key) ==
+					NGX_OK) {
+				key = ngx_http_51D_hash(
+					key,
+					&lMatchConf->body->key,
+					sizeof(lMatchConf->body->key));
+				cacheable = 1;
+#if (NGX_HTTP_GZIP && NGX_ZLIB)
+				// The compressed body is only sent where it is turned on,
+				// as the gzip directive of the location does not apply to
+				// a body which never passes through the gzip filter.
+				if (fdlcf->javascriptGzip) {
+					gzip = r->headers_out.content_encoding == NULL &&
+						ngx_http_gzip_ok(r) == NGX_OK;
+					encodings = 1;
+				}
+#endif
+			}
+
+			// The Javascript differs by the evidence of the match, which
+			// caches must know, including for a 304 Not Modified response.
+			if (ngx_http_51D_set_javascript_vary(
+				r,
+				fdmcf,
+				lMatchConf->body,
+				fdlcf->overrides,
+				encodings) != NGX_OK) {
+				return NGX_ERROR;
+			}
+
+			if (cacheable) {
+				// The Javascript is identified by the data file and the
+				// matched profiles, so a request which already has it is
+				// answered before it is found or formatted.
+				h = ngx_http_51D_set_javascript_etag(r, fdmcf, key, gzip);
+				if (h == NULL) {
+					return NGX_ERROR;
+				}
+				if (ngx_http_51D_etag_match(r, &h->value)) {
+					ctx->notModified = 1;
+					r->headers_out.status = NGX_HTTP_NOT_MODIFIED;
+					r->headers_out.status_line.len = 0;
+					r->headers_out.content_type.len = 0;
+					ngx_http_clear_content_length(r);
+					ngx_http_clear_accept_ranges(r);
+					r->header_only = 1;
+					return ngx_http_next_header_filter(r);
+				}
+
+				entry = ngx_http_51D_javascript_cache_find(fdmcf, key);
+			}
+
+			// For each property, set the value in value_string_array.
+			if (entry == NULL) {
+				ngx_http_51D_get_value(
+					fdmcf,
+					r,
+					&value,
+					&lMatchConf->body->properties[0],
+					1,
+					NULL);
+			}
+		}
+
+		if (entry == NULL) {
+			if (value.len > 0 &&
+				ngx_strcmp(
+					value.data,
+					FIFTYONE_DEGREES_PROPERTY_NOT_AVAILABLE) != 0) {
+				javascript.data = value.data;
+				javascript.len = value.len;
+			}
+			else {
+				javascript.data =
+					(u_char *)FIFTYONE_DEGREES_JAVASCRIPT_NOT_AVAILABLE;
+				javascript.len =
+					ngx_strlen(FIFTYONE_DEGREES_JAVASCRIPT_NOT_AVAILABLE);
+			}
+			if (cacheable) {
+				entry = ngx_http_51D_javascript_cache_insert(
+					fdmcf, key, &javascript, r->connection->log);
+			}
+		}
 
-		if (lMatchConf->body->propertyCount > 0) {
-			// Get a match. If there are multiple instances of
-			// 51D_match_single, 51D_match_ua, 51D_match_ua_client_hints or 51D_match_all, then don't get the
-			// match if it has already been fetched.
-			// If Response Headers was performed and
-			// a '51D_get_javascript_all' is used then
-			// no need to perform detection again.
-			if ((lMatchConf->body->multi & ngx_http_51D_multi_mode_mask_ua_only) ||
-				((lMatchConf->body->multi & ngx_http_51D_multi_mode_mask_non_ua_only) && 
-					(setHeaders == 0 || fdmcf->setRespHeaderCount <= 0))) {
-				ngx_uint_t ngxCode = ngx_http_51D_get_match(fdmcf, r, lMatchConf->body->multi, userAgent);
-				if (ngxCode != NGX_OK) {
-					return ngxCode;
+		// Send the body held by the worker, compressed if 51D_javascript_gzip
+		// is on and the request accepts gzip encoding. The gzip filter leaves responses which
+		// already have a Content-Encoding alone.
+		if (entry != NULL) {
+			if (ngx_http_51D_javascript_acquire(r, entry) != NGX_OK) {
+				return NGX_ERROR;
+			}
+			javascript = entry->identity;
+#if (NGX_HTTP_GZIP)
+			if (entry->gzip.len > 0 && gzip) {
+				h = ngx_list_push(&r->headers_out.headers);
+				if (h == NULL) {
+					report_insufficient_memory_status(r->connection->log);
+					return NGX_ERROR;
 				}
+				h->hash = 1;
+				ngx_str_set(&h->key, "Content-Encoding");
+				ngx_str_set(&h->value, "gzip");
+				h->lowcase_key = (u_char *)"content-encoding";
+				r->headers_out.content_encoding = h;
+				javascript = entry->gzip;
 			}
-
-			// For each property, set the value in value_string_array.
-			ngx_http_51D_get_value(
-				fdmcf,
-				r,
-				fdmcf->valueString,
-				(const char *)lMatchConf->body->property[0]->data,
-				FIFTYONE_DEGREES_MAX_STRING,
-				1,
-				NULL);
+#endif
 		}
 
+		// Keep the Javascript for the body filter, so it is formatted once
+		// and matches the Content-Length.
+		ctx->javascript = javascript;
+		ctx->hasJavascript = 1;
+
 		// Send header
-		contentLength = ngx_strlen(fdmcf->valueString);
 		r->headers_out.status = NGX_HTTP_OK;
-		if (contentLength > 0 &&
-			ngx_strcmp(
-				fdmcf->valueString,
-				FIFTYONE_DEGREES_PROPERTY_NOT_AVAILABLE) != 0) {
-			r->headers_out.content_length_n = contentLength;
-		}
-		else {
-			r->headers_out.content_length_n =
-				ngx_strlen(FIFTYONE_DEGREES_JAVASCRIPT_NOT_AVAILABLE);
-		}
+		r->headers_out.content_length_n = javascript.len;
 	}
 	return ngx_http_next_header_filter(r);
 }
@@ -2642,7 +7942,8 @@ ngx_http_51D_body_filter(ngx_http_request_t *r, ngx_chain_t *in) {
 	ngx_http_51D_loc_conf_t *fdlcf;
 	ngx_http_51D_main_conf_t *fdmcf;
 	ngx_http_51D_match_conf_t *matchConf;
-	ngx_str_t *userAgent;
+	ngx_http_51D_value_builder_t value;
+	ngx_http_51D_ctx_t *ctx;
 	size_t contentLength = 0;
 
 	if (ngx_http_51D_shm_resource_manager == NULL ||
@@ -2657,18 +7958,24 @@ ngx_http_51D_body_filter(ngx_http_request_t *r, ngx_chain_t *in) {
 	matchConf = &fdlcf->matchConf;
 
 	if (matchConf->body != NULL) {
-		memset(fdmcf->valueString, 0, FIFTYONE_DEGREES_MAX_STRING);
+		ngx_http_51D_value_init(&value, r->pool, 0);
 
-		// Get the value string for the required property
+		// Get the value string for the required property, unless the
+		// header filter has already set the body.
 		// There should only be one property since only
 		// content that is supported is a javascript. 
-		if (matchConf->body->propertyCount > 0) {
+		ctx = ngx_http_get_module_ctx(r, ngx_http_51D_module);
+		if (ctx != NULL && ctx->notModified) {
+			// A 304 Not Modified response has no body.
+			return ngx_http_next_body_filter(r, in);
+		}
+		if ((ctx == NULL || ctx->hasJavascript == 0) &&
+			matchConf->body->propertyCount > 0) {
 			ngx_http_51D_get_value(
 				fdmcf,
 				r,
-				fdmcf->valueString,
-				(const char *)matchConf->body->property[0]->data,
-				FIFTYONE_DEGREES_MAX_STRING,
+				&value,
+				&matchConf->body->properties[0],
 				1,
 				NULL);
 		}
@@ -2684,12 +7991,16 @@ ngx_http_51D_body_filter(ngx_http_request_t *r, ngx_chain_t *in) {
 
 		b->memory = 1;
 
-		contentLength = ngx_strlen(fdmcf->valueString);
-		if (contentLength > 0 &&
+		contentLength = value.len;
+		if (ctx != NULL && ctx->hasJavascript) {
+			contentLength = ctx->javascript.len;
+			b->pos = ctx->javascript.data;
+		}
+		else if (contentLength > 0 &&
 			ngx_strcmp(
-				fdmcf->valueString,
+				value.data,
 				FIFTYONE_DEGREES_PROPERTY_NOT_AVAILABLE) != 0) {
-			b->pos = (u_char *) fdmcf->valueString;
+			b->pos = value.data;
 		}
 		else {
 			contentLength = ngx_strlen(FIFTYONE_DEGREES_JAVASCRIPT_NOT_AVAILABLE);
@@ -2708,6 +8019,86 @@ ngx_http_51D_body_filter(ngx_http_request_t *r, ngx_chain_t *in) {
 	return rc;
 }
 
+/**
+ * Add a property to the properties the data set is initialised with, if it
+ * is not already included. Properties are compared without case, and a
+ * property is only found where it is whole, e.g. ScreenPixelsWidth is not
+ * found in ScreenPixelsWidthJavascript.
+ * @param fdmcf 51Degrees main config holding the properties string.
+ * @param name of the property to add.
+ */
+static void
+add_required_property(ngx_http_51D_main_conf_t *fdmcf, const char *name)
+{
+	size_t length = ngx_strlen(name);
+	u_char *start = (u_char *)fdmcf->properties;
+	u_char *pos = start;
+
+	while (length > 0 &&
+		(pos = ngx_strcasestrn(pos, (char *)name, length - 1)) != NULL) {
+		if ((pos == start || pos[-1] == ',') &&
+			(pos[length] == ',' || pos[length] == '\0')) {
+			return;
+		}
+		pos += length;
+	}
+	add_value(
+		",",
+		(char *)name,
+		fdmcf->properties,
+		FIFTYONE_DEGREES_MAX_PROPS_STRING - strlen(fdmcf->properties));
+}
+
+/**
+ * Add the SetHeader properties in the data file to the properties the data
+ * set is initialised with, so that enabling 51D_set_resp_headers does not
+ * require all of the data file's properties. The property names are read
+ * from a temporary data set using the low memory profile, which only loads
+ * the data file's metadata.
+ * @param cf nginx config.
+ * @param fdmcf 51Degrees main config holding the properties string.
+ * @return ngx_int_t nginx conf status.
+ */
+static ngx_int_t
+ngx_http_51D_add_set_header_properties(
+	ngx_conf_t *cf,
+	ngx_http_51D_main_conf_t *fdmcf)
+{
+	ResourceManager manager;
+	DataSetHash *dataSet;
+	ConfigHash config = HashLowMemoryConfig;
+	PropertiesRequired properties = PropertiesDefault;
+	const char *propertyName;
+	ngx_uint_t i;
+
+	EXCEPTION_CREATE;
+	HashInitManagerFromFile(
+		&manager,
+		&config,
+		&properties,
+		(const char *)fdmcf->dataFile.data,
+		exception);
+	if (EXCEPTION_FAILED) {
+		return report_status(
+			cf->cycle->log,
+			exception->status,
+			(const char *)fdmcf->dataFile.data);
+	}
+	dataSet = (DataSetHash *)DataSetGet(&manager);
+	for (i = 0; i < dataSet->b.b.available->count; i++) {
+		propertyName = STRING(dataSet->b.b.available->items[i].name.data.ptr);
+		if (ngx_strncmp(
+			FIFTYONE_DEGREES_SET_HEADER_PREFIX,
+			propertyName,
+			ngx_strlen(FIFTYONE_DEGREES_SET_HEADER_PREFIX)) == 0) {
+			add_required_property(fdmcf, propertyName);
+		}
+	}
+	DataSetRelease((DataSetBase *)dataSet);
+	ResourceManagerFree(&manager);
+	return NGX_OK;
+}
+
 /**
  * Set data function. Initialises the data structure for a given occurrence
  * of "51D_match_single", "51D_match_ua", "51D_match_ua_client_hints", "51D_match_all", "51D_get_javascript_single" or
@@ -2731,7 +8122,23 @@ set_data(
 	int propertiesCount,
 	ngx_http_51D_main_conf_t *fdmcf)
 {
-	char *tok, *tokPos = NULL, *saveptr = NULL;
+	char *tok, *saveptr = NULL;
+	ngx_http_51D_data_to_set **registered;
+
+	// Register the data so its properties are resolved against the data set
+	// when each process starts.
+	registered = ngx_array_push(fdmcf->dataToSet);
+	if (registered == NULL) {
+		report_insufficient_memory_status(cf->log);
+		return NGX_CONF_ERROR;
+	}
+	*registered = data;
+	data->properties = NULL;
+
+	// The key identifies the value for the data in the result cache, so is
+	// the hash of the match mode and the properties in order.
+	data->key = ngx_http_51D_hash(
+		FIFTYONE_DEGREES_HASH_OFFSET, &data->multi, sizeof(data->multi));
 
 	// Allocate space for the properties array.
 	data->property =
@@ -2762,25 +8169,13 @@ set_data(
 			data->property[data->propertyCount]->data,
 			(u_char *)tok,
 			data->property[data->propertyCount]->len + 1);
+		data->key = ngx_http_51D_hash(
+			data->key,
+			tok,
+			data->property[data->propertyCount]->len + 1);
 
-		// A is not already included if it does not present
-		// in the composed properties string and is not a substring
-		// of other already presented properties.
-		// e.g. ScreenPixelsWidth is substring of ScreenPixelsWidthJavascript
-		// so when checking the present of ScreenPixelsWidth, need to
-		// make sure that it is not mistaken with substring of
-		// ScreenPixelsWidthJavascript.
-		tokPos = ngx_strstr(fdmcf->properties, tok);
-		if ((tokPos == NULL ||
-			(tokPos != NULL &&
-				(tokPos + ngx_strlen(tok))[0] != ',' &&
-				(tokPos + ngx_strlen(tok))[0] != '\0')) &&
-			 !is_metadata(tok)) {
-			add_value(
-				",",
-				tok,
-				fdmcf->properties,
-				FIFTYONE_DEGREES_MAX_PROPS_STRING - strlen(fdmcf->properties));
+		if (!is_metadata(tok)) {
+			add_required_property(fdmcf, tok);
 		}
 		data->propertyCount++;
 		tok = strtok_r(NULL, ",", &saveptr);
@@ -2791,17 +8186,7 @@ set_data(
 	// evidence must be initialised with the data set even though it is
 	// not named in a directive. See get_properties_hash.
 	if ((data->multi & ngx_http_51D_multi_mode_mask_non_ua_only) != 0) {
-		tok = "JavascriptGetHighEntropyValues";
-		tokPos = ngx_strstr(fdmcf->properties, tok);
-		if (tokPos == NULL ||
-			((tokPos + ngx_strlen(tok))[0] != ',' &&
-				(tokPos + ngx_strlen(tok))[0] != '\0')) {
-			add_value(
-				",",
-				tok,
-				fdmcf->properties,
-				FIFTYONE_DEGREES_MAX_PROPS_STRING - strlen(fdmcf->properties));
-		}
+		add_required_property(fdmcf, "JavascriptGetHighEntropyValues");
 	}
 
 	// Set the variable name or other header if they are specified.
@@ -2835,6 +8220,208 @@ set_data(
 	return NGX_CONF_OK;
 }
 
+/**
+ * Variable get handler for the $51D_* variables. The first time a variable
+ * is evaluated for a request, a single match is performed for all the
+ * variables which use the same evidence, and their values kept in the
+ * request context, so other variables do not perform detection again. The
+ * values are taken from the result caches where they hold them.
+ * @param r the http request.
+ * @param v the variable value to set.
+ * @param data the index of the variable.
+ * @return ngx_int_t nginx status.
+ */
+static ngx_int_t
+ngx_http_51D_variable(
+	ngx_http_request_t *r,
+	ngx_http_variable_value_t *v,
+	uintptr_t data)
+{
+	ngx_http_51D_data_to_set **variables, *variable;
+	ngx_http_51D_main_conf_t *fdmcf;
+	ngx_http_51D_loc_conf_t *fdlcf;
+	ngx_http_51D_match_state_t state;
+	ngx_http_51D_ctx_t *ctx;
+	ngx_uint_t i;
+	ngx_int_t rc = NGX_OK;
+
+	if (ngx_http_51D_shm_resource_manager == NULL ||
+		r->headers_in.headers.last == NULL) {
+		v->not_found = 1;
+		return NGX_OK;
+	}
+
+	fdmcf = ngx_http_get_module_main_conf(r, ngx_http_51D_module);
+	fdlcf = ngx_http_get_module_loc_conf(r, ngx_http_51D_module);
+	variables = fdmcf->variables->elts;
+	variable = variables[data];
+
+	ctx = ngx_http_51D_get_ctx(r);
+	if (ctx == NULL) {
+		return NGX_ERROR;
+	}
+	if (ctx->variableValues == NULL) {
+		ctx->variableValues = ngx_pcalloc(
+			r->pool, fdmcf->variables->nelts * sizeof(ngx_str_t));
+		if (ctx->variableValues == NULL) {
+			report_insufficient_memory_status(r->connection->log);
+			return NGX_ERROR;
+		}
+	}
+
+	if ((ctx->variableMulti & variable->multi) == 0) {
+		ngx_http_51D_init_match_state(
+			&state,
+			variable->multi,
+			ngx_http_51D_get_user_agent(r, NULL),
+			fdlcf->overrides);
+		for (i = 0; i < fdmcf->variables->nelts && rc == NGX_OK; i++) {
+			if (variables[i]->multi == variable->multi) {
+				rc = ngx_http_51D_get_header_value(
+					r, fdmcf, variables[i], &state, &ctx->variableValues[i]);
+			}
+		}
+		ngx_http_51D_free_match_state(&state);
+		if (rc != NGX_OK) {
+			return NGX_ERROR;
+		}
+		ctx->variableMulti |= variable->multi;
+	}
+
+	v->data = ctx->variableValues[data].data;
+	v->len = ctx->variableValues[data].len;
+	v->valid = 1;
+	v->no_cacheable = 0;
+	v->not_found = 0;
+	return NGX_OK;
+}
+
+/**
+ * Whether a variable has been defined by another module or directive, e.g.
+ * set or map, in which case it is not a $51D_* variable.
+ * @param cmcf the core main config holding the variables.
+ * @param name of the variable.
+ * @return 1 if the variable is defined, otherwise 0.
+ */
+static ngx_uint_t
+ngx_http_51D_variable_defined(
+	ngx_http_core_main_conf_t *cmcf,
+	ngx_str_t *name)
+{
+	ngx_hash_key_t *key;
+	ngx_uint_t i;
+
+	key = cmcf->variables_keys->keys.elts;
+	for (i = 0; i < cmcf->variables_keys->keys.nelts; i++) {
+		if (key[i].key.len == name->len &&
+			ngx_strncasecmp(key[i].key.data, name->data, name->len) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Add the $51D_* variables which are used in the config. Each variable takes
+ * the value of a single property, named after the prefix, from a match
+ * using the evidence given by the prefix:
+ * --$51D_ua_<property> or $51D_<property> matches the User-Agent.
+ * --$51D_uach_<property> matches the User-Agent and Sec-CH-UA-* headers.
+ * --$51D_all_<property> matches all evidence in the request.
+ * The variables are found in those indexed by the config which no other
+ * module or directive defines, and their properties added to those the data
+ * set is initialised with.
+ * @param cf the nginx config.
+ * @return ngx_int_t nginx status.
+ */
+static ngx_int_t
+ngx_http_51D_add_variables(ngx_conf_t *cf)
+{
+	static const struct {
+		ngx_str_t prefix;
+		ngx_http_51D_multi_header_mode multi;
+	} prefixes[] = {
+		{ ngx_string("51d_ua_"), ngx_http_51D_multi_mode_mask_ua_only },
+		{ ngx_string("51d_uach_"), ngx_http_51D_multi_mode_mask_client_hints },
+		{ ngx_string("51d_all_"), ngx_http_51D_multi_mode_mask_all_evidence },
+		{ ngx_string("51d_"), ngx_http_51D_multi_mode_mask_ua_only }
+	};
+	ngx_uint_t i, j, count;
+	ngx_str_t name, *property;
+	ngx_http_variable_t *v, *var;
+	ngx_http_core_main_conf_t *cmcf;
+	ngx_http_51D_main_conf_t *fdmcf;
+	ngx_http_51D_data_to_set *data, **registered, **variable;
+
+	cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+	fdmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_51D_module);
+	v = cmcf->variables.elts;
+	count = cmcf->variables.nelts;
+	for (i = 0; i < count; i++) {
+		// Names of indexed variables are held in lower case.
+		for (j = 0; j < sizeof(prefixes) / sizeof(prefixes[0]); j++) {
+			if (v[i].name.len > prefixes[j].prefix.len &&
+				ngx_strncmp(
+					v[i].name.data,
+					prefixes[j].prefix.data,
+					prefixes[j].prefix.len) == 0) {
+				break;
+			}
+		}
+		if (j == sizeof(prefixes) / sizeof(prefixes[0]) ||
+			ngx_http_51D_variable_defined(cmcf, &v[i].name)) {
+			continue;
+		}
+
+		data = ngx_pcalloc(cf->pool, sizeof(ngx_http_51D_data_to_set));
+		property = ngx_palloc(cf->pool, sizeof(ngx_str_t));
+		data->property = ngx_palloc(cf->pool, sizeof(ngx_str_t *));
+		registered = ngx_array_push(fdmcf->dataToSet);
+		variable = ngx_array_push(fdmcf->variables);
+		if (data == NULL || property == NULL || data->property == NULL ||
+			registered == NULL || variable == NULL) {
+			report_insufficient_memory_status(cf->log);
+			return NGX_ERROR;
+		}
+		property->len = v[i].name.len - prefixes[j].prefix.len;
+		property->data = ngx_pnalloc(cf->pool, property->len + 1);
+		if (property->data == NULL) {
+			report_insufficient_memory_status(cf->log);
+			return NGX_ERROR;
+		}
+		ngx_memcpy(
+			property->data,
+			v[i].name.data + prefixes[j].prefix.len,
+			property->len);
+		property->data[property->len] = '\0';
+
+		data->multi = prefixes[j].multi;
+		data->propertyCount = 1;
+		data->property[0] = property;
+		data->key = ngx_http_51D_hash(
+			FIFTYONE_DEGREES_HASH_OFFSET, &data->multi, sizeof(data->multi));
+		data->key = ngx_http_51D_hash(
+			data->key, property->data, property->len + 1);
+		*registered = data;
+		*variable = data;
+		if (!is_metadata((char *)property->data)) {
+			add_required_property(fdmcf, (const char *)property->data);
+		}
+		if ((data->multi & ngx_http_51D_multi_mode_mask_non_ua_only) != 0) {
+			add_required_property(fdmcf, "JavascriptGetHighEntropyValues");
+		}
+
+		name = v[i].name;
+		var = ngx_http_add_variable(cf, &name, 0);
+		if (var == NULL) {
+			return NGX_ERROR;
+		}
+		var->get_handler = ngx_http_51D_variable;
+		var->data = fdmcf->variables->nelts - 1;
+	}
+	return NGX_OK;
+}
+
 /**
  * Set up the header to be set.
  * @param cf the nginx config.
@@ -3122,9 +8709,9 @@ ngx_conf_t *cf, ngx_command_t *cmd, ngx_http_51D_match_conf_t *matchConf)
 
 	if (value->len > 0 && ngx_strcmp("on", value[1].data) == 0) {
 		matchConf->setHeaders = 1;
-		// The SetHeader properties are discovered from the data file, so
-		// all of its properties must be initialised. See
-		// get_properties_hash.
+		// The SetHeader properties are discovered from the data file, and
+		// added to the required properties in post configuration. See
+		// ngx_http_51D_add_set_header_properties.
 		ngx_http_51D_main_conf_t *fdmcf =
 			ngx_http_conf_get_module_main_conf(cf, ngx_http_51D_module);
 		fdmcf->respHeadersEnabled = 1;
@@ -3254,6 +8841,207 @@ static char *ngx_http_51D_set_main(ngx_conf_t* cf, ngx_command_t *cmd, void *con
 	return ngx_http_51D_set_conf_header(cf, cmd, &fdmcf->matchConf);
 }
 
+/**
+ * Set function. Is called for occurrences of "51D_cache" or
+ * "51D_profile_cache" in a http config block. Sets the number of entries in
+ * the cache of each worker process from the size=N argument.
+ * @param cf the nginx conf.
+ * @param cmd the name of the command called from the config file.
+ * @param conf A pointer to the context for configuration object
+ * @return char* nginx conf status.
+ */
+static char *ngx_http_51D_set_cache(ngx_conf_t* cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_int_t size = NGX_ERROR;
+	ngx_str_t *value = cf->args->elts;
+	ngx_http_51D_main_conf_t *fdmcf =
+		ngx_http_conf_get_module_main_conf(cf, ngx_http_51D_module);
+
+	if (value[1].len > ngx_strlen("size=") &&
+		ngx_strncmp(value[1].data, "size=", ngx_strlen("size=")) == 0) {
+		size = ngx_atoi(
+			value[1].data + ngx_strlen("size="),
+			value[1].len - ngx_strlen("size="));
+	}
+	if (size == NGX_ERROR) {
+		ngx_log_error(
+			NGX_LOG_ERR,
+			cf->cycle->log,
+			0,
+			"51Degrees argument '%s' is not in a valid format, expected "
+			"size=N",
+			(const char *)value[1].data);
+		return NGX_CONF_ERROR;
+	}
+	*(ngx_uint_t *)((char *)fdmcf + cmd->offset) = (ngx_uint_t)size;
+	return NGX_CONF_OK;
+}
+
+/**
+ * Set function. Is called for occurrences of "51D_cache_zone" in a http
+ * config block. Adds the shared memory zone for the result cache shared by
+ * all worker processes from the name:size argument, and sets the maximum
+ * length of the values it holds from the optional value_size=size argument.
+ * @param cf the nginx conf.
+ * @param cmd the name of the command called from the config file.
+ * @param conf A pointer to the context for configuration object
+ * @return char* nginx conf status.
+ */
+static char *ngx_http_51D_set_cache_zone(ngx_conf_t* cf, ngx_command_t *cmd, void *conf)
+{
+	u_char *p;
+	ssize_t size = NGX_ERROR, valueSize = FIFTYONE_DEGREES_CACHE_ZONE_VALUE_SIZE;
+	ngx_str_t name, sizeString;
+	ngx_str_t *value = cf->args->elts;
+	ngx_http_51D_main_conf_t *fdmcf =
+		ngx_http_conf_get_module_main_conf(cf, ngx_http_51D_module);
+
+	if (fdmcf->cacheZone != NULL) {
+		return "is duplicate";
+	}
+
+	p = ngx_strlchr(value[1].data, value[1].data + value[1].len, ':');
+	if (p != NULL) {
+		name.data = value[1].data;
+		name.len = p - value[1].data;
+		sizeString.data = p + 1;
+		sizeString.len = value[1].data + value[1].len - sizeString.data;
+		size = ngx_parse_size(&sizeString);
+	}
+	if (p == NULL || name.len == 0 || size == NGX_ERROR) {
+		ngx_log_error(
+			NGX_LOG_ERR,
+			cf->cycle->log,
+			0,
+			"51Degrees argument '%s' is not in a valid format, expected "
+			"name:size",
+			(const char *)value[1].data);
+		return NGX_CONF_ERROR;
+	}
+	if (size < (ssize_t)(8 * ngx_pagesize)) {
+		ngx_log_error(
+			NGX_LOG_ERR,
+			cf->cycle->log,
+			0,
+			"51Degrees cache zone \"%V\" is too small",
+			&name);
+		return NGX_CONF_ERROR;
+	}
+
+	if (cf->args->nelts > 2) {
+		valueSize = NGX_ERROR;
+		if (value[2].len > ngx_strlen("value_size=") &&
+			ngx_strncmp(
+				value[2].data,
+				"value_size=",
+				ngx_strlen("value_size=")) == 0) {
+			sizeString.data = value[2].data + ngx_strlen("value_size=");
+			sizeString.len = value[2].len - ngx_strlen("value_size=");
+			valueSize = ngx_parse_size(&sizeString);
+		}
+		if (valueSize == NGX_ERROR ||
+			valueSize == 0 ||
+			valueSize > (ssize_t)(size / 8)) {
+			ngx_log_error(
+				NGX_LOG_ERR,
+				cf->cycle->log,
+				0,
+				"51Degrees argument '%s' is not in a valid format, expected "
+				"value_size=size smaller than an eighth of the zone",
+				(const char *)value[2].data);
+			return NGX_CONF_ERROR;
+		}
+	}
+	fdmcf->cacheZoneValueSize = (size_t)valueSize;
+
+	// The tag is the same for every cycle so that the zone, and the values
+	// in it, are carried over a reload.
+	fdmcf->cacheZone =
+		ngx_shared_memory_add(cf, &name, size, &ngx_http_51D_module);
+	if (fdmcf->cacheZone == NULL) {
+		return NGX_CONF_ERROR;
+	}
+	fdmcf->cacheZone->init = ngx_http_51D_init_cache_zone;
+	fdmcf->cacheZone->data = fdmcf;
+	return NGX_CONF_OK;
+}
+
+/**
+ * Set function. Is called for occurrences of "51D_auto_reload" in a http
+ * config block. Sets the interval at which the data file is checked for
+ * changes from the interval=time argument.
+ * @param cf the nginx conf.
+ * @param cmd the name of the command called from the config file.
+ * @param conf A pointer to the context for configuration object
+ * @return char* nginx conf status.
+ */
+static char *ngx_http_51D_set_auto_reload(ngx_conf_t* cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_int_t interval = NGX_ERROR;
+	ngx_str_t intervalString;
+	ngx_str_t *value = cf->args->elts;
+	ngx_http_51D_main_conf_t *fdmcf = conf;
+
+	if (fdmcf->reloadInterval > 0) {
+		return "is duplicate";
+	}
+	if (value[1].len > ngx_strlen("interval=") &&
+		ngx_strncmp(
+			value[1].data,
+			"interval=",
+			ngx_strlen("interval=")) == 0) {
+		intervalString.data = value[1].data + ngx_strlen("interval=");
+		intervalString.len = value[1].len - ngx_strlen("interval=");
+		interval = ngx_parse_time(&intervalString, 0);
+	}
+	if (interval == NGX_ERROR || interval == 0) {
+		ngx_log_error(
+			NGX_LOG_ERR,
+			cf->cycle->log,
+			0,
+			"51Degrees argument '%s' is not in a valid format, expected "
+			"interval=time",
+			(const char *)value[1].data);
+		return NGX_CONF_ERROR;
+	}
+	fdmcf->reloadInterval = (ngx_msec_t)interval;
+	return NGX_CONF_OK;
+}
+
+#if (NGX_THREADS)
+/**
+ * Set function. Is called for occurrences of "51D_thread_pool" in a http,
+ * server or location config block. Adds the thread pool which all evidence
+ * matches are performed in, unless the argument is "off".
+ * @param cf the nginx conf.
+ * @param cmd the name of the command called from the config file.
+ * @param conf A pointer to the context for configuration object
+ * @return char* nginx conf status.
+ */
+static char *ngx_http_51D_set_thread_pool(ngx_conf_t* cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_str_t *value = cf->args->elts;
+	ngx_http_51D_loc_conf_t *fdlcf = conf;
+	ngx_http_51D_main_conf_t *fdmcf =
+		ngx_http_conf_get_module_main_conf(cf, ngx_http_51D_module);
+
+	if (fdlcf->threadPool != NGX_CONF_UNSET_PTR) {
+		return "is duplicate";
+	}
+	if (value[1].len == ngx_strlen("off") &&
+		ngx_strncmp(value[1].data, "off", ngx_strlen("off")) == 0) {
+		fdlcf->threadPool = NULL;
+		return NGX_CONF_OK;
+	}
+	fdlcf->threadPool = ngx_thread_pool_add(cf, &value[1]);
+	if (fdlcf->threadPool == NULL) {
+		return NGX_CONF_ERROR;
+	}
+	fdmcf->threadPoolUsed = 1;
+	return NGX_CONF_OK;
+}
+#endif
+
 /**
  * @}
  */
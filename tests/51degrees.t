@@ -10,6 +10,7 @@
 
 use warnings;
 use strict;
+use File::Copy;
 use File::Temp qw/ tempdir /;
 use Test::More;
 
@@ -24,14 +25,14 @@ use URI::Escape;
 select STDERR; $| = 1;
 select STDOUT; $| = 1;
 
-my $n = 30;
+my $n = 82;
 my $t_lite = 1;
 
 # The Lite data file version does not contains properties that can be used
 # to test the overrides feature. Please consider to use one that have at least
 # ScreenPixelsWidth and ScreenPixelsWidthJavascript properties
 if (scalar(@ARGV) > 0 && index($ARGV[0], "51Degrees-Lite") == -1) {
-	$n += 20;
+	$n += 31;
 	$t_lite = 0;
 }
 
@@ -172,12 +173,23 @@ http {
 			add_header x-ismobile-from-wrong-var $http_x_ismobile_from_wrong_var;
 		}
 
+		location /variables {
+			add_header x-ismobile $51D_IsMobile;
+			add_header x-ismobile-all $51D_all_IsMobile;
+		}
+
 		location /overrides {
 			51D_match_all x-javascript ScreenPixelsWidthJavascript;
 			51D_match_all x-screenpixelswidth ScreenPixelsWidth;
 			add_header x-screenpixelswidth $http_x_screenpixelswidth;
 		}
 
+		location /overrides-cookie {
+			51D_overrides cookie;
+			51D_match_all x-screenpixelswidth ScreenPixelsWidth;
+			add_header x-screenpixelswidth $http_x_screenpixelswidth;
+		}
+
 		location /clienthints {
 			51D_set_resp_headers on;
 		}
@@ -191,6 +203,8 @@ http {
 		}
 
 		location /51D-single.js {
+			51D_javascript_cache_control "max-age=3600";
+			51D_javascript_gzip on;
 			51D_get_javascript_single JavascriptHardwareProfile;
 		}
 
@@ -232,7 +246,9 @@ $t->write_file('non-property', '');
 $t->write_file('redirect', '');
 $t->write_file('locations', '');
 $t->write_file('variable', '');
+$t->write_file('variables', '');
 $t->write_file('overrides', '');
+$t->write_file('overrides-cookie', '');
 $t->write_file('clienthints', '');
 $t->write_file('clienthintsoff', '');
 $t->write_file('clienthintsnone', '');
@@ -307,6 +323,86 @@ sec-ch-ua: "Google Chrome";v="117", "Not;A=Brand";v="8", "Chromium";v="117"
 EOF
 }
 
+# Start nginx with its own config for settings which can only be set in the
+# http block, and optionally the main block. The config has the /ua and /all
+# locations with the IsMobile property, and /all-properties with several
+# properties in one header.
+sub start_nginx {
+	my ($http, $main) = @_;
+	my $t = Test::Nginx->new();
+	my $conf = <<'EOF';
+
+daemon off;
+
+%%TEST_GLOBALS%%
+%%51D_MAIN%%
+events {
+}
+
+http {
+	%%TEST_GLOBALS_HTTP%%
+
+	51D_allow_unmatched on;
+%%51D_HTTP%%
+
+	server {
+		listen       127.0.0.1:8080;
+		server_name  localhost;
+
+		location /ua {
+			51D_match_ua x-ismobile IsMobile;
+			add_header x-ismobile $http_x_ismobile;
+		}
+
+		location /all {
+			51D_match_all x-ismobile IsMobile;
+			add_header x-ismobile $http_x_ismobile;
+		}
+
+		location /all-properties {
+			51D_match_all x-properties IsMobile,BrowserName,HardwareVendor,HardwareModel,PlatformVersion;
+			add_header x-properties $http_x_properties;
+		}
+	}
+}
+
+EOF
+	$main = '' unless defined $main;
+	$conf =~ s/%%51D_MAIN%%/$main/;
+	$conf =~ s/%%51D_HTTP%%/$http/;
+	$t->write_file_expand('nginx.conf', $conf);
+	$t->write_file('ua', '');
+	$t->write_file('all', '');
+	$t->write_file('all-properties', '');
+	$t->run();
+	return $t;
+}
+
+# Replace a file by renaming a new file over it, as a data file is updated.
+# The new file is a copy of another file, or is not a data file if undef.
+sub replace_file {
+	my ($path, $from) = @_;
+	if (defined $from) {
+		copy($from, "$path.new") or die "Can't copy $from: $!";
+	}
+	else {
+		open my $fh, '>', "$path.new" or die "Can't write $path.new: $!";
+		print $fh 'not a data file';
+		close $fh;
+	}
+	rename("$path.new", $path) or die "Can't rename $path.new: $!";
+}
+
+# Wait up to 10 seconds for a message in the error log.
+sub wait_for_log {
+	my ($t, $message) = @_;
+	for (1 .. 50) {
+		return 1 if $t->read_file('error.log') =~ $message;
+		select undef, undef, undef, 0.2;
+	}
+	return 0;
+}
+
 ###############################################################################
 # Constants.
 ###############################################################################
@@ -404,6 +500,16 @@ like($r, qr/x-non-property: NoMatch/, 'Handles non-existent property');
 # Reload Nginx.
 $t->reload();
 
+###############################################################################
+# Test variables.
+###############################################################################
+
+# Detection results are available from $51D_* variables.
+$r = get_with_ua('/variables', $mobileUserAgent);
+like($r, qr/x-ismobile: True.*x-ismobile-all: True/s, 'Mobile match from variables');
+$r = get_with_ua('/variables', $desktopUserAgent);
+like($r, qr/x-ismobile: False.*x-ismobile-all: False/s, 'Desktop match from variables');
+
 ###############################################################################
 # Test config blocks.
 ###############################################################################
@@ -477,6 +583,14 @@ if (!$t_lite) {
 	# Match with override value from query string.
 	$r = get_with_ua('/overrides?51D_ScreenPixelsWidth=20', $desktopUserAgent);
 	like($r, qr/x-screenpixelswidth: 20/, 'Screen Pixels Width value was not overriden by value in query string.');
+
+	# Match with override value from a cookie among other cookies.
+	$r = get_with_ua_cookie('/overrides-cookie', $desktopUserAgent, 'a=b; 51d_screenpixelswidth=30; c=d');
+	like($r, qr/x-screenpixelswidth: 30/, 'Screen Pixels Width value was not overriden by value in cookie when only cookies are enabled.');
+
+	# Query string is ignored where only cookies are enabled.
+	$r = get_with_ua('/overrides-cookie?51D_ScreenPixelsWidth=20', $desktopUserAgent);
+	unlike($r, qr/x-screenpixelswidth: 20/, 'Screen Pixels Width value was overriden by value in query string when only cookies are enabled.');
 }
 
 ###############################################################################
@@ -516,6 +630,50 @@ if (!$t_lite) {
 	$r = get_content_with_ua('/51D-single.js', $mobileUserAgent);
 	like($r, qr/getProfileId/, 'Javascript response content using single User-Agent header.');
 
+	# Javascript sent gzip encoded where 51D_javascript_gzip is on and the
+	# request accepts it.
+	$r = http(<<EOF);
+GET /51D-single.js HTTP/1.1
+Host: localhost
+Connection: close
+Accept-Encoding: gzip
+User-Agent: $mobileUserAgent
+
+EOF
+	like($r, qr/Content-Encoding: gzip/, 'Javascript response content gzip encoded.');
+	like($r, qr/Vary: [^\r\n]*Accept-Encoding/, 'Gzip encoded Javascript response varies by Accept-Encoding.');
+
+	# Javascript not gzip encoded where 51D_javascript_gzip is off.
+	$r = http(<<EOF);
+GET /51D-single-query.js?ua=test HTTP/1.1
+Host: localhost
+Connection: close
+Accept-Encoding: gzip
+User-Agent: $mobileUserAgent
+
+EOF
+	unlike($r, qr/Content-Encoding: gzip/, 'Javascript response content not gzip encoded by default.');
+
+	# Javascript sent without encoding still varies by Accept-Encoding.
+	$r = get_content_with_ua('/51D-single.js', $mobileUserAgent);
+	like($r, qr/Vary: [^\r\n]*Accept-Encoding/, 'Identity Javascript response varies by Accept-Encoding.');
+	like($r, qr/Vary: [^\r\n]*User-Agent/, 'Javascript response using single User-Agent header varies by User-Agent.');
+
+	# Javascript with an ETag, answered with 304 when the request has it.
+	$r = get_content_with_ua('/51D-single.js', $mobileUserAgent);
+	like($r, qr/ETag: "[0-9a-f]+".*Cache-Control: max-age=3600|Cache-Control: max-age=3600.*ETag: "[0-9a-f]+"/s, 'Javascript response has an ETag and Cache-Control.');
+	my ($etag) = $r =~ /ETag: ("[^"]+")/;
+	$etag = '""' unless defined $etag;
+	$r = http(<<EOF);
+GET /51D-single.js HTTP/1.1
+Host: localhost
+Connection: close
+If-None-Match: $etag
+User-Agent: $mobileUserAgent
+
+EOF
+	like($r, qr/^HTTP\/1\.1 304/, 'Javascript response not modified for the same ETag.');
+
 	# Javascript using single User-Agent from query string.
 	$r = get_content_with_ua('/51D-single-query.js?ua='.uri_escape($mobileUserAgent), $desktopUserAgent);
 	like($r, qr/getProfileId/, 'Javascript response content using variable.');
@@ -523,6 +681,8 @@ if (!$t_lite) {
 	# Javascript using all evidence.
 	$r = get_content_with_ua('/51D-all.js', $mobileUserAgent);
 	like($r, qr/getProfileId/, 'Javascript response content using all evidence.');
+	like($r, qr/Vary: [^\r\n]*User-Agent/, 'Javascript response using all evidence varies by User-Agent.');
+	like($r, qr/Vary: [^\r\n]*Sec-CH-UA/i, 'Javascript response using all evidence varies by Client Hints.');
 
 	# Javascript using query.
 	$r = get_content_with_ua('/51D-all.js?User-Agent='.uri_escape($mobileUserAgent), $desktopUserAgent);
@@ -574,6 +734,240 @@ like($r, qr/301 Moved Permanently/, 'Redirected to mobile');
 $r = get_with_ua('/redirect', $desktopUserAgent);
 unlike($r, qr/301 Moved Permanently/, 'Didn\'t redirect for desktop');
 
+###############################################################################
+# Test result caches.
+###############################################################################
+
+# The caches are set for all of a worker's requests, so are tested in their
+# own instance of nginx.
+$t->stop();
+$t = start_nginx(<<'EOF');
+	51D_cache size=1000;
+	51D_profile_cache size=1000;
+	51D_cache_zone 51D_cache:1m;
+	51D_connection_cache on;
+EOF
+
+# Repeated matches are served from the result cache, and must not be confused
+# with the values for other evidence or other headers.
+$r = get_with_ua('/ua', $mobileUserAgent);
+like($r, qr/x-ismobile: True/, 'Mobile match for result cache');
+$r = get_with_ua('/ua', $desktopUserAgent);
+like($r, qr/x-ismobile: False/, 'Desktop match for result cache');
+$r = get_with_ua('/ua', $mobileUserAgent);
+like($r, qr/x-ismobile: True/, 'Mobile match from result cache');
+$r = get_with_ua('/ua', $desktopUserAgent);
+like($r, qr/x-ismobile: False/, 'Desktop match from result cache');
+$r = get_with_ua('/all', $mobileUserAgent);
+like($r, qr/x-ismobile: True/, 'Mobile match for result cache (all HTTP headers)');
+$r = get_with_ua('/all', $mobileUserAgent);
+like($r, qr/x-ismobile: True/, 'Mobile match from result cache (all HTTP headers)');
+
+# A different User-Agent for the same device is served from the profile cache.
+$r = get_with_ua('/ua', $mobileUserAgent . ' 51Degrees');
+like($r, qr/x-ismobile: True/, 'Mobile match from profile cache');
+
+# Requests on the same connection with different evidence must not be given
+# the values held for the connection.
+$r = http(<<EOF);
+HEAD /ua HTTP/1.1
+Host: localhost
+User-Agent: $mobileUserAgent
+
+HEAD /ua HTTP/1.1
+Host: localhost
+Connection: close
+User-Agent: $desktopUserAgent
+
+EOF
+like($r, qr/x-ismobile: True.*x-ismobile: False/s, 'Matches from connection cache');
+
+# Requests on the same connection with the same evidence are given the values
+# held for the connection.
+$r = http(<<EOF);
+HEAD /ua HTTP/1.1
+Host: localhost
+User-Agent: $mobileUserAgent
+
+HEAD /ua HTTP/1.1
+Host: localhost
+Connection: close
+User-Agent: $mobileUserAgent
+
+EOF
+like($r, qr/x-ismobile: True.*x-ismobile: True/s, 'Same match from connection cache');
+
+# The shared result cache zone is carried over the reload.
+$t->reload();
+$r = get_with_ua('/ua', $mobileUserAgent);
+like($r, qr/x-ismobile: True/, 'Mobile match from shared result cache after reload');
+
+# Worker processes log their cache hits when they exit.
+$t->stop();
+my $log = $t->read_file('error.log');
+like($log, qr/51Degrees result cache hits [1-9]/, 'Result cache hits');
+like($log, qr/51Degrees profile cache hits [1-9]/, 'Profile cache hits');
+like($log, qr/51Degrees shared result cache hits [1-9]/, 'Shared result cache hits after reload');
+like($log, qr/51Degrees connection cache hits [1-9]/, 'Connection cache hits');
+
+# Values of several properties are held in a shared result cache zone whose
+# slots are sized for them.
+$t = start_nginx(<<'EOF');
+	51D_cache_zone 51D_large:1m value_size=4k;
+EOF
+$r = get_with_ua('/all-properties', $mobileUserAgent);
+like($r, qr/x-properties: True,/, 'Several properties for shared result cache');
+$t->reload();
+$r = get_with_ua('/all-properties', $mobileUserAgent);
+like($r, qr/x-properties: True,/, 'Several properties from shared result cache after reload');
+$t->stop();
+$log = $t->read_file('error.log');
+like($log, qr/51Degrees shared result cache hits [1-9]/, 'Shared result cache hits with value_size');
+
+###############################################################################
+# Test thread pool.
+###############################################################################
+
+# All evidence matches performed in a thread pool give the same values as
+# those performed in the worker.
+SKIP: {
+	skip 'nginx built without threads', 5 unless $t->has_module('threads');
+
+	$t = start_nginx(<<'HTTP', <<'MAIN');
+	51D_thread_pool 51D_pool;
+	51D_thread_concurrency 2;
+HTTP
+thread_pool 51D_pool threads=2;
+MAIN
+
+	$r = get_with_ua('/all', $mobileUserAgent);
+	like($r, qr/x-ismobile: True/, 'Mobile match in thread pool');
+	$r = get_with_ua('/all', $desktopUserAgent);
+	like($r, qr/x-ismobile: False/, 'Desktop match in thread pool');
+	$r = get_with_ua('/ua', $mobileUserAgent);
+	like($r, qr/x-ismobile: True/, 'Mobile User-Agent match with thread pool');
+
+	# Matches queued beyond the concurrency are performed in the worker.
+	my @s = map { http(<<EOF, start => 1) } 1 .. 4;
+HEAD /all HTTP/1.1
+Host: localhost
+Connection: close
+User-Agent: $mobileUserAgent
+
+EOF
+	my $all = join '', map { http_end($_) } @s;
+	like($all, qr/^(?:.*?x-ismobile: True){4}/s, 'Concurrent matches in thread pool');
+
+	# Worker processes log the matches performed in the thread pool when
+	# they exit.
+	$t->stop();
+	$log = $t->read_file('error.log');
+	like($log, qr/51Degrees thread pool matches [1-9]\d*, worker matches \d+/, 'Matches performed in thread pool');
+}
+
+###############################################################################
+# Test auto reload.
+###############################################################################
+
+# A data file replaced while nginx is running is loaded without a reload, and
+# one which can not be loaded leaves the old data in use. The file is
+# replaced in a copy of the data file set by the test globals.
+SKIP: {
+	my ($dataFile) = ($ENV{TEST_NGINX_GLOBALS_HTTP} // '') =~
+		/51D_file_path\s+([^;\s]+)/;
+	skip 'data file path not set in TEST_NGINX_GLOBALS_HTTP', 7
+		unless defined $dataFile;
+
+	my $dir = tempdir(CLEANUP => 1);
+	my $copy = "$dir/51Degrees.hash";
+	copy($dataFile, $copy) or die "Can't copy $dataFile: $!";
+	local $ENV{TEST_NGINX_GLOBALS_HTTP} =
+		$ENV{TEST_NGINX_GLOBALS_HTTP} =~
+		s/51D_file_path\s+[^;\s]+/51D_file_path $copy/r;
+
+	$t = start_nginx(<<'HTTP');
+	51D_auto_reload interval=1s;
+HTTP
+
+	$r = get_with_ua('/ua', $mobileUserAgent);
+	like($r, qr/x-ismobile: True/, 'Mobile match before data file replaced');
+
+	# Replace the data file with one which can not be loaded.
+	replace_file($copy, undef);
+	ok(wait_for_log($t, qr/\[error\].*51Degrees/), 'Replaced data file which can not be loaded is reported');
+	$r = get_with_ua('/ua', $mobileUserAgent);
+	like($r, qr/x-ismobile: True/, 'Mobile match with old data after failed reload');
+	$r = get_with_ua('/ua', $desktopUserAgent);
+	like($r, qr/x-ismobile: False/, 'Desktop match with old data after failed reload');
+
+	# Replace it again with the data file.
+	replace_file($copy, $dataFile);
+	ok(wait_for_log($t, qr/51Degrees reloaded data file/), 'Replaced data file is reloaded');
+	$r = get_with_ua('/ua', $mobileUserAgent);
+	like($r, qr/x-ismobile: True/, 'Mobile match after reload of data file');
+	$r = get_with_ua('/all', $desktopUserAgent);
+	like($r, qr/x-ismobile: False/, 'Desktop match after reload of data file');
+
+	$t->stop();
+}
+
+###############################################################################
+# Test memory-mapped load mode.
+###############################################################################
+
+# A data set over the memory-mapped data file gives the same values as one
+# copied into shared memory.
+$t = start_nginx(<<'HTTP');
+	51D_load_mode mmap;
+HTTP
+
+$r = get_with_ua('/ua', $mobileUserAgent);
+like($r, qr/x-ismobile: True/, 'Mobile match with memory-mapped data file');
+$r = get_with_ua('/ua', $desktopUserAgent);
+like($r, qr/x-ismobile: False/, 'Desktop match with memory-mapped data file');
+$r = get_with_ua('/all', $mobileUserAgent);
+like($r, qr/x-ismobile: True/, 'Mobile match with memory-mapped data file (all HTTP headers)');
+
+# The data file is mapped again by a reload.
+$t->reload();
+$r = get_with_ua('/ua', $mobileUserAgent);
+like($r, qr/x-ismobile: True/, 'Mobile match with memory-mapped data file after reload');
+
+# Worker processes log that their data set is over the mapping, before and
+# after the reload.
+$t->stop();
+$log = $t->read_file('error.log');
+my @mapped = $log =~ /51Degrees data set uses the data file "[^"]+" mapped at/g;
+ok(@mapped >= 2, 'Data set uses memory-mapped data file before and after reload');
+
+###############################################################################
+# Test file based performance profiles.
+###############################################################################
+
+# Each worker process loads its own data set with the profiles which keep
+# parts of the data set in the file, and gives the same values.
+foreach my $profile (qw/HIGH_PERFORMANCE LOW_MEMORY BALANCED BALANCED_TEMP/) {
+	$t = start_nginx(<<HTTP, <<'MAIN');
+	51D_performance_profile $profile;
+HTTP
+worker_processes 2;
+MAIN
+
+	$r = get_with_ua('/ua', $mobileUserAgent);
+	like($r, qr/x-ismobile: True/, "Mobile match with $profile");
+	$r = get_with_ua('/ua', $desktopUserAgent);
+	like($r, qr/x-ismobile: False/, "Desktop match with $profile");
+	$r = get_with_ua('/all', $mobileUserAgent);
+	like($r, qr/x-ismobile: True/, "Mobile match with $profile (all HTTP headers)");
+
+	# Both worker processes log that they loaded their own data set.
+	$t->stop();
+	$log = $t->read_file('error.log');
+	my %pids = map { $_ => 1 }
+		$log =~ /51Degrees worker process (\d+) loaded its own data set/g;
+	is(scalar keys %pids, 2, "Data set loaded by each worker with $profile");
+}
+
 ###############################################################################
 
 # Print out warnings at the end for user attention
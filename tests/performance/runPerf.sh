@@ -28,6 +28,12 @@ PASSES=$((PASSES_PER_WORKER * CONCURRENCY))
 # 'ipi' (IP intelligence).
 ENGINE=${ENGINE:-hash}
 
+# The performance profile used to load the device detection data file.
+# One of IN_MEMORY (the default), HIGH_PERFORMANCE, LOW_MEMORY, BALANCED or
+# BALANCED_TEMP. The profiles other than IN_MEMORY load a data set in each
+# Nginx worker.
+PERFORMANCE_PROFILE=${PERFORMANCE_PROFILE:-IN_MEMORY}
+
 # Evidence file passed to the benchmark. Empty by default, which leaves the
 # harness rotating the User-Agents file. Set for the device detection
 # engine below when an evidence file is available.
@@ -62,6 +68,8 @@ else
 	DATA_FILE_DIR=$REPO_DIR/device-detection-cxx/device-detection-data
 	sed "s/\${MODULES_DIR}/${MODULES_DIR//\//\\/}/g" ./nginx.conf.template > ./nginx.conf
 	sed -i "s/\${DATA_FILE_DIR}/${DATA_FILE_DIR//\//\\/}/g" ./nginx.conf
+	sed -i "s/\${PERFORMANCE_PROFILE}/${PERFORMANCE_PROFILE}/g" ./nginx.conf
+	echo "Performance profile: $PERFORMANCE_PROFILE"
 	if [ "$DATA_FILE_NAME" ]; then
 		sed -i "s/51Degrees-LiteV4\.1\.hash/${DATA_FILE_NAME}/g" nginx.conf
 	fi